@@ -0,0 +1,375 @@
+/*
+ * llog-bench: measures the throughput and the latency of the logging macros, from 1 up to N threads, with
+ * different sinks registered, and prints the results as CSV or JSON. Latencies include the cost of reading
+ * the clock twice (tens of nanoseconds).
+ *
+ * Build with (POSIX):
+ *     cc -std=c11 -O2 -pthread -o llog-bench llog-bench.c llog.c
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "llog.h"
+
+#if !defined(LLOG_HAS_THREADS_)
+#  error "llog-bench requires threads."
+#endif
+
+#define MAX_CALLBACKS 63     // the most llog accepts
+
+enum { FORMAT_CSV=0, FORMAT_JSON };
+
+typedef struct {
+    const char *name;
+    int (*setup)(void);
+    void (*teardown)(void);
+} scenario;
+
+typedef struct {
+    pthread_t thread;
+    size_t calls;
+    uint32_t *latencies;        // nanoseconds
+    int status;
+} worker;
+
+static struct {
+    size_t calls;
+    int maxthreads;
+    int format;
+    const char *dir;
+    const char *only;
+    char path[4096];
+    FILE *fp;
+    int ncallbacks;
+    int objs[MAX_CALLBACKS];
+    atomic_bool go;
+    bool first;
+} bench = { .calls = 200000, .maxthreads = 4, .format = FORMAT_CSV, .dir = "/dev/shm", };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage:\n%s [-n calls] [-t threads] [-f csv|json] [-d dir] [-s scenario]\n"
+                    "  -n  calls per thread (default 200000)\n"
+                    "  -t  maximum number of threads, doubled from 1 (default 4)\n"
+                    "  -f  output format (default csv)\n"
+                    "  -d  directory of the files written by the file scenarios, preferably on tmpfs"
+                    " (default /dev/shm)\n"
+                    "  -s  only runs the given scenario\n", prog);
+}
+
+/*
+ * Sinks
+ */
+static void format_callback(llog_event event)
+{
+    char msg[256];
+    vsnprintf(msg, sizeof msg, event.format, event.args);
+}
+
+static int add_callbacks(int n, int level)
+{
+    for (int i = 0; i < n; i++) {
+        int status = llog_add_callback(format_callback, &bench.objs[i], level);
+        if (status) return status;
+        bench.ncallbacks++;
+    }
+    return 0;
+}
+
+static void remove_callbacks(void)
+{
+    for (int i = 0; i < bench.ncallbacks; i++) {
+        llog_remove_callback(format_callback, &bench.objs[i]);
+    }
+    bench.ncallbacks = 0;
+}
+
+static int setup_disabled(void)    { return add_callbacks(1, LLOG_WARN); }
+static int setup_callbacks1(void)  { return add_callbacks(1, LLOG_TRACE); }
+static int setup_callbacks8(void)  { return add_callbacks(8, LLOG_TRACE); }
+static int setup_callbacks63(void) { return add_callbacks(MAX_CALLBACKS, LLOG_TRACE); }
+
+static int set_path(const char *name)
+{
+    int n = snprintf(bench.path, sizeof bench.path, "%s/llog-bench-%ld.%s", bench.dir, (long) getpid(), name);
+    return n < 0 || (size_t) n >= sizeof bench.path ? -EINVAL : 0;
+}
+
+static int open_fp(const char *name, const char *mode)
+{
+    if (set_path(name)) return -EINVAL;
+    bench.fp = fopen(bench.path, mode);
+    return bench.fp ? 0 : -EINVAL;
+}
+
+static void close_fp(void)
+{
+    llog_remove_fp(bench.fp);
+    fclose(bench.fp);
+    unlink(bench.path);
+}
+
+static int setup_fp(void)
+{
+    int status = open_fp("log", "w");
+    if (status) return status;
+    return llog_add_fp(bench.fp, LLOG_TRACE);
+}
+
+static int setup_binary(void)
+{
+    int status = open_fp("bin", "wb");
+    if (status) return status;
+    return llog_add_binary_fp(bench.fp, LLOG_TRACE);
+}
+
+static int setup_file(void)
+{
+    if (set_path("log")) return -EINVAL;
+    llog_file_opts opts = LLOG_FILE_DEFAULTS;
+    opts.truncate = true;
+    return llog_add_file(bench.path, LLOG_TRACE, &opts);
+}
+
+static void teardown_file(void)
+{
+    llog_remove_file(bench.path);
+    unlink(bench.path);
+}
+
+/* The same event written by three text outputs. */
+static struct {
+    FILE *json;
+    char jsonpath[4096];
+    char filepath[4096];
+} text3;
+
+static int setup_text3(void)
+{
+    if (set_path("json")) return -EINVAL;
+    strcpy(text3.jsonpath, bench.path);
+    if (set_path("txt")) return -EINVAL;
+    strcpy(text3.filepath, bench.path);
+    text3.json = fopen(text3.jsonpath, "w");
+    if (!text3.json) return -EINVAL;
+
+    llog_file_opts opts = LLOG_FILE_DEFAULTS;
+    opts.truncate = true;
+    int status = llog_add_json_fp(text3.json, LLOG_TRACE);
+    if (!status) status = llog_add_file(text3.filepath, LLOG_TRACE, &opts);
+    if (!status) status = setup_fp();
+    return status;
+}
+
+static void teardown_text3(void)
+{
+    close_fp();
+    llog_remove_file(text3.filepath);
+    unlink(text3.filepath);
+    llog_remove_fp(text3.json);
+    fclose(text3.json);
+    unlink(text3.jsonpath);
+}
+
+static int setup_mmap(void)
+{
+    if (set_path("ring")) return -EINVAL;
+    return llog_add_mmap(bench.path, 1U << 24, LLOG_TRACE);
+}
+
+static void teardown_mmap(void)
+{
+    llog_remove_mmap(bench.path);
+    unlink(bench.path);
+}
+
+static int setup_async(void)
+{
+    int status = add_callbacks(1, LLOG_TRACE);
+    if (status) return status;
+    return llog_start_async(1U << 14, LLOG_ASYNC_BLOCK);
+}
+
+static void teardown_async(void)
+{
+    llog_stop_async();
+    remove_callbacks();
+}
+
+/* Events are logged at LLOG_INFO, which the callback of "disabled" filters. */
+static const scenario scenarios[] = {
+    { "disabled",     setup_disabled,    remove_callbacks },
+    { "callbacks-1",  setup_callbacks1,  remove_callbacks },
+    { "callbacks-8",  setup_callbacks8,  remove_callbacks },
+    { "callbacks-63", setup_callbacks63, remove_callbacks },
+    { "fp",           setup_fp,          close_fp },
+    { "file",         setup_file,        teardown_file },
+    { "text-3",       setup_text3,       teardown_text3 },
+    { "binary",       setup_binary,      close_fp },
+    { "mmap",         setup_mmap,        teardown_mmap },
+    { "async",        setup_async,       teardown_async },
+};
+
+/*
+ * Measurement
+ */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+    worker *w = arg;
+    while (!atomic_load_explicit(&bench.go, memory_order_acquire))
+        ;
+
+    for (size_t i = 0; i < w->calls; i++) {
+        uint64_t start = now();
+        int status = llog_info("event %zu of %s: %d %.3f", i, "bench", (int) i, 1.5);
+        uint64_t elapsed = now() - start;
+        w->latencies[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+        if (status) w->status = status;
+    }
+    return (void *) 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t n, double p)
+{
+    size_t i = (size_t) (p * (double) (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void report(const char *name, int threads, size_t calls, double seconds, uint32_t *latencies)
+{
+    qsort(latencies, calls, sizeof *latencies, compare);
+    uint32_t p50 = percentile(latencies, calls, 0.50);
+    uint32_t p99 = percentile(latencies, calls, 0.99);
+    uint32_t p999 = percentile(latencies, calls, 0.999);
+    uint32_t max = latencies[calls - 1];
+    double rate = seconds > 0 ? (double) calls / seconds : 0;
+
+    if (bench.format == FORMAT_JSON) {
+        printf("%s\n  {\"scenario\": \"%s\", \"threads\": %d, \"calls\": %zu, \"seconds\": %.6f, "
+               "\"calls_per_sec\": %.0f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+               bench.first ? "" : ",", name, threads, calls, seconds, rate,
+               (unsigned long) p50, (unsigned long) p99, (unsigned long) p999, (unsigned long) max);
+    }
+    else {
+        printf("%s,%d,%zu,%.6f,%.0f,%lu,%lu,%lu,%lu\n", name, threads, calls, seconds, rate,
+               (unsigned long) p50, (unsigned long) p99, (unsigned long) p999, (unsigned long) max);
+    }
+    bench.first = false;
+    fflush(stdout);
+}
+
+static int measure(const scenario *s, int threads)
+{
+    worker workers[threads];
+    size_t total = bench.calls * (size_t) threads;
+    uint32_t *latencies = malloc(total * sizeof *latencies);
+    if (!latencies) {
+        fprintf(stderr, "%s: out of memory\n", s->name);
+        return -1;
+    }
+
+    int status = s->setup();
+    if (status) {
+        fprintf(stderr, "%s: setup failed (%d)\n", s->name, status);
+        s->teardown();
+        free(latencies);
+        return -1;
+    }
+
+    atomic_store(&bench.go, false);
+    int started = 0;
+    for (; started < threads; started++) {
+        workers[started] = (worker){
+            .calls = bench.calls,
+            .latencies = latencies + (size_t) started * bench.calls,
+        };
+        if (pthread_create(&workers[started].thread, (void *) 0, run, &workers[started])) break;
+    }
+    uint64_t start = now();
+    atomic_store_explicit(&bench.go, true, memory_order_release);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, (void *) 0);
+        if (workers[i].status) status = workers[i].status;
+    }
+    /* Asynchronous events are only done once dispatched. */
+    s->teardown();
+    double seconds = (double) (now() - start) / 1e9;
+
+    if (started < threads) {
+        fprintf(stderr, "%s: couldn't create the threads\n", s->name);
+        status = -1;
+    }
+    else if (status) {
+        fprintf(stderr, "%s: logging failed (%d)\n", s->name, status);
+    }
+    else {
+        report(s->name, threads, total, seconds, latencies);
+    }
+    free(latencies);
+    return status ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || !argv[i][1] || argv[i][2] || i + 1 == argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char *arg = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 'n': bench.calls = strtoul(arg, (void *) 0, 10);     break;
+        case 't': bench.maxthreads = atoi(arg);                   break;
+        case 'd': bench.dir = arg;                                break;
+        case 's': bench.only = arg;                               break;
+        case 'f':
+            if (!strcmp(arg, "csv")) bench.format = FORMAT_CSV;
+            else if (!strcmp(arg, "json")) bench.format = FORMAT_JSON;
+            else bench.format = -1;
+            break;
+        default:
+            bench.format = -1;
+            break;
+        }
+    }
+    if (!bench.calls || bench.maxthreads < 1 || bench.format < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    llog_set_quiet(true);
+    bench.first = true;
+    if (bench.format == FORMAT_JSON) printf("[");
+    else printf("scenario,threads,calls,seconds,calls_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof scenarios / sizeof scenarios[0]; i++) {
+        if (bench.only && strcmp(bench.only, scenarios[i].name)) continue;
+        for (int threads = 1;; threads *= 2) {
+            if (threads > bench.maxthreads) threads = bench.maxthreads;
+            if (measure(&scenarios[i], threads)) status = -1;
+            if (threads == bench.maxthreads) break;
+        }
+    }
+
+    if (bench.format == FORMAT_JSON) printf("\n]\n");
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,437 @@
+/*
+ * llog-decode: converts logs written by llog_add_binary_fp back to the text layout of llog_add_fp, and
+ * recovers the events of ring files written by llog_add_mmap.
+ *
+ * Build with:
+ *     cc -std=c11 -o llog-decode llog-decode.c llog.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "llog.h"
+
+#define LEVEL_STR                                          \
+    (const char *const[]){                                 \
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL", \
+    }
+
+typedef struct {
+    char *file;
+    char *func;
+    char *format;
+    unsigned long line;
+} site;
+
+static struct {
+    site *sites;
+    size_t nsites;
+    int level;
+    uint64_t since;
+    uint64_t until;
+    char *msg;
+    size_t msgsize;
+} decoder = { .level = LLOG_TRACE, .until = UINT64_MAX, };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage:\n%s [-l level] [-s seconds] [-u seconds] [file...]\n"
+                    "Decodes binary logs and recovers the events of ring files.\n"
+                    "  -l  only events of this level or above (trace, debug, info, warn, error, fatal)\n"
+                    "  -s  only events logged at or after this time (seconds since the Epoch)\n"
+                    "  -u  only events logged before this time (seconds since the Epoch)\n"
+                    "Reads the standard input if no file is given.\n", prog);
+}
+
+static int parse_level(const char *arg)
+{
+    static const char *const names[] = { "trace", "debug", "info", "warn", "error", "fatal", };
+    for (int i = 0; i < (int) (sizeof names / sizeof names[0]); i++) {
+        if (!strcmp(arg, names[i]) || (arg[0] == '0' + i && !arg[1])) return i;
+    }
+    return -1;
+}
+
+static int parse_time(const char *arg, uint64_t *ns)
+{
+    char *end;
+    double seconds = strtod(arg, &end);
+    if (end == arg || *end || seconds < 0) return -1;
+    *ns = seconds * 1e9 < (double) UINT64_MAX ? (uint64_t) (seconds * 1e9) : UINT64_MAX;
+    return 0;
+}
+
+static void reset_sites(void)
+{
+    for (size_t i = 0; i < decoder.nsites; i++) {
+        free(decoder.sites[i].file);
+        free(decoder.sites[i].func);
+        free(decoder.sites[i].format);
+    }
+    free(decoder.sites);
+    decoder.sites = (void *) 0;
+    decoder.nsites = 0;
+}
+
+static char *read_string(FILE *fp, size_t len)
+{
+    char *str = malloc(len + 1);
+    if (!str) return (void *) 0;
+    if (fread(str, 1, len, fp) != len) {
+        free(str);
+        return (void *) 0;
+    }
+    str[len] = 0;
+    return str;
+}
+
+static void print_prefix(int level, uint64_t ns, const char *file, int filelen, const char *func, int funclen,
+                         unsigned long line)
+{
+    char datefmt[64];
+    time_t seconds = (time_t) (ns / 1000000000U);
+    struct tm tm = *localtime(&seconds);
+
+    datefmt[strftime(datefmt, sizeof datefmt, "%Y-%m-%d %T", &tm)] = 0;
+    printf("%s %-7s [%.*s]:%.*s:%lu: ", datefmt, LEVEL_STR[level], filelen, file, funclen, func, line);
+}
+
+static bool selected(int level, uint64_t ns)
+{
+    return level >= decoder.level && ns >= decoder.since && ns < decoder.until;
+}
+
+/*
+ * Reads the rest of a header whose first 8 bytes (magic and version) are in magic.
+ */
+static int read_header(FILE *fp, const char *name, const unsigned char magic[8])
+{
+    unsigned char header[16];
+    uint32_t bom;
+    const unsigned char sizes[9] = {
+        sizeof(int), sizeof(long), sizeof(long long), sizeof(intmax_t), sizeof(size_t),
+        sizeof(ptrdiff_t), sizeof(double), sizeof(long double), sizeof(void *),
+    };
+
+    if (memcmp(magic, "LLOGBIN", 7) || fread(header, sizeof header, 1, fp) != 1) {
+        fprintf(stderr, "%s: not an llog binary log\n", name);
+        return -1;
+    }
+    memcpy(&bom, header, sizeof bom);
+    if (magic[7] != 1 || bom != 0x01020304UL || memcmp(header + 4, sizes, sizeof sizes)) {
+        fprintf(stderr, "%s: written by an unsupported version or platform\n", name);
+        return -1;
+    }
+    reset_sites();
+    return 0;
+}
+
+static int read_site(FILE *fp, const char *name)
+{
+    unsigned char rec[15];
+    uint16_t filelen, funclen, fmtlen;
+    uint32_t id, line;
+
+    if (fread(rec, sizeof rec, 1, fp) != 1) goto truncated;
+    memcpy(&filelen, rec + 1, 2);
+    memcpy(&id, rec + 3, 4);
+    memcpy(&line, rec + 7, 4);
+    memcpy(&funclen, rec + 11, 2);
+    memcpy(&fmtlen, rec + 13, 2);
+
+    if (id >= decoder.nsites) {
+        size_t n = (size_t) id + 1;
+        site *sites = realloc(decoder.sites, n * sizeof *sites);
+        if (!sites) {
+            fprintf(stderr, "%s: out of memory\n", name);
+            return -1;
+        }
+        memset(sites + decoder.nsites, 0, (n - decoder.nsites) * sizeof *sites);
+        decoder.sites = sites;
+        decoder.nsites = n;
+    }
+    site *s = &decoder.sites[id];
+    free(s->file);
+    free(s->func);
+    free(s->format);
+    s->file = read_string(fp, filelen);
+    s->func = read_string(fp, funclen);
+    s->format = read_string(fp, fmtlen);
+    s->line = line;
+    if (!s->file || !s->func || !s->format) goto truncated;
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated site record\n", name);
+    return -1;
+}
+
+static int read_event(FILE *fp, const char *name)
+{
+    unsigned char rec[15];
+    static unsigned char args[UINT16_MAX];
+    uint16_t arglen;
+    uint32_t id;
+    uint64_t ns;
+
+    if (fread(rec, sizeof rec, 1, fp) != 1) goto truncated;
+    memcpy(&arglen, rec + 1, 2);
+    memcpy(&id, rec + 3, 4);
+    memcpy(&ns, rec + 7, 8);
+    if (fread(args, 1, arglen, fp) != arglen) goto truncated;
+
+    int level = rec[0];
+    if (level > LLOG_FATAL || id >= decoder.nsites || !decoder.sites[id].format) {
+        fprintf(stderr, "%s: event refers to an unknown site (%lu)\n", name, (unsigned long) id);
+        return -1;
+    }
+    if (!selected(level, ns)) return 0;
+
+    site *s = &decoder.sites[id];
+    int n = llog_format_packed(decoder.msg, decoder.msgsize, s->format, args, arglen);
+    if (n >= 0 && (size_t) n >= decoder.msgsize) {
+        char *msg = realloc(decoder.msg, (size_t) n + 1);
+        if (!msg) {
+            fprintf(stderr, "%s: out of memory\n", name);
+            return -1;
+        }
+        decoder.msg = msg;
+        decoder.msgsize = (size_t) n + 1;
+        n = llog_format_packed(decoder.msg, decoder.msgsize, s->format, args, arglen);
+    }
+    if (n < 0) {
+        fprintf(stderr, "%s: arguments don't match the format of %s:%lu\n", name, s->file, s->line);
+        return -1;
+    }
+    print_prefix(level, ns, s->file, (int) strlen(s->file), s->func, (int) strlen(s->func), s->line);
+    fwrite(decoder.msg, 1, (size_t) n, stdout);
+    putchar('\n');
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated event record\n", name);
+    return -1;
+}
+
+static int read_message(FILE *fp, const char *name)
+{
+    unsigned char rec[19];
+    uint16_t msglen, filelen, funclen;
+    uint32_t line;
+    uint64_t ns;
+
+    if (fread(rec, sizeof rec, 1, fp) != 1) goto truncated;
+    memcpy(&msglen, rec + 1, 2);
+    memcpy(&line, rec + 3, 4);
+    memcpy(&ns, rec + 7, 8);
+    memcpy(&filelen, rec + 15, 2);
+    memcpy(&funclen, rec + 17, 2);
+
+    char *file = read_string(fp, filelen);
+    char *func = read_string(fp, funclen);
+    char *msg = read_string(fp, msglen);
+    int level = rec[0];
+    if (!file || !func || !msg) {
+        free(file);
+        free(func);
+        free(msg);
+        goto truncated;
+    }
+    if (level <= LLOG_FATAL && selected(level, ns)) {
+        print_prefix(level, ns, file, filelen, func, funclen, line);
+        puts(msg);
+    }
+    free(file);
+    free(func);
+    free(msg);
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated message record\n", name);
+    return -1;
+}
+
+/*
+ * Prints the complete records of a ring file, oldest first (see the layout in llog.c). Records that a
+ * writer didn't finish are skipped.
+ */
+static int recover(FILE *fp, const char *name)
+{
+    unsigned char header[120];
+    uint32_t version, slotsize, bom;
+    uint64_t nslots, head;
+
+    if (fread(header, sizeof header, 1, fp) != 1) {
+        fprintf(stderr, "%s: truncated ring file\n", name);
+        return -1;
+    }
+    memcpy(&version, header, 4);
+    memcpy(&slotsize, header + 4, 4);
+    memcpy(&nslots, header + 8, 8);
+    memcpy(&bom, header + 16, 4);
+    memcpy(&head, header + 56, 8);
+    if (version != 1 || bom != 0x01020304UL || slotsize < 32 || !nslots || nslots > SIZE_MAX / slotsize) {
+        fprintf(stderr, "%s: written by an unsupported version or platform\n", name);
+        return -1;
+    }
+
+    size_t size = (size_t) nslots * slotsize;
+    unsigned char *slots = malloc(size);
+    if (!slots) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return -1;
+    }
+    if (fread(slots, 1, size, fp) != size) {
+        fprintf(stderr, "%s: truncated ring file\n", name);
+        free(slots);
+        return -1;
+    }
+
+    /* Records are read into rec, unwrapped. */
+    unsigned char *rec = (void *) 0;
+    size_t recsize = 0;
+    size_t skipped = 0;
+    int status = 0;
+    for (uint64_t i = head > nslots ? head - nslots : 0; i < head;) {
+        size_t pos = (size_t) (i % nslots) * slotsize;
+        uint64_t commit;
+        uint32_t len;
+        memcpy(&commit, slots + pos, 8);
+        memcpy(&len, slots + pos + 28, 4);
+        if (commit != i + 1 || !len || len > head - i) {
+            skipped++;
+            i++;
+            continue;
+        }
+
+        size_t reclen = (size_t) len * slotsize;
+        if (reclen > recsize) {
+            unsigned char *r = realloc(rec, reclen);
+            if (!r) {
+                fprintf(stderr, "%s: out of memory\n", name);
+                status = -1;
+                break;
+            }
+            rec = r;
+            recsize = reclen;
+        }
+        size_t first = reclen < size - pos ? reclen : size - pos;
+        memcpy(rec, slots + pos, first);
+        memcpy(rec + first, slots, reclen - first);
+        i += len;
+
+        uint64_t ns;
+        uint32_t line;
+        uint16_t lens[3];
+        memcpy(&ns, rec + 8, 8);
+        memcpy(&line, rec + 16, 4);
+        memcpy(lens, rec + 22, sizeof lens);
+        int level = rec[20];
+        if (level > LLOG_FATAL || 32U + lens[0] + lens[1] + lens[2] > reclen) {
+            skipped += len;
+            continue;
+        }
+        if (!selected(level, ns)) continue;
+
+        const char *file = (const char *) rec + 32;
+        print_prefix(level, ns, file, lens[0], file + lens[0], lens[1], line);
+        fwrite(file + lens[0] + lens[1], 1, lens[2], stdout);
+        putchar('\n');
+    }
+    if (skipped) fprintf(stderr, "%s: skipped %zu incomplete slots\n", name, skipped);
+
+    free(rec);
+    free(slots);
+    return status;
+}
+
+static int decode(FILE *fp, const char *name)
+{
+    unsigned char magic[8];
+    if (fread(magic, sizeof magic, 1, fp) != 1) {
+        fprintf(stderr, "%s: not an llog binary log\n", name);
+        return -1;
+    }
+    if (!memcmp(magic, "LLOGRING", 8)) return recover(fp, name);
+    if (read_header(fp, name, magic)) return -1;
+
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        int status;
+        switch (c) {
+        case 'L':
+            magic[0] = (unsigned char) c;
+            status = fread(magic + 1, 7, 1, fp) == 1 ? read_header(fp, name, magic) : -1;
+            break;
+        case 'S': status = read_site(fp, name);    break;
+        case 'E': status = read_event(fp, name);   break;
+        case 'M': status = read_message(fp, name); break;
+        default:
+            fprintf(stderr, "%s: unknown record type (0x%02x)\n", name, c);
+            status = -1;
+            break;
+        }
+        if (status) return status;
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        }
+        if (i + 1 == argc || argv[i][2]) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char *arg = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 'l':
+            decoder.level = parse_level(arg);
+            if (decoder.level < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            if (parse_time(arg, &decoder.since)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'u':
+            if (parse_time(arg, &decoder.until)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = 0;
+    if (i == argc) {
+        status = decode(stdin, "<stdin>");
+    }
+    for (; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            fprintf(stderr, "%s: couldn't open the file\n", argv[i]);
+            status = -1;
+            continue;
+        }
+        if (decode(fp, argv[i])) status = -1;
+        fclose(fp);
+    }
+
+    reset_sites();
+    free(decoder.msg);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
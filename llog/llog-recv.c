@@ -0,0 +1,279 @@
+/*
+ * llog-recv: receives the log sent by llog_add_socket and prints it, one event per line, to the standard
+ * output. Meant for tests and for checking a deployment, not as a collector.
+ *
+ * Build with:
+ *     cc -std=c11 -o llog-recv llog-recv.c
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 64
+#define MAX_MESSAGE 65536
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t used;
+} client;
+
+static struct {
+    bool octets;              // stream messages are framed by octet counting instead of newlines
+    unsigned long count;      // exits after this many messages, if not 0
+    unsigned long received;
+    int type;
+    client clients[MAX_CLIENTS];
+    size_t nclients;
+} receiver;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage:\n%s [-n count] [-s] address\n"
+                    "Receives the log sent by llog_add_socket and prints one event per line.\n"
+                    "  -n  exits after this many events\n"
+                    "  -s  syslog messages (RFC 5424), framed by octet counting on stream sockets\n"
+                    "The address is unix:PATH, unixgram:PATH, tcp:HOST:PORT or udp:HOST:PORT.\n", prog);
+}
+
+/*
+ * Prints a message, and tells whether the receiver is done.
+ */
+static bool print_message(const char *msg, size_t len)
+{
+    fwrite(msg, 1, len, stdout);
+    putchar('\n');
+    return receiver.count && ++receiver.received >= receiver.count;
+}
+
+/*
+ * Opens the socket at address, bound and listening. Returns its descriptor, or -1.
+ */
+static int listen_at(const char *address)
+{
+    int family = AF_UNSPEC;
+    const char *rest;
+    if (!strncmp(address, "unix:", 5)) {
+        family = AF_UNIX;
+        receiver.type = SOCK_STREAM;
+        rest = address + 5;
+    }
+    else if (!strncmp(address, "unixgram:", 9)) {
+        family = AF_UNIX;
+        receiver.type = SOCK_DGRAM;
+        rest = address + 9;
+    }
+    else if (!strncmp(address, "tcp:", 4)) {
+        receiver.type = SOCK_STREAM;
+        rest = address + 4;
+    }
+    else if (!strncmp(address, "udp:", 4)) {
+        receiver.type = SOCK_DGRAM;
+        rest = address + 4;
+    }
+    else {
+        return -1;
+    }
+
+    int fd = -1;
+    if (family == AF_UNIX) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+        if (!*rest || strlen(rest) >= sizeof addr.sun_path) return -1;
+        strcpy(addr.sun_path, rest);
+        unlink(rest);
+        fd = socket(AF_UNIX, receiver.type, 0);
+        if (fd >= 0 && bind(fd, (struct sockaddr *) &addr, sizeof addr)) {
+            perror(rest);
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        char host[256];
+        const char *colon = strrchr(rest, ':');
+        size_t len = colon ? (size_t) (colon - rest) : 0;
+        if (!colon || !len || len >= sizeof host || !colon[1]) return -1;
+        if (rest[0] == '[' && rest[len - 1] == ']' && len > 2) {
+            rest++;
+            len -= 2;
+        }
+        memcpy(host, rest, len);
+        host[len] = 0;
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = receiver.type, .ai_flags = AI_PASSIVE, };
+        struct addrinfo *list;
+        int error = getaddrinfo(host, colon + 1, &hints, &list);
+        if (error) {
+            fprintf(stderr, "%s: %s\n", address, gai_strerror(error));
+            return -1;
+        }
+        for (struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, 0);
+            if (fd < 0) continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+                perror(address);
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(list);
+    }
+    /* Bursts of datagrams don't wait for the output. */
+    if (fd >= 0 && receiver.type == SOCK_DGRAM) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){ 8 * 1024 * 1024 }, sizeof(int));
+    }
+    if (fd >= 0 && receiver.type == SOCK_STREAM && listen(fd, 16)) {
+        perror(address);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Prints the complete messages buffered for the client, and keeps the rest.
+ */
+static bool print_buffered(client *c)
+{
+    size_t at = 0;
+    bool done = false;
+    while (!done && at < c->used) {
+        if (receiver.octets) {
+            char *end = memchr(c->buf + at, ' ', c->used - at);
+            if (!end) break;
+            size_t len = (size_t) strtoul(c->buf + at, (void *) 0, 10);
+            size_t start = (size_t) (end - c->buf) + 1;
+            if (len > MAX_MESSAGE || c->used - start < len) break;
+            done = print_message(c->buf + start, len);
+            at = start + len;
+        }
+        else {
+            char *newline = memchr(c->buf + at, '\n', c->used - at);
+            if (!newline) break;
+            done = print_message(c->buf + at, (size_t) (newline - (c->buf + at)));
+            at = (size_t) (newline - c->buf) + 1;
+        }
+    }
+    memmove(c->buf, c->buf + at, c->used - at);
+    c->used -= at;
+    return done;
+}
+
+/*
+ * Reads what the client sent. Returns -1 once it is disconnected, 1 if the receiver is done, 0 otherwise.
+ */
+static int read_client(client *c)
+{
+    if (c->used == 2 * MAX_MESSAGE) {
+        fprintf(stderr, "message too long, dropping the connection\n");
+        return -1;
+    }
+    ssize_t n = read(c->fd, c->buf + c->used, 2 * MAX_MESSAGE - c->used);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return -1;
+    c->used += (size_t) n;
+    return print_buffered(c) ? 1 : 0;
+}
+
+static int receive(int fd)
+{
+    static char datagram[MAX_MESSAGE];
+    for (;;) {
+        struct pollfd fds[MAX_CLIENTS + 1] = { { .fd = fd, .events = POLLIN, }, };
+        for (size_t i = 0; i < receiver.nclients; i++) {
+            fds[i + 1] = (struct pollfd){ .fd = receiver.clients[i].fd, .events = POLLIN, };
+        }
+        fflush(stdout);
+        if (poll(fds, receiver.nclients + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        if (fds[0].revents && receiver.type == SOCK_DGRAM) {
+            ssize_t n = recv(fd, datagram, sizeof datagram, 0);
+            if (n >= 0 && print_message(datagram, (size_t) n)) return EXIT_SUCCESS;
+        }
+        else if (fds[0].revents) {
+            int cfd = accept(fd, (void *) 0, (void *) 0);
+            char *buf = cfd >= 0 && receiver.nclients < MAX_CLIENTS ? malloc(2 * MAX_MESSAGE) : (void *) 0;
+            if (buf) {
+                receiver.clients[receiver.nclients++] = (client){ .fd = cfd, .buf = buf, };
+            }
+            else if (cfd >= 0) {
+                close(cfd);
+            }
+        }
+
+        for (size_t i = receiver.nclients; i > 0; i--) {
+            client *c = &receiver.clients[i - 1];
+            if (!fds[i].revents) continue;
+            int status = read_client(c);
+            if (status > 0) return EXIT_SUCCESS;
+            if (status < 0) {
+                close(c->fd);
+                free(c->buf);
+                *c = receiver.clients[--receiver.nclients];
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        }
+        if (argv[i][2]) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        switch (argv[i][1]) {
+        case 'n': {
+            char *end;
+            if (i + 1 == argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            receiver.count = strtoul(argv[++i], &end, 10);
+            if (*end || !receiver.count) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 's':
+            receiver.octets = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = listen_at(argv[i]);
+    if (fd < 0) {
+        fprintf(stderr, "%s: couldn't listen at this address\n", argv[i]);
+        return EXIT_FAILURE;
+    }
+    int status = receive(fd);
+    fflush(stdout);
+    close(fd);
+    return status;
+}
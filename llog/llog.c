@@ -3,70 +3,356 @@
  *
  * TODO:
  *    - Allow compiling without locking (unsynchronized)
- *    - Interface to remove callbacks and file pointers
  */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
 #include "llog.h"
 
-typedef struct {
-    int level;
-    void *logobj;
-    llog_callback cbfunc;
-} callback;
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
+#  include <sched.h>
+#endif
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#  include <unistd.h>
+#  if defined(_POSIX_VERSION)
+#    include <fcntl.h>
+#    include <netdb.h>
+#    include <poll.h>
+#    include <sys/mman.h>
+#    include <sys/socket.h>
+#    include <sys/stat.h>
+#    include <sys/time.h>
+#    include <sys/uio.h>
+#    include <sys/un.h>
+#    define LLOG_POSIX_IO_ 1
+#  endif
+#endif
 
 #define LLOG_MAX_CBS 63U
+#define LLOG_STATS_SLOTS 64U
 #if !defined(CACHELINE_SIZE)
 #  define CACHELINE_SIZE 64U
 #endif
 
-#if __STDC_VERSION__ < 201112L
-typedef unsigned char cacheline_padding_[CACHELINE_SIZE];
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Threading primitives, over C11 threads or POSIX threads.
+ */
+#if defined(USE_C11THREADS_)
+typedef mtx_t llmutex_;
+typedef cnd_t llcond_;
+typedef thrd_t llthread_;
+typedef tss_t llkey_;
+
+static int _mutex_init(llmutex_ *mutex)
+{
+    return mtx_init(mutex, mtx_plain) == thrd_success ? 0 : -ELOCK;
+}
+
+static void _mutex_destroy(llmutex_ *mutex)
+{
+    mtx_destroy(mutex);
+}
+
+static int _mutex_lock(llmutex_ *mutex)
+{
+    return mtx_lock(mutex) == thrd_success ? 0 : -ELOCK;
+}
+
+static int _mutex_unlock(llmutex_ *mutex)
+{
+    return mtx_unlock(mutex) == thrd_success ? 0 : -ELOCK;
+}
+
+static int _cond_init(llcond_ *cond)
+{
+    return cnd_init(cond) == thrd_success ? 0 : -ELOCK;
+}
+
+static void _cond_destroy(llcond_ *cond)
+{
+    cnd_destroy(cond);
+}
+
+static void _cond_signal(llcond_ *cond)
+{
+    cnd_signal(cond);
+}
+
+static void _cond_broadcast(llcond_ *cond)
+{
+    cnd_broadcast(cond);
+}
+
+static void _cond_wait(llcond_ *cond, llmutex_ *mutex)
+{
+    cnd_wait(cond, mutex);
+}
+
+/*
+ * Waits until signaled or the deadline, in nanoseconds since the Epoch (TIME_UTC), or spuriously.
+ */
+static void _cond_timedwait(llcond_ *cond, llmutex_ *mutex, long long deadline)
+{
+    struct timespec ts = { .tv_sec = (time_t) (deadline / 1000000000LL), .tv_nsec = (long) (deadline % 1000000000LL) };
+    cnd_timedwait(cond, mutex, &ts);
+}
+
+static int _thread_create(llthread_ *thread, int (*func)(void *), void *arg)
+{
+    return thrd_create(thread, func, arg) == thrd_success ? 0 : -ENOMEM;
+}
+
+static void _thread_join(llthread_ thread)
+{
+    thrd_join(thread, (void *) 0);
+}
+
+static int _key_create(llkey_ *key, void (*dtor)(void *))
+{
+    return tss_create(key, dtor) == thrd_success ? 0 : -ENOMEM;
+}
+
+static void _key_set(llkey_ key, void *value)
+{
+    tss_set(key, value);
+}
+
+static void _thread_yield(void)
+{
+    thrd_yield();
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+#elif defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
+typedef pthread_mutex_t llmutex_;
+typedef pthread_cond_t llcond_;
+typedef pthread_t llthread_;
+typedef pthread_key_t llkey_;
+
+static int _mutex_init(llmutex_ *mutex)
+{
+    return pthread_mutex_init(mutex, (void *) 0) ? -ELOCK : 0;
+}
+
+static void _mutex_destroy(llmutex_ *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static int _mutex_lock(llmutex_ *mutex)
+{
+    return pthread_mutex_lock(mutex) ? -ELOCK : 0;
+}
+
+static int _mutex_unlock(llmutex_ *mutex)
+{
+    return pthread_mutex_unlock(mutex) ? -ELOCK : 0;
+}
+
+static int _cond_init(llcond_ *cond)
+{
+    return pthread_cond_init(cond, (void *) 0) ? -ELOCK : 0;
+}
+
+static void _cond_destroy(llcond_ *cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+static void _cond_signal(llcond_ *cond)
+{
+    pthread_cond_signal(cond);
+}
+
+static void _cond_broadcast(llcond_ *cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+static void _cond_wait(llcond_ *cond, llmutex_ *mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+/*
+ * Waits until signaled or the deadline, in nanoseconds since the Epoch (CLOCK_REALTIME), or spuriously.
+ */
+static void _cond_timedwait(llcond_ *cond, llmutex_ *mutex, long long deadline)
+{
+    struct timespec ts = { .tv_sec = (time_t) (deadline / 1000000000LL), .tv_nsec = (long) (deadline % 1000000000LL) };
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+struct _thread_start {
+    int (*func)(void *);
+    void *arg;
+};
+
+static void *_thread_trampoline(void *arg)
+{
+    struct _thread_start start = *(struct _thread_start *) arg;
+    free(arg);
+    start.func(start.arg);
+    return (void *) 0;
+}
+
+static int _thread_create(llthread_ *thread, int (*func)(void *), void *arg)
+{
+    struct _thread_start *start = malloc(sizeof *start);
+    if (!start) return -ENOMEM;
+
+    *start = (struct _thread_start){ .func = func, .arg = arg, };
+    if (pthread_create(thread, (void *) 0, _thread_trampoline, start)) {
+        free(start);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void _thread_join(llthread_ thread)
+{
+    pthread_join(thread, (void *) 0);
+}
+
+static int _key_create(llkey_ *key, void (*dtor)(void *))
+{
+    return pthread_key_create(key, dtor) ? -ENOMEM : 0;
+}
+
+static void _key_set(llkey_ key, void *value)
+{
+    pthread_setspecific(key, value);
+}
+
+static void _thread_yield(void)
+{
+    sched_yield();
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
 #endif
 
-static struct {
+/*
+ * A registered output. Sinks are shared by every snapshot of the sink table that contains them, and
+ * are only destroyed when no thread can be dispatching to them anymore (see _llog_synchronize).
+ * Each sink has its own lock, so that a slow sink doesn't stall the others, except for SINK_MMAP and
+ * SINK_SOCKET sinks, which synchronize their writers themselves.
+ */
+enum { SINK_CALLBACK=0, SINK_FP, SINK_FILE, SINK_MMAP, SINK_SOCKET };
 
-#if __STDC_VERSION__ >= 201112L
-    _Alignas(CACHELINE_SIZE) size_t cbidx;
-    int level;
-#  if defined(USE_C11THREADS_)
+typedef struct {
+    atomic_int level;               // can be changed while other threads dispatch to the sink
+    int kind;
+    llog_callback cbfunc;
+    void *logobj;                   // passed to cbfunc
+    void *key;                      // identifies the sink on removal (a path or an address for SINK_FILE,
+                                    // SINK_MMAP and SINK_SOCKET)
+    void (*release)(void *);        // frees logobj, if it is owned by llog
+#if defined(LLOG_HAS_THREADS_)
+    llmutex_ mutex;
+#endif
+    int slot;                       // of the per-thread counters (see _stats_slot_get), -1 if there was none
+    unsigned long long baseevents;  // what the slot counted before the sink got it
+    unsigned long long basebytes;
+    atomic_ullong events;           // statistics of a sink without slot (see llog_get_stats)
+    atomic_ullong bytes;
+    atomic_ullong nanoseconds;
+    atomic_ullong lockwait;
+} sink;
+
+/*
+ * Immutable snapshot of the registered sinks, replaced as a whole on registration and removal.
+ */
+typedef struct {
+    size_t n;
+    sink *sinks[];
+} sinktable;
+
+static void _stdout_callback(llog_event event);
+static void _binary_callback(llog_event event);
+
+static struct {
+    _Alignas(CACHELINE_SIZE) _Atomic(sinktable *) table;
+    atomic_int level;               // read without locking; written locked, with the threshold
+    atomic_bool quiet;
+#if defined(USE_C11THREADS_)
     _Alignas(CACHELINE_SIZE) mtx_t mutex;
-#  elif defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
+#elif defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
     _Alignas(CACHELINE_SIZE) pthread_mutex_t mutex;
-#  else
-    _Alignas(CACHELINE_SIZE) void *lockobj;
-    llog_lock lockfunc;
-#  endif
-    _Alignas(CACHELINE_SIZE) callback cbs[LLOG_MAX_CBS];
-    _Alignas(CACHELINE_SIZE) bool quiet;
-
 #else
-    cacheline_padding_ padding0;
-    size_t cbidx;
-    int level;
-    cacheline_padding_ padding1;
-#  if defined(USE_C11THREADS_)
-    mtx_t mutex;
-#  elif defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
-    pthread_mutex_t mutex;
-#  else
-    void *lockobj;
+    _Alignas(CACHELINE_SIZE) void *lockobj;
     llog_lock lockfunc;
-#  endif
-    cacheline_padding_ padding2;
-    callback cbs[LLOG_MAX_CBS];
-    cacheline_padding_ padding3;
-    bool quiet;
-    cacheline_padding_ padding4;
 #endif
-
-} _llog = { .cbidx = 0,
+    _Alignas(CACHELINE_SIZE) sink stderrsink;
+} _llog = { .table = (void *) 0,
             .level = LLOG_TRACE,
 #if defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
             .mutex = PTHREAD_MUTEX_INITIALIZER,
+            .stderrsink.mutex = PTHREAD_MUTEX_INITIALIZER,
 #elif !defined(USE_C11THREADS_)
             .lockfunc = (void *) 0,
 #endif
+            .stderrsink.cbfunc = _stdout_callback,
+            .stderrsink.slot = 0,
+};
+
+LLOG_LOCAL
+atomic_int _llog_threshold = LLOG_TRACE;
+
+/*
+ * A logger other than the default one (see llog_logger_create). What an event reads comes first, on cache
+ * lines of its own, and the threshold first of all, as the logging macros read it through the opaque type.
+ * The fields are written locked, and the list of the loggers and their parents are read in read sections
+ * (see _read_begin): a logger is only freed once no thread can be dispatching through it.
+ */
+struct llog_logger {
+    _Alignas(CACHELINE_SIZE) atomic_int threshold;
+    atomic_int outputs;             // the threshold without the flight recorder (see _llog_outputs)
+    atomic_bool additive;           // its events also go to the outputs of its parent
+    _Atomic(sinktable *) table;
+    _Atomic(struct llog_logger *) parent;   // null for the default logger
+    _Alignas(CACHELINE_SIZE) int level;     // LLOG_INHERIT, or as set
+    unsigned long id;               // identifies it in the records of the asynchronous mode
+    char *name;
+    _Atomic(struct llog_logger *) next;
 };
 
+static _Atomic(llog_logger *) _llog_loggers;
+
+/*
+ * The threshold without the flight recorder, and the lowest level it records (LLOG_FATAL + 1 when off).
+ */
+static atomic_int _llog_outputs = LLOG_TRACE;
+static atomic_int _llog_recording = LLOG_FATAL + 1;
+
+LLOG_LOCAL
+LLOG_TLS_ unsigned long long _llog_random;
+
+/*
+ * Seeds the sampling generator of the calling thread from its address and the time, through splitmix64 so
+ * that close seeds give unrelated sequences.
+ */
+LLOG_LOCAL
+unsigned long long _llog_seed(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    unsigned long long z = (unsigned long long) (uintptr_t) &_llog_random
+                           ^ ((unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec);
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return _llog_random = z ? z : 1;
+}
+
 #define LLEVEL_STR                                         \
     (const char *const[]){                                 \
     "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL", \
@@ -86,11 +372,13 @@ void _llog_event_context(llog_event [static 1], void *);
 static void _llog_mtx_destroy(void)
 {
     mtx_destroy(&_llog.mutex);
+    mtx_destroy(&_llog.stderrsink.mutex);
 }
 
 static void _llog_mtx_init(void)
 {
     int status = mtx_init(&_llog.mutex, mtx_plain);
+    if (status == thrd_success) status = mtx_init(&_llog.stderrsink.mutex, mtx_plain);
     if (status != thrd_success) {
         fprintf(stderr, "Failed to initialize mutex. Exiting...\n");
         exit(EXIT_FAILURE);
@@ -131,8 +419,16 @@ int llog_set_lock(llog_lock lockfunc, void *lockobj)
 /*-------------------------------------------------------------------------------------------------------------*/
 #endif
 
+static long long _stats_clock(void);
+static void _stats_lockwait(long long start);
+
+/*
+ * The global lock serializes the configuration (registration and removal of sinks, level, quiet mode).
+ * Without threads, it also protects the dispatch, which is otherwise lock-free.
+ */
 static int _lock(void)
 {
+    long long start = _stats_clock();
 #if defined(USE_C11THREADS_)
     call_once(&flag, _llog_mtx_init);
 
@@ -143,9 +439,11 @@ static int _lock(void)
     if (status) return -ELOCK;
 #else
     if (_llog.lockfunc) {
-        return _llog.lockfunc(true, _llog.lockobj);
+        int status = _llog.lockfunc(true, _llog.lockobj);
+        if (status) return status;
     }
 #endif
+    _stats_lockwait(start);
     return 0;
 }
 
@@ -165,133 +463,5457 @@ static int _unlock(void)
     return 0;
 }
 
-static void _stdout_callback(llog_event event)
+static int _sink_lock(sink *s)
 {
-    char datefmt[21];
-    datefmt[strftime(datefmt, sizeof datefmt, "%T", event.time)] = 0;
-
-#if defined(LLOG_COLOR)
-    fprintf(event.logobj, "%s %s%-7s\x1b[0m \x1b[90m[%s]:%s:%lu:\x1b[0m ", datefmt,
-            LLEVEL_COLOR[event.level], LLEVEL_STR[event.level], event.file, event.func, event.line);
+#if defined(USE_C11THREADS_)
+    if (s == &_llog.stderrsink) call_once(&flag, _llog_mtx_init);
+#endif
+#if defined(LLOG_HAS_THREADS_)
+    return _mutex_lock(&s->mutex);
 #else
-    fprintf(event.logobj, "%s %-7s [%s]:%s:%lu: ", datefmt, LLEVEL_STR[event.level],
-            event.file, event.func, event.line);
+    (void) s;
+    return 0;
 #endif
-
-    vfprintf(event.logobj, event.format, event.args);
-    fputs("\n", event.logobj);
-    fflush(event.logobj);
 }
 
-static void _file_callback(llog_event event)
+static int _sink_unlock(sink *s)
 {
-    char datefmt[64];
-    datefmt[strftime(datefmt, sizeof datefmt, "%Y-%m-%d %T", event.time)] = 0;
-
-    fprintf(event.logobj, "%s %-7s [%s]:%s:%lu: ", datefmt, LLEVEL_STR[event.level],
-            event.file, event.func, event.line);
-    vfprintf(event.logobj, event.format, event.args);
-    fputs("\n", event.logobj);
-    fflush(event.logobj);
+#if defined(LLOG_HAS_THREADS_)
+    return _mutex_unlock(&s->mutex);
+#else
+    (void) s;
+    return 0;
+#endif
 }
 
-LLOG_LOCAL
-void llog_set_quiet(bool quiet)
-{
-    _llog.quiet = quiet;
-}
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Per-thread state and read-side synchronization.
+ *
+ * Every thread that logs gets a record, kept in a lock-free list. Records are never freed: when a thread
+ * exits, its record is released and later reused by another thread.
+ *
+ * The sink table is read without locks, in an epoch-based scheme: a reader publishes the global epoch in
+ * its record for as long as it uses a snapshot of the table. A writer replaces the snapshot, increments the
+ * epoch and, before freeing what it replaced, waits for every reader that started in an older epoch
+ * (_llog_synchronize). Without threads, readers and writers just take the global lock.
+ */
+/*
+ * Buffer in which a thread formats messages (see _llog_format).
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    bool busy;                      // a message in it is being dispatched
+} msgarena;
 
-LLOG_LOCAL
-int llog_set_level(int level)
-{
-    switch(level) {
-    case LLOG_TRACE:
-    case LLOG_DEBUG:
-    case LLOG_INFO:
-    case LLOG_WARN:
-    case LLOG_ERROR:
-    case LLOG_FATAL:
-        _llog.level = level;
-        return 0;
-    default:
-        return -EINVAL;
-    }
-}
+/*
+ * Counters of the events of a thread (see llog_get_stats), only written by the thread.
+ */
+typedef struct {
+    atomic_ullong events[LLOG_FATAL + 1];
+    atomic_ullong filtered;
+    atomic_ullong limited;
+    atomic_ullong lockwait;         // nanoseconds waiting for the global lock
+    atomic_ullong sinkevents[LLOG_STATS_SLOTS];     // events the thread passed to the sink of each slot
+    atomic_ullong sinkbytes[LLOG_STATS_SLOTS];
+} counters;
 
-// TODO: expose an interface to remove callbacks and file pointers.
-LLOG_LOCAL
-int llog_add_callback(llog_callback logfunc, void *logobj, int level)
-{
-    if (!logfunc) return -EINVAL;
-    if (!logobj) return -EINVAL;
-    switch(level) {
-    default:
-        return -EINVAL;
-    case LLOG_TRACE:
-    case LLOG_DEBUG:
-    case LLOG_INFO:
-    case LLOG_WARN:
-    case LLOG_ERROR:
-    case LLOG_FATAL:
-        break;
-    }
+#if defined(LLOG_HAS_THREADS_)
+struct ring;
+struct flight;
 
-    int status = _lock();
-    if (status) return status;
+typedef struct tstate {
+    _Alignas(CACHELINE_SIZE) atomic_ulong epoch;    // epoch of the current read section, 0 outside of it
+    struct ring *ring;                              // asynchronous mode buffer
+    msgarena arena;                                 // kept for the next thread that gets the record
+    counters counters;                              // kept too, so that they count exited threads
+    _Atomic(struct flight *) flight;                // flight recorder ring, kept too
+    _Alignas(CACHELINE_SIZE) atomic_bool inuse;
+    struct tstate *next;
+} tstate;
 
-    if (_llog.cbidx == LLOG_MAX_CBS) {
-        status = _unlock();
-        if (status) return status;   /* an error in unlock has precedence here. */
-        return -EOVERFLOW;
-    }
+static struct {
+    _Alignas(CACHELINE_SIZE) atomic_ulong epoch;
+    _Alignas(CACHELINE_SIZE) _Atomic(tstate *) threads;
+    llkey_ key;
+    bool keyok;
+} _llog_threads = { .epoch = 1, };
 
-    _llog.cbs[_llog.cbidx++] = (callback){
-        .cbfunc = logfunc,
-        .level = level,
-        .logobj = logobj,
-    };
+static _Thread_local tstate *_llog_tstate;
 
-    status = _unlock();
-    if (status) return status;
+static void _ring_orphan(struct ring *r);
 
-    return 0;
+static void _tstate_release(void *arg)
+{
+    tstate *t = arg;
+    if (t->ring) _ring_orphan(t->ring);
+    t->ring = (void *) 0;
+    atomic_store_explicit(&t->epoch, 0, memory_order_release);
+    atomic_store_explicit(&t->inuse, false, memory_order_release);
 }
 
-LLOG_LOCAL
-int llog_add_fp(FILE *restrict fp, int level)
+static void _llog_threads_init(void)
 {
-    return llog_add_callback(_file_callback, fp, level);
+    _llog_threads.keyok = !_key_create(&_llog_threads.key, _tstate_release);
 }
 
-#if defined(__GNUC__)
-__attribute__((format(printf, 5, 6)))
-#endif
-LLOG_LOCAL
-int _llog_log(int level, const char *restrict file, const char *restrict func,
-              unsigned long line, const char *restrict format, ...)
+/*
+ * Returns the record of the calling thread, or a null pointer if it couldn't be allocated.
+ */
+static tstate *_llog_thread(void)
 {
-    llog_event event = { .level = level, .file = file, .func = func, .line = line, .format = format, };
+    tstate *t = _llog_tstate;
+    if (t) return t;
 
-    int status = _lock();
-    if (status) return status;
+#if defined(USE_C11THREADS_)
+    static once_flag tflag = ONCE_FLAG_INIT;
+    call_once(&tflag, _llog_threads_init);
+#else
+    static pthread_once_t tflag = PTHREAD_ONCE_INIT;
+    pthread_once(&tflag, _llog_threads_init);
+#endif
+    if (!_llog_threads.keyok) return (void *) 0;
 
-    if (!_llog.quiet && _llog.level <= level) {
-        _llog_event_context(&event, stderr);
-        va_start(event.args, format);
-        _stdout_callback(event);
-        va_end(event.args);
+    for (t = atomic_load_explicit(&_llog_threads.threads, memory_order_acquire); t; t = t->next) {
+        bool inuse = false;
+        if (!atomic_load_explicit(&t->inuse, memory_order_relaxed)
+            && atomic_compare_exchange_strong_explicit(&t->inuse, &inuse, true,
+                                                       memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (!t) {
+        size_t size = (sizeof(tstate) + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+        t = aligned_alloc(CACHELINE_SIZE, size);
+        if (!t) return (void *) 0;
+        memset(t, 0, sizeof *t);
+        atomic_init(&t->epoch, 0);
+        atomic_init(&t->inuse, true);
+        t->next = atomic_load_explicit(&_llog_threads.threads, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&_llog_threads.threads, &t->next, t,
+                                                      memory_order_release, memory_order_relaxed))
+            ;
     }
-    for (size_t i = 0; i < _llog.cbidx; i++) {
-        callback cb = _llog.cbs[i];
-        if (cb.level <= level) {
-            _llog_event_context(&event, cb.logobj);
-            va_start(event.args, format);
-            cb.cbfunc(event);
-            va_end(event.args);
+    _key_set(_llog_threads.key, t);
+    return _llog_tstate = t;
+}
+
+/*
+ * Waits until no thread can be using a snapshot replaced before the call. Must not be called
+ * from a read section.
+ */
+static void _llog_synchronize(void)
+{
+    unsigned long epoch = atomic_fetch_add_explicit(&_llog_threads.epoch, 1, memory_order_seq_cst) + 1;
+
+    for (tstate *t = atomic_load_explicit(&_llog_threads.threads, memory_order_acquire); t; t = t->next) {
+        for (;;) {
+            unsigned long e = atomic_load_explicit(&t->epoch, memory_order_seq_cst);
+            if (!e || e >= epoch) break;
+            _thread_yield();
         }
     }
+}
+#endif
 
-    status = _unlock();
+/*
+ * Starts a read section and returns the current sink table (null if no sink was registered).
+ */
+static int _read_begin(sinktable **table)
+{
+#if defined(LLOG_HAS_THREADS_)
+    tstate *t = _llog_thread();
+    if (!t) return -ENOMEM;
+    atomic_store_explicit(&t->epoch, atomic_load_explicit(&_llog_threads.epoch, memory_order_seq_cst),
+                          memory_order_seq_cst);
+#else
+    int status = _lock();
     if (status) return status;
+#endif
+    *table = atomic_load_explicit(&_llog.table, memory_order_seq_cst);
+    return 0;
+}
+
+static int _read_end(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    atomic_store_explicit(&_llog_tstate->epoch, 0, memory_order_release);
+    return 0;
+#else
+    return _unlock();
+#endif
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Statistics.
+ *
+ * The counters of the events are kept in the record of each thread and only written by it, with a relaxed
+ * load and store; llog_get_stats adds up the records. Without threads, a single set of counters is updated
+ * with atomic additions, as the lock set with llog_set_lock doesn't cover them. The events and bytes of a
+ * sink are counted the same way, in a slot of the records that the sink holds while it exists, so that
+ * threads logging to the same sink don't share a cache line; the slot counted for earlier sinks before, which
+ * the sink subtracts. Sinks beyond LLOG_STATS_SLOTS, and timings, are counted with atomic additions on the
+ * sink. Timings take clock readings around the locks and the callbacks, and are only measured when enabled.
+ */
+static atomic_bool _llog_timing;
+
+/*
+ * Slots of the per-thread sink counters in use, the first one by stderr.
+ */
+static atomic_ullong _llog_slots = 1;
+
+/*
+ * Bytes produced by the callback of a sink being called by the thread (see _llog_call).
+ */
+static LLOG_TLS_ unsigned long long _llog_written;
+
+#if !defined(LLOG_HAS_THREADS_)
+static counters _llog_counters_all;
+#endif
+
+static counters *_llog_counters(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    tstate *t = _llog_thread();
+    return t ? &t->counters : (void *) 0;
+#else
+    return &_llog_counters_all;
+#endif
+}
+
+static void _count(atomic_ullong *counter, unsigned long long n)
+{
+#if defined(LLOG_HAS_THREADS_)
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+#else
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+#endif
+}
+
+/*
+ * Returns a monotonic time in nanoseconds, or 0 if timings are disabled.
+ */
+static long long _stats_clock(void)
+{
+    if (!atomic_load_explicit(&_llog_timing, memory_order_relaxed)) return 0;
+    struct timespec ts;
+#if defined(LLOG_POSIX_IO_)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec + 1;
+}
+
+static void _slot_totals(int slot, unsigned long long *events, unsigned long long *bytes)
+{
+    *events = *bytes = 0;
+#if defined(LLOG_HAS_THREADS_)
+    for (tstate *t = atomic_load_explicit(&_llog_threads.threads, memory_order_acquire); t; t = t->next) {
+        *events += atomic_load_explicit(&t->counters.sinkevents[slot], memory_order_relaxed);
+        *bytes += atomic_load_explicit(&t->counters.sinkbytes[slot], memory_order_relaxed);
+    }
+#else
+    *events = atomic_load_explicit(&_llog_counters_all.sinkevents[slot], memory_order_relaxed);
+    *bytes = atomic_load_explicit(&_llog_counters_all.sinkbytes[slot], memory_order_relaxed);
+#endif
+}
+
+/*
+ * Takes a free slot of the per-thread sink counters for s, if there is one.
+ */
+static void _stats_slot_get(sink *s)
+{
+    s->slot = -1;
+    unsigned long long used = atomic_load_explicit(&_llog_slots, memory_order_relaxed);
+    for (int slot = 0; slot < (int) LLOG_STATS_SLOTS;) {
+        if (used & 1ULL << slot) {
+            slot++;
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&_llog_slots, &used, used | 1ULL << slot,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            s->slot = slot;
+            _slot_totals(slot, &s->baseevents, &s->basebytes);
+            return;
+        }
+        slot = 0;
+    }
+}
+
+/*
+ * Must be called once no thread can be dispatching to s anymore.
+ */
+static void _stats_slot_put(sink *s)
+{
+    if (s->slot >= 0) atomic_fetch_and_explicit(&_llog_slots, ~(1ULL << s->slot), memory_order_release);
+}
+
+static void _stats_lockwait(long long start)
+{
+    long long end = start ? _stats_clock() : 0;
+    counters *c = end ? _llog_counters() : (void *) 0;
+    if (c) _count(&c->lockwait, (unsigned long long) (end - start));
+}
+
+LLOG_LOCAL
+void llog_set_stats_timing(bool enabled)
+{
+    atomic_store_explicit(&_llog_timing, enabled, memory_order_relaxed);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Timestamps.
+ *
+ * Each thread caches the broken-down time of the last second it rendered, along with its date and time
+ * text, so that only the fractional part is rendered for the other events of that second.
+ */
+#define LLOG_TIME_SIZE 48U
+
+static atomic_int _llog_timeflags = LLOG_TIME_SECONDS;
+
+typedef struct {
+    bool valid;
+    int flags;
+    time_t second;
+    struct tm tm;
+    size_t datelen;
+    char date[32];                  // up to the seconds
+    char zone[8];                   // ISO 8601 offset
+} timecache;
+
+static LLOG_TLS_ timecache _llog_timecache;
+
+static const timecache *_llog_timecache_for(time_t second, int flags)
+{
+    timecache *c = &_llog_timecache;
+    if (c->valid && c->second == second && c->flags == flags) return c;
+
+    bool utc = flags & LLOG_TIME_UTC;
+    bool iso = flags & LLOG_TIME_ISO8601;
+#if defined(_POSIX_VERSION)
+    c->valid = utc ? gmtime_r(&second, &c->tm) : localtime_r(&second, &c->tm);
+#elif defined(_WIN32)
+    c->valid = !(utc ? gmtime_s(&c->tm, &second) : localtime_s(&c->tm, &second));
+#else
+    c->valid = !_lock();
+    if (c->valid) {
+        struct tm *tm = utc ? gmtime(&second) : localtime(&second);
+        if (tm) c->tm = *tm;
+        c->valid = tm;
+        _unlock();
+    }
+#endif
+    if (!c->valid) c->tm = (struct tm){ .tm_mday = 1, };
+    c->flags = flags;
+    c->second = second;
+    c->datelen = strftime(c->date, sizeof c->date, iso ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &c->tm);
+
+    c->zone[0] = 0;
+    if (iso && utc) {
+        strcpy(c->zone, "Z");
+    }
+    else if (iso && strftime(c->zone, sizeof c->zone, "%z", &c->tm) == 5) {
+        /* +hhmm to +hh:mm */
+        memmove(c->zone + 4, c->zone + 3, 3);
+        c->zone[3] = ':';
+    }
+    return c;
+}
+
+/*
+ * Returns the broken-down time of second for the calling thread, in local time or UTC as configured.
+ * It is valid until the thread's next event.
+ */
+LLOG_LOCAL
+struct tm *_llog_tm(time_t second)
+{
+    return (struct tm *) &_llog_timecache_for(second, atomic_load_explicit(&_llog_timeflags,
+                                                                           memory_order_relaxed))->tm;
+}
+
+/*
+ * Renders ts in the configured format into buf, with its date unless date is false (and the format isn't
+ * ISO 8601), and returns its length.
+ */
+static size_t _llog_time(char buf[static LLOG_TIME_SIZE], const struct timespec *ts, bool date)
+{
+    int flags = atomic_load_explicit(&_llog_timeflags, memory_order_relaxed);
+    const timecache *c = _llog_timecache_for(ts->tv_sec, flags);
+    size_t skip = !date && !(flags & LLOG_TIME_ISO8601) && c->datelen > 8 ? c->datelen - 8 : 0;
+    size_t len = c->datelen - skip;
+
+    memcpy(buf, c->date + skip, len);
+    int digits = (flags & LLOG_TIME_NANOS) * 3;
+    if (digits) {
+        unsigned long fraction = (unsigned long) ts->tv_nsec;
+        for (int i = digits; i < 9; i++) fraction /= 10;
+        buf[len++] = '.';
+        for (int i = digits; i--;) {
+            buf[len + (size_t) i] = (char) ('0' + fraction % 10);
+            fraction /= 10;
+        }
+        len += (size_t) digits;
+    }
+    size_t zonelen = strlen(c->zone);
+    memcpy(buf + len, c->zone, zonelen + 1);
+    return len + zonelen;
+}
+
+LLOG_LOCAL
+int llog_set_time_format(int flags)
+{
+    if (flags & ~(LLOG_TIME_NANOS | LLOG_TIME_UTC | LLOG_TIME_ISO8601)) return -EINVAL;
+    atomic_store_explicit(&_llog_timeflags, flags, memory_order_relaxed);
+    return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Diagnostic context.
+ *
+ * Each thread keeps its context in thread-local storage: its fields point into a buffer of the thread, in
+ * which pushed keys and values are copied back to back, so that pushing and popping only move an index.
+ */
+#if !defined(LLOG_CTX_MAX)
+#  define LLOG_CTX_MAX 8U
+#endif
+#if !defined(LLOG_CTX_SIZE)
+#  define LLOG_CTX_SIZE 256U
+#endif
+#define LLOG_THREAD_NAME_SIZE 32U
+
+typedef struct {
+    llog_context ctx;
+    llog_kv kv[LLOG_CTX_MAX];
+    size_t marks[LLOG_CTX_MAX];     // used before each field was pushed
+    size_t used;
+    char text[LLOG_CTX_SIZE];
+    char name[LLOG_THREAD_NAME_SIZE];
+} threadctx;
+
+static LLOG_TLS_ threadctx _llog_threadctx;
+static atomic_ulong _llog_threadids;
+
+static const llog_context *_llog_context(void)
+{
+    threadctx *t = &_llog_threadctx;
+    if (!t->ctx.id) {
+        t->ctx.id = atomic_fetch_add_explicit(&_llog_threadids, 1, memory_order_relaxed) + 1;
+        t->ctx.kv = t->kv;
+    }
+    return &t->ctx;
+}
+
+LLOG_LOCAL
+int llog_ctx_push(const char *restrict key, const char *restrict value)
+{
+    threadctx *t = &_llog_threadctx;
+    if (!key || !value) return -EINVAL;
+
+    size_t keylen = strlen(key) + 1;
+    size_t valuelen = strlen(value) + 1;
+    if (t->ctx.nkv == LLOG_CTX_MAX || keylen + valuelen > sizeof t->text - t->used) return -EOVERFLOW;
+
+    _llog_context();
+    char *k = t->text + t->used;
+    memcpy(k, key, keylen);
+    memcpy(k + keylen, value, valuelen);
+    t->marks[t->ctx.nkv] = t->used;
+    t->kv[t->ctx.nkv] = LLOG_KV_STR(k, k + keylen);
+    t->used += keylen + valuelen;
+    t->ctx.nkv++;
+    return 0;
+}
+
+LLOG_LOCAL
+int llog_ctx_pop(void)
+{
+    threadctx *t = &_llog_threadctx;
+    if (!t->ctx.nkv) return -EINVAL;
+    t->used = t->marks[--t->ctx.nkv];
+    return 0;
+}
+
+LLOG_LOCAL
+void llog_ctx_clear(void)
+{
+    _llog_threadctx.ctx.nkv = 0;
+    _llog_threadctx.used = 0;
+}
+
+LLOG_LOCAL
+int llog_set_thread_name(const char *name)
+{
+    threadctx *t = &_llog_threadctx;
+    if (!name) {
+        t->ctx.name = (void *) 0;
+        return 0;
+    }
+    size_t len = strlen(name);
+    if (len >= sizeof t->name) len = sizeof t->name - 1;
+    memcpy(t->name, name, len);
+    t->name[len] = 0;
+    t->ctx.name = t->name;
+    return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Text writer and structured fields.
+ *
+ * A writer either fills a buffer like snprintf (counting what doesn't fit), or streams to a file through
+ * its buffer. It escapes strings for JSON, which also makes them unambiguous key="value" pairs in text.
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t used;                    // in buf
+    size_t len;                     // total written
+    FILE *fp;                       // if not null, buf is written to it when full
+} llwriter;
+
+static void _w_put(llwriter *w, const char *s, size_t n)
+{
+    size_t reserve = w->fp ? 0 : 1;    // for the null character
+
+    w->len += n;
+    while (n) {
+        size_t room = w->size > w->used + reserve ? w->size - w->used - reserve : 0;
+        if (!room) {
+            if (!w->fp) return;
+            fwrite(w->buf, 1, w->used, w->fp);
+            w->used = 0;
+            continue;
+        }
+        size_t k = n < room ? n : room;
+        memcpy(w->buf + w->used, s, k);
+        w->used += k;
+        s += k;
+        n -= k;
+    }
+}
+
+static void _w_puts(llwriter *w, const char *s)
+{
+    _w_put(w, s, strlen(s));
+}
+
+/*
+ * Null-terminates the buffer, or writes it to the file.
+ */
+static void _w_end(llwriter *w)
+{
+    if (w->fp) {
+        fwrite(w->buf, 1, w->used, w->fp);
+        w->used = 0;
+    }
+    else if (w->size) {
+        w->buf[w->used] = 0;
+    }
+}
+
+static void _w_escaped(llwriter *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+
+    _w_put(w, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        _w_put(w, run, (size_t) (s - run));
+        run = s + 1;
+        switch (c) {
+        case '"':  _w_put(w, "\\\"", 2); break;
+        case '\\': _w_put(w, "\\\\", 2); break;
+        case '\n': _w_put(w, "\\n", 2);  break;
+        case '\r': _w_put(w, "\\r", 2);  break;
+        case '\t': _w_put(w, "\\t", 2);  break;
+        default:
+            _w_put(w, (const char[]){ '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] }, 6);
+            break;
+        }
+    }
+    _w_put(w, run, (size_t) (s - run));
+    _w_put(w, "\"", 1);
+}
+
+static void _w_value(llwriter *w, const llog_kv *kv, bool json)
+{
+    char num[32];
+    int n = 0;
+
+    switch (kv->type) {
+    case LLOG_KV_TYPE_INT:
+        n = snprintf(num, sizeof num, "%lld", kv->value.i);
+        break;
+    case LLOG_KV_TYPE_UINT:
+        n = snprintf(num, sizeof num, "%llu", kv->value.u);
+        break;
+    case LLOG_KV_TYPE_DOUBLE:
+        if (json && (isnan(kv->value.d) || isinf(kv->value.d))) {
+            _w_puts(w, "null");
+            return;
+        }
+        n = snprintf(num, sizeof num, "%.17g", kv->value.d);
+        break;
+    case LLOG_KV_TYPE_BOOL:
+        _w_puts(w, kv->value.b ? "true" : "false");
+        return;
+    case LLOG_KV_TYPE_STR:
+        if (kv->value.s) _w_escaped(w, kv->value.s);
+        else _w_puts(w, "null");
+        return;
+    default:
+        _w_puts(w, "null");
+        return;
+    }
+    if (n > 0) _w_put(w, num, (size_t) n < sizeof num ? (size_t) n : sizeof num - 1);
+}
+
+/*
+ * Writes the fields as ' key="value"' pairs (as JSON members, each preceded by a comma, if json is true).
+ */
+static void _w_fields(llwriter *w, const llog_kv *kv, size_t n, bool json)
+{
+    for (size_t i = 0; i < n; i++) {
+        const char *key = kv[i].key ? kv[i].key : "";
+        if (json) {
+            _w_put(w, ",", 1);
+            _w_escaped(w, key);
+            _w_put(w, ":", 1);
+        }
+        else {
+            _w_put(w, " ", 1);
+            _w_puts(w, key);
+            _w_put(w, "=", 1);
+        }
+        _w_value(w, &kv[i], json);
+    }
+}
+
+/*
+ * Writes the name of the thread and the context fields, then the fields of the event. JSON also gets the
+ * number of the thread.
+ */
+static void _w_event_fields(llwriter *w, const llog_event *event, bool json)
+{
+    const llog_context *ctx = event->ctx;
+    if (ctx) {
+        if (json) {
+            char num[32];
+            int n = snprintf(num, sizeof num, ",\"tid\":%lu", ctx->id);
+            _w_put(w, num, (size_t) n);
+        }
+        if (ctx->name) _w_fields(w, &LLOG_KV_STR("thread", ctx->name), 1, json);
+        _w_fields(w, ctx->kv, ctx->nkv, json);
+    }
+    _w_fields(w, event->kv, event->nkv, json);
+}
+
+static bool _llog_has_fields(const llog_event *event)
+{
+    return event->nkv || (event->ctx && (event->ctx->name || event->ctx->nkv));
+}
+
+/*
+ * Writes the context and the fields of an event in text into buf, and returns their length like snprintf.
+ */
+static size_t _llog_fields(char *restrict buf, size_t size, const llog_event *event)
+{
+    llwriter w = { .buf = buf, .size = size, };
+    _w_event_fields(&w, event, false);
+    _w_end(&w);
+    return w.len;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * The line is assembled in a buffer around the formatted message, and usually written with a single fwrite,
+ * so that the stream is locked once per event.
+ */
+#define LLOG_LINE_SIZE 1024U
+
+static void _text_line(llog_event *event, const char *prefix, int n)
+{
+    char buf[LLOG_LINE_SIZE];
+    llwriter w = { .buf = buf, .size = sizeof buf, .fp = event->logobj, };
+
+    if (n > 0) _w_put(&w, prefix, (size_t) n < LLOG_LINE_SIZE ? (size_t) n : LLOG_LINE_SIZE - 1);
+    _w_put(&w, event->msg ? event->msg : "", event->msg ? event->msglen : 0);
+    if (_llog_has_fields(event)) _w_event_fields(&w, event, false);
+    _w_put(&w, "\n", 1);
+    _w_end(&w);
+    fflush(event->logobj);
+    _llog_written += w.len;
+}
+
+static void _stdout_callback(llog_event event)
+{
+    char datefmt[LLOG_TIME_SIZE];
+    char prefix[LLOG_LINE_SIZE];
+    _llog_time(datefmt, &event.stamp, false);
+
+#if defined(LLOG_COLOR)
+    int n = snprintf(prefix, sizeof prefix, "%s %s%-7s\x1b[0m \x1b[90m[%s]:%s:%lu:\x1b[0m ", datefmt,
+                     LLEVEL_COLOR[event.level], LLEVEL_STR[event.level], event.file, event.func, event.line);
+#else
+    int n = snprintf(prefix, sizeof prefix, "%s %-7s [%s]:%s:%lu: ", datefmt, LLEVEL_STR[event.level],
+                     event.file, event.func, event.line);
+#endif
+    _text_line(&event, prefix, n);
+}
+
+static void _file_callback(llog_event event)
+{
+    char datefmt[LLOG_TIME_SIZE];
+    char prefix[LLOG_LINE_SIZE];
+    _llog_time(datefmt, &event.stamp, true);
+
+    int n = snprintf(prefix, sizeof prefix, "%s %-7s [%s]:%s:%lu: ", datefmt, LLEVEL_STR[event.level],
+                     event.file, event.func, event.line);
+    _text_line(&event, prefix, n);
+}
+
+/*
+ * Configuration.
+ *
+ * The levels and the quiet flag are atomics, read with relaxed loads by the logging threads, so that they
+ * can be changed at any time without pausing them. Writers take the global lock, only to keep the threshold
+ * consistent with what they wrote.
+ */
+static bool _stderr_accepts(int level)
+{
+    return !atomic_load_explicit(&_llog.quiet, memory_order_relaxed)
+           && atomic_load_explicit(&_llog.level, memory_order_relaxed) <= level;
+}
+
+static bool _sink_accepts(sink *s, int level)
+{
+    return atomic_load_explicit(&s->level, memory_order_relaxed) <= level;
+}
+
+static bool _valid_level(int level)
+{
+    return level >= LLOG_TRACE && level <= LLOG_FATAL;
+}
+
+/*
+ * Returns the lowest level accepted by the sinks of the table, or by threshold if lower.
+ */
+static int _table_threshold(const sinktable *table, int threshold)
+{
+    for (size_t i = 0; table && i < table->n; i++) {
+        int level = atomic_load_explicit(&table->sinks[i]->level, memory_order_relaxed);
+        if (level < threshold) threshold = level;
+    }
+    return threshold;
+}
+
+/*
+ * Level of the logger, or the one it inherits. Must be called locked.
+ */
+static int _logger_level(const llog_logger *logger)
+{
+    for (; logger; logger = atomic_load_explicit(&logger->parent, memory_order_relaxed)) {
+        if (logger->level != LLOG_INHERIT) return logger->level;
+    }
+    return LLOG_TRACE;
+}
+
+/*
+ * Lowest level accepted by the outputs an event of the logger reaches, given the one of the default logger.
+ * Must be called locked.
+ */
+static int _logger_reach(const llog_logger *logger, int outputs)
+{
+    if (!logger) return outputs;
+    int parent = atomic_load_explicit(&logger->additive, memory_order_relaxed)
+                 ? _logger_reach(atomic_load_explicit(&logger->parent, memory_order_relaxed), outputs)
+                 : LLOG_FATAL + 1;
+    return _table_threshold(atomic_load_explicit(&logger->table, memory_order_relaxed), parent);
+}
+
+/*
+ * Must be called locked.
+ */
+static void _llog_update_threshold(void)
+{
+    sinktable *table = atomic_load_explicit(&_llog.table, memory_order_relaxed);
+    int threshold = atomic_load_explicit(&_llog.quiet, memory_order_relaxed)
+                    ? LLOG_FATAL + 1 : atomic_load_explicit(&_llog.level, memory_order_relaxed);
+
+    threshold = _table_threshold(table, threshold);
+    int recording = atomic_load_explicit(&_llog_recording, memory_order_relaxed);
+    atomic_store_explicit(&_llog_outputs, threshold, memory_order_relaxed);
+    atomic_store_explicit(&_llog_threshold, recording < threshold ? recording : threshold, memory_order_relaxed);
+
+    for (llog_logger *logger = atomic_load_explicit(&_llog_loggers, memory_order_relaxed); logger;
+         logger = atomic_load_explicit(&logger->next, memory_order_relaxed)) {
+        int level = _logger_level(logger);
+        int outputs = _logger_reach(logger, threshold);
+        if (level > outputs) outputs = level;
+        atomic_store_explicit(&logger->outputs, outputs, memory_order_relaxed);
+        atomic_store_explicit(&logger->threshold, recording < outputs ? recording : outputs, memory_order_relaxed);
+    }
+}
+
+LLOG_LOCAL
+int llog_set_quiet(bool quiet)
+{
+    int status = _lock();
+    if (status) return status;
+    atomic_store_explicit(&_llog.quiet, quiet, memory_order_relaxed);
+    _llog_update_threshold();
+    return _unlock();
+}
+
+LLOG_LOCAL
+int llog_set_level(int level)
+{
+    if (!_valid_level(level)) return -EINVAL;
+
+    int status = _lock();
+    if (status) return status;
+    atomic_store_explicit(&_llog.level, level, memory_order_relaxed);
+    _llog_update_threshold();
+    return _unlock();
+}
+
+static void _sink_destroy(sink *s)
+{
+    _stats_slot_put(s);
+#if defined(LLOG_HAS_THREADS_)
+    _mutex_destroy(&s->mutex);
+#endif
+    if (s->release) s->release(s->logobj);
+    free(s);
+}
+
+/*
+ * Sink table of the logger, the default one if it is null.
+ */
+static _Atomic(sinktable *) *_llog_table_of(llog_logger *logger)
+{
+    return logger ? &logger->table : &_llog.table;
+}
+
+/*
+ * Publishes a new snapshot of a sink table and frees the previous one once no thread uses it anymore.
+ * Must be called locked; it is unlocked on return.
+ */
+static int _llog_publish(_Atomic(sinktable *) *at, sinktable *table)
+{
+    sinktable *old = atomic_exchange_explicit(at, table, memory_order_seq_cst);
+    _llog_update_threshold();
+#if defined(LLOG_HAS_THREADS_)
+    int status = _unlock();
+    _llog_synchronize();
+    free(old);
+    return status;
+#else
+    free(old);
+    return _unlock();
+#endif
+}
+
+static int _llog_add_sink(llog_logger *logger, llog_callback logfunc, void *logobj, void *key, int level,
+                          int kind, void (*release)(void *))
+{
+    if (!_valid_level(level)) return -EINVAL;
+
+    sink *s = malloc(sizeof *s);
+    if (!s) return -ENOMEM;
+    *s = (sink){
+        .cbfunc = logfunc,
+        .logobj = logobj,
+        .key = key,
+        .kind = kind,
+    };
+    atomic_init(&s->level, level);
+#if defined(LLOG_HAS_THREADS_)
+    if (_mutex_init(&s->mutex)) {
+        free(s);
+        return -ELOCK;
+    }
+#endif
+    _stats_slot_get(s);
+
+    int status = _lock();
+    if (status) {
+        _sink_destroy(s);
+        return status;
+    }
+
+    sinktable *old = atomic_load_explicit(_llog_table_of(logger), memory_order_relaxed);
+    size_t n = old ? old->n : 0;
+    if (n == LLOG_MAX_CBS) {
+        _sink_destroy(s);
+        status = _unlock();
+        if (status) return status;   /* an error in unlock has precedence here. */
+        return -EOVERFLOW;
+    }
+
+    sinktable *table = malloc(sizeof *table + (n + 1) * sizeof table->sinks[0]);
+    if (!table) {
+        _sink_destroy(s);
+        status = _unlock();
+        if (status) return status;
+        return -ENOMEM;
+    }
+    table->n = n + 1;
+    if (n) memcpy(table->sinks, old->sinks, n * sizeof table->sinks[0]);
+    table->sinks[n] = s;
+
+    /* From now on, the sink owns logobj. */
+    s->release = release;
+    return _llog_publish(_llog_table_of(logger), table);
+}
+
+static bool _sink_matches(const sink *s, llog_callback cbfunc, const void *key, int kind)
+{
+    bool path = kind == SINK_FILE || kind == SINK_MMAP || kind == SINK_SOCKET;
+    return s->kind == kind && (path ? !strcmp(s->key, key) : s->key == key) && (!cbfunc || s->cbfunc == cbfunc);
+}
+
+/*
+ * Sets the level of the sinks of the logger of the given kind matching cbfunc (if not null) and key, like
+ * _llog_remove_sink. Returns how many did. Must be called locked.
+ */
+static size_t _llog_set_level_of(llog_logger *logger, llog_callback cbfunc, const void *key, int kind, int level)
+{
+    sinktable *table = atomic_load_explicit(_llog_table_of(logger), memory_order_relaxed);
+    size_t nset = 0;
+    for (size_t i = 0; table && i < table->n; i++) {
+        if (_sink_matches(table->sinks[i], cbfunc, key, kind)) {
+            atomic_store_explicit(&table->sinks[i]->level, level, memory_order_relaxed);
+            nset++;
+        }
+    }
+    _llog_update_threshold();
+    return nset;
+}
+
+/*
+ * Sets the level of the sinks of the logger (see _llog_set_level_of). Returns -EINVAL if none matched.
+ */
+static int _llog_set_sink_level(llog_logger *logger, llog_callback cbfunc, const void *key, int kind, int level)
+{
+    if (!key || !_valid_level(level)) return -EINVAL;
+    int status = _lock();
+    if (status) return status;
+    size_t nset = _llog_set_level_of(logger, cbfunc, key, kind, level);
+    status = _unlock();
+    if (status) return status;
+    return nset ? 0 : -EINVAL;
+}
+
+/*
+ * Removes the sinks of the given kind matching cbfunc (if not null) and key (compared as strings for
+ * paths). Returns -EINVAL if none did.
+ */
+static int _llog_remove_sink(llog_logger *logger, llog_callback cbfunc, void *key, int kind)
+{
+    int status = _lock();
+    if (status) return status;
+
+    sinktable *old = atomic_load_explicit(_llog_table_of(logger), memory_order_relaxed);
+    size_t n = old ? old->n : 0;
+    sinktable *table = malloc(sizeof *table + n * sizeof table->sinks[0]);
+    if (!table) {
+        status = _unlock();
+        if (status) return status;
+        return -ENOMEM;
+    }
+
+    sink *removed[LLOG_MAX_CBS];
+    size_t nremoved = 0;
+    table->n = 0;
+    for (size_t i = 0; i < n; i++) {
+        sink *s = old->sinks[i];
+        if (_sink_matches(s, cbfunc, key, kind)) {
+            removed[nremoved++] = s;
+        }
+        else {
+            table->sinks[table->n++] = s;
+        }
+    }
+    if (!nremoved) {
+        free(table);
+        status = _unlock();
+        if (status) return status;
+        return -EINVAL;
+    }
+
+    status = _llog_publish(_llog_table_of(logger), table);
+    for (size_t i = 0; i < nremoved; i++) {
+        _sink_destroy(removed[i]);
+    }
+    return status;
+}
+
+LLOG_LOCAL
+int llog_add_callback(llog_callback logfunc, void *logobj, int level)
+{
+    if (!logfunc) return -EINVAL;
+    if (!logobj) return -EINVAL;
+    return _llog_add_sink((void *) 0, logfunc, logobj, logobj, level, SINK_CALLBACK, (void *) 0);
+}
+
+LLOG_LOCAL
+int llog_remove_callback(llog_callback logfunc, void *logobj)
+{
+    if (!logfunc) return -EINVAL;
+    if (!logobj) return -EINVAL;
+    return _llog_remove_sink((void *) 0, logfunc, logobj, SINK_CALLBACK);
+}
+
+LLOG_LOCAL
+int llog_set_callback_level(llog_callback logfunc, void *logobj, int level)
+{
+    if (!logfunc) return -EINVAL;
+    return _llog_set_sink_level((void *) 0, logfunc, logobj, SINK_CALLBACK, level);
+}
+
+LLOG_LOCAL
+int llog_add_fp(FILE *restrict fp, int level)
+{
+    if (!fp) return -EINVAL;
+    return _llog_add_sink((void *) 0, _file_callback, fp, fp, level, SINK_FP, (void *) 0);
+}
+
+LLOG_LOCAL
+int llog_remove_fp(FILE *restrict fp)
+{
+    if (!fp) return -EINVAL;
+    return _llog_remove_sink((void *) 0, (void *) 0, fp, SINK_FP);
+}
+
+LLOG_LOCAL
+int llog_set_fp_level(FILE *restrict fp, int level)
+{
+    return _llog_set_sink_level((void *) 0, (void *) 0, fp, SINK_FP, level);
+}
+
+static void _llog_call(sink *s, llog_event event[static 1], va_list args)
+{
+    bool locked = s->kind != SINK_MMAP && s->kind != SINK_SOCKET;
+    long long start = _stats_clock();
+    if (locked && _sink_lock(s)) return;
+    long long called = start ? _stats_clock() : 0;
+    unsigned long long outer = _llog_written;
+
+    _llog_written = 0;
+    event->logobj = s == &_llog.stderrsink ? stderr : s->logobj;
+    va_copy(event->args, args);
+    s->cbfunc(*event);
+    va_end(event->args);
+
+    long long end = called ? _stats_clock() : 0;
+    counters *c = s->slot >= 0 ? _llog_counters() : (void *) 0;
+    if (c) {
+        _count(&c->sinkevents[s->slot], 1);
+        if (_llog_written) _count(&c->sinkbytes[s->slot], _llog_written);
+    }
+    else {
+        atomic_fetch_add_explicit(&s->events, 1, memory_order_relaxed);
+        if (_llog_written) atomic_fetch_add_explicit(&s->bytes, _llog_written, memory_order_relaxed);
+    }
+    if (end) {
+        atomic_fetch_add_explicit(&s->lockwait, (unsigned long long) (called - start), memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->nanoseconds, (unsigned long long) (end - called), memory_order_relaxed);
+    }
+    _llog_written = outer;
+    if (locked) _sink_unlock(s);
+}
+
+/*
+ * Messages are formatted once per event, for all the sinks, into a buffer of the thread that grows up to
+ * LLOG_ARENA_MAX bytes and is then reused without allocating. Longer messages, and messages of events logged
+ * by a sink while the buffer is in use, get a buffer of their own.
+ */
+#if !defined(LLOG_ARENA_SIZE)
+#  define LLOG_ARENA_SIZE 1024U
+#endif
+#if !defined(LLOG_ARENA_MAX)
+#  define LLOG_ARENA_MAX 65536U
+#endif
+
+enum { MSG_NONE=0, MSG_ARENA, MSG_HEAP };
+
+static msgarena *_llog_arena(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    return &_llog_tstate->arena;
+#else
+    static msgarena arena;
+    return &arena;
+#endif
+}
+
+/*
+ * Sets the message of the event, and returns where it was formatted. Must be called in a read section.
+ */
+static int _llog_format(llog_event event[static 1], va_list args)
+{
+    static const char empty[] = "";
+    msgarena *a = _llog_arena();
+    bool inarena = !a->busy;
+    char *buf = inarena ? a->buf : (void *) 0;
+    size_t size = inarena ? a->size : 0;
+    va_list copy;
+
+    va_copy(copy, args);
+    int n = vsnprintf(buf, size, event->format, copy);
+    va_end(copy);
+    event->msg = empty;
+    event->msglen = 0;
+    if (n < 0) return MSG_NONE;
+
+    if ((size_t) n >= size) {
+        size_t grown = size ? size : LLOG_ARENA_SIZE;
+        while (grown <= (size_t) n) grown *= 2;
+        if (!inarena || grown > LLOG_ARENA_MAX) {
+            inarena = false;
+            buf = malloc((size_t) n + 1);
+            size = (size_t) n + 1;
+        }
+        else if ((buf = realloc(a->buf, grown))) {
+            a->buf = buf;
+            a->size = size = grown;
+        }
+        else {
+            buf = a->buf;
+        }
+        if (!buf) return MSG_NONE;
+        va_copy(copy, args);
+        n = vsnprintf(buf, size, event->format, copy);
+        va_end(copy);
+        if (n < 0) n = 0;
+        if ((size_t) n >= size) n = (int) size - 1;
+    }
+    if (inarena) a->busy = true;
+    event->msg = buf;
+    event->msglen = (size_t) n;
+    return inarena ? MSG_ARENA : MSG_HEAP;
+}
+
+/*
+ * Tells whether a sink of the table accepting the level writes the message. The binary sink can do without it.
+ */
+static bool _table_needs_message(const sinktable *table, int level)
+{
+    for (size_t i = 0; table && i < table->n; i++) {
+        if (_sink_accepts(table->sinks[i], level) && table->sinks[i]->cbfunc != _binary_callback) return true;
+    }
+    return false;
+}
+
+/*
+ * Returns the logger whose sinks an event of the logger reaches after its own, or a null pointer if it
+ * reaches the default logger. Sets *last if it reaches no other.
+ */
+static const llog_logger *_logger_next(const llog_logger *logger, bool *last)
+{
+    *last = !atomic_load_explicit(&logger->additive, memory_order_relaxed);
+    return atomic_load_explicit(&logger->parent, memory_order_acquire);
+}
+
+static bool _llog_needs_message(const llog_logger *logger, const sinktable *table, int level)
+{
+    bool last = false;
+    for (; logger && !last; logger = _logger_next(logger, &last)) {
+        if (_table_needs_message(atomic_load_explicit(&logger->table, memory_order_acquire), level)) return true;
+    }
+    return !last && (_stderr_accepts(level) || _table_needs_message(table, level));
+}
+
+/*
+ * Calls the sinks of the table that accept the level of the event. Returns whether one did.
+ */
+static bool _table_dispatch(const sinktable *table, llog_event event[static 1], va_list args)
+{
+    bool accepted = false;
+    for (size_t i = 0; table && i < table->n; i++) {
+        sink *s = table->sinks[i];
+        if (_sink_accepts(s, event->level)) {
+            _llog_call(s, event, args);
+            accepted = true;
+        }
+    }
+    return accepted;
+}
+
+/*
+ * Writes the event to the sinks of the logger (if not null) and of its ancestors that accept its level, then
+ * to stderr and to the sinks of the table of the default logger unless a logger isn't additive, after
+ * formatting its message if it wasn't already. Must be called in a read section, with event->time already set.
+ */
+static void _llog_dispatch(const llog_logger *logger, const sinktable *table, llog_event event[static 1],
+                           va_list args)
+{
+    int msg = MSG_NONE;
+    if (!event->msg && _llog_needs_message(logger, table, event->level)) {
+        msg = _llog_format(event, args);
+    }
+    event->logger = logger ? logger->name : (void *) 0;
+
+    bool accepted = false;
+    bool last = false;
+    for (; logger && !last; logger = _logger_next(logger, &last)) {
+        if (_table_dispatch(atomic_load_explicit(&logger->table, memory_order_acquire), event, args)) {
+            accepted = true;
+        }
+    }
+    if (!last && _stderr_accepts(event->level)) {
+        _llog_call(&_llog.stderrsink, event, args);
+        accepted = true;
+    }
+    if (!last && _table_dispatch(table, event, args)) accepted = true;
+    counters *c = accepted ? (void *) 0 : _llog_counters();
+    if (c) _count(&c->filtered, 1);
+
+    if (msg == MSG_ARENA) _llog_arena()->busy = false;
+    else if (msg == MSG_HEAP) free((char *) event->msg);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Call sites and deferred formatting.
+ *
+ * Every (file, line, format) triple that reaches the logging functions gets an entry in a fixed-size,
+ * open-addressed table, filled lock-free on first use. The entry caches the argument types expected by
+ * the format string, so that the arguments can be copied into a compact binary buffer (_llog_pack) and
+ * formatted later, possibly by another thread or another program (llog_format_packed).
+ *
+ * Packed arguments have no padding nor tags: each value is stored with the size of its promoted type, in
+ * the order it appears in the format string, and strings are stored as a 16-bit length followed by their
+ * characters (no terminating null). A null string has the length LLOG_PACKED_NULL.
+ */
+#if !defined(LLOG_MAX_SITES)
+#  define LLOG_MAX_SITES 4096U
+#endif
+#if (LLOG_MAX_SITES & (LLOG_MAX_SITES - 1))
+#  error "LLOG_MAX_SITES must be a power of two."
+#endif
+#define LLOG_MAX_ARGS 32U
+#if !defined(LLOG_BINARY_ARGS_SIZE)
+#  define LLOG_BINARY_ARGS_SIZE 1024U
+#endif
+#define LLOG_MAX_SPEC 32U
+#define LLOG_PACKED_NULL 0xffffU
+
+enum { ARG_NONE=-1, ARG_INT=0, ARG_LONG, ARG_LLONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF,
+       ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR };
+
+enum { SITE_EMPTY=0, SITE_BUSY, SITE_READY };
+
+typedef struct {
+    atomic_int state;
+    unsigned long line;
+    const char *file;
+    const char *func;
+    const char *format;
+    int nargs;                              // -1 if the format can't be deferred
+    unsigned char tags[LLOG_MAX_ARGS];
+    unsigned short after[LLOG_MAX_ARGS];    // minimum room needed by the arguments after each one
+    /* Rate limiting and duplicate suppression (see _llog_limit). */
+    atomic_int level;
+    atomic_llong tat;                       // theoretical arrival time of the next event, in ns
+    atomic_ullong lasthash;                 // of the arguments of the last event let through
+    atomic_llong lastns;                    // time of the last event let through
+    atomic_ulong repeats;                   // duplicates of it suppressed since
+    atomic_ulong limited;                   // events suppressed by the rate limit since
+} site;
+
+static site _llog_sites[LLOG_MAX_SITES];
+
+/*
+ * Parses the conversion specification starting right after a '%'. Returns a pointer past it and stores
+ * in tag the type of its argument (ARG_NONE for "%%"), and in stars the number of '*' it has. Returns
+ * a null pointer if it is not supported (positional arguments, %n, wide characters, ...).
+ */
+static const char *_llog_conv(const char *p, int *tag, int *stars)
+{
+    enum { M_NONE, M_HH, M_H, M_L, M_LL, M_J, M_Z, M_T, M_BIGL } mod = M_NONE;
+
+    *stars = 0;
+    if (*p == '%') {
+        *tag = ARG_NONE;
+        return p + 1;
+    }
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        ++*stars;
+        p++;
+    }
+    else {
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            ++*stars;
+            p++;
+        }
+        else {
+            while (*p >= '0' && *p <= '9') p++;
+        }
+    }
+    switch (*p) {
+    case 'h': mod = p[1] == 'h' ? M_HH : M_H; p += 1 + (mod == M_HH); break;
+    case 'l': mod = p[1] == 'l' ? M_LL : M_L; p += 1 + (mod == M_LL); break;
+    case 'j': mod = M_J; p++; break;
+    case 'z': mod = M_Z; p++; break;
+    case 't': mod = M_T; p++; break;
+    case 'L': mod = M_BIGL; p++; break;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        switch (mod) {
+        case M_L:    *tag = ARG_LONG;    break;
+        case M_LL:   *tag = ARG_LLONG;   break;
+        case M_J:    *tag = ARG_INTMAX;  break;
+        case M_Z:    *tag = ARG_SIZE;    break;
+        case M_T:    *tag = ARG_PTRDIFF; break;
+        case M_BIGL: return (void *) 0;
+        default:     *tag = ARG_INT;     break;
+        }
+        break;
+    case 'c':
+        if (mod != M_NONE) return (void *) 0;
+        *tag = ARG_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        *tag = mod == M_BIGL ? ARG_LDOUBLE : ARG_DOUBLE;
+        break;
+    case 's':
+        if (mod != M_NONE) return (void *) 0;
+        *tag = ARG_STR;
+        break;
+    case 'p':
+        if (mod != M_NONE) return (void *) 0;
+        *tag = ARG_PTR;
+        break;
+    default:
+        return (void *) 0;
+    }
+    return p + 1;
+}
+
+static const unsigned char _llog_argsize[] = {
+    [ARG_INT] = sizeof(int), [ARG_LONG] = sizeof(long), [ARG_LLONG] = sizeof(long long),
+    [ARG_INTMAX] = sizeof(intmax_t), [ARG_SIZE] = sizeof(size_t), [ARG_PTRDIFF] = sizeof(ptrdiff_t),
+    [ARG_DOUBLE] = sizeof(double), [ARG_LDOUBLE] = sizeof(long double), [ARG_PTR] = sizeof(void *),
+    [ARG_STR] = sizeof(unsigned short),
+};
+
+static int _llog_parse(const char *restrict format, unsigned char tags[static LLOG_MAX_ARGS])
+{
+    int nargs = 0;
+
+    for (const char *p = format; (p = strchr(p, '%')); ) {
+        int tag, stars;
+        p = _llog_conv(p + 1, &tag, &stars);
+        if (!p) return -1;
+        if (tag == ARG_NONE) continue;
+        if (nargs + stars + 1 > (int) LLOG_MAX_ARGS) return -1;
+        while (stars--) tags[nargs++] = ARG_INT;
+        tags[nargs++] = (unsigned char) tag;
+    }
+    return nargs;
+}
+
+/*
+ * Returns the entry of a call site, or a null pointer if the table is full.
+ */
+static site *_llog_site(const char *restrict file, const char *restrict func, unsigned long line,
+                        const char *restrict format)
+{
+    size_t h = (size_t) (((uintptr_t) format >> 3) ^ line * 0x9e3779b1UL);
+
+    for (size_t probe = 0; probe < LLOG_MAX_SITES; probe++) {
+        site *s = &_llog_sites[(h + probe) & (LLOG_MAX_SITES - 1)];
+        int state = atomic_load_explicit(&s->state, memory_order_acquire);
+
+        if (state == SITE_EMPTY) {
+            if (atomic_compare_exchange_strong_explicit(&s->state, &state, SITE_BUSY,
+                                                        memory_order_acquire, memory_order_acquire)) {
+                s->file = file;
+                s->func = func;
+                s->line = line;
+                s->format = format;
+                s->nargs = _llog_parse(format, s->tags);
+                for (int i = s->nargs - 1, after = 0; i >= 0; i--) {
+                    s->after[i] = (unsigned short) after;
+                    after += _llog_argsize[s->tags[i]];
+                }
+                atomic_store_explicit(&s->state, SITE_READY, memory_order_release);
+                return s;
+            }
+        }
+        while (state == SITE_BUSY) {
+            state = atomic_load_explicit(&s->state, memory_order_acquire);
+        }
+        if (s->format == format && s->line == line && s->file == file) return s;
+    }
+    return (void *) 0;
+}
+
+/*
+ * Copies the arguments described by the site into buf. Strings that don't fit are truncated.
+ * Returns the number of bytes used, or SIZE_MAX if the arguments don't fit in size bytes.
+ */
+static size_t _llog_pack(const site *restrict s, unsigned char *restrict buf, size_t size, va_list args)
+{
+    unsigned char *p = buf;
+    unsigned char *end = buf + size;
+
+#define PACK_(T)                                                    \
+    do {                                                            \
+        T value_ = va_arg(args, T);                                 \
+        if ((size_t) (end - p) < sizeof value_) return SIZE_MAX;    \
+        memcpy(p, &value_, sizeof value_);                          \
+        p += sizeof value_;                                         \
+    } while (0)
+
+    for (int i = 0; i < s->nargs; i++) {
+        switch (s->tags[i]) {
+        case ARG_INT:     PACK_(int);         break;
+        case ARG_LONG:    PACK_(long);        break;
+        case ARG_LLONG:   PACK_(long long);   break;
+        case ARG_INTMAX:  PACK_(intmax_t);    break;
+        case ARG_SIZE:    PACK_(size_t);      break;
+        case ARG_PTRDIFF: PACK_(ptrdiff_t);   break;
+        case ARG_DOUBLE:  PACK_(double);      break;
+        case ARG_LDOUBLE: PACK_(long double); break;
+        case ARG_PTR:     PACK_(void *);      break;
+        case ARG_STR: {
+            const char *str = va_arg(args, const char *);
+            if (end - p < 2) return SIZE_MAX;
+
+            unsigned short len = LLOG_PACKED_NULL;
+            if (str) {
+                size_t n = strlen(str);
+                size_t room = (size_t) (end - p) - 2;
+                room = room > s->after[i] ? room - s->after[i] : 0;
+                if (n > room) n = room;
+                if (n >= LLOG_PACKED_NULL) n = LLOG_PACKED_NULL - 1;
+                len = (unsigned short) n;
+            }
+            memcpy(p, &len, sizeof len);
+            p += sizeof len;
+            if (len != LLOG_PACKED_NULL) {
+                memcpy(p, str, len);
+                p += len;
+            }
+            break;
+        }
+        }
+    }
+#undef PACK_
+    return (size_t) (p - buf);
+}
+
+LLOG_LOCAL
+int llog_format_packed(char *restrict buf, size_t size, const char *restrict format,
+                       const void *restrict args, size_t len)
+{
+    const unsigned char *a = args;
+    const unsigned char *aend = a + len;
+    size_t total = 0;
+    char spec[LLOG_MAX_SPEC + sizeof ".*s"];
+    int star[2];
+
+#define PUT_(PTR, N)                                                           \
+    do {                                                                       \
+        size_t n_ = (N);                                                       \
+        if (total < size) {                                                    \
+            memcpy(buf + total, (PTR), size - total > n_ ? n_ : size - total); \
+        }                                                                      \
+        total += n_;                                                           \
+    } while (0)
+#define TAKE_(T, V)                                                            \
+    do {                                                                       \
+        if ((size_t) (aend - a) < sizeof(T)) return -EINVAL;                   \
+        memcpy(&(V), a, sizeof(T));                                            \
+        a += sizeof(T);                                                        \
+    } while (0)
+#define EMIT_(T)                                                               \
+    do {                                                                       \
+        T value_;                                                              \
+        TAKE_(T, value_);                                                      \
+        char *out_ = total < size ? buf + total : (void *) 0;                  \
+        size_t room_ = total < size ? size - total : 0;                        \
+        int n_ = stars == 0 ? snprintf(out_, room_, spec, value_)              \
+               : stars == 1 ? snprintf(out_, room_, spec, star[0], value_)     \
+               : snprintf(out_, room_, spec, star[0], star[1], value_);        \
+        if (n_ < 0) return n_;                                                 \
+        total += (size_t) n_;                                                  \
+    } while (0)
+
+    const char *p = format;
+    for (const char *q; (q = strchr(p, '%')); ) {
+        PUT_(p, (size_t) (q - p));
+
+        int tag, stars;
+        p = _llog_conv(q + 1, &tag, &stars);
+        if (!p || (size_t) (p - q) > LLOG_MAX_SPEC) return -EINVAL;
+        if (tag == ARG_NONE) {
+            PUT_("%", 1);
+            continue;
+        }
+        memcpy(spec, q, (size_t) (p - q));
+        spec[p - q] = 0;
+        for (int i = 0; i < stars; i++) TAKE_(int, star[i]);
+
+        switch (tag) {
+        case ARG_INT:     EMIT_(int);         break;
+        case ARG_LONG:    EMIT_(long);        break;
+        case ARG_LLONG:   EMIT_(long long);   break;
+        case ARG_INTMAX:  EMIT_(intmax_t);    break;
+        case ARG_SIZE:    EMIT_(size_t);      break;
+        case ARG_PTRDIFF: EMIT_(ptrdiff_t);   break;
+        case ARG_DOUBLE:  EMIT_(double);      break;
+        case ARG_LDOUBLE: EMIT_(long double); break;
+        case ARG_PTR:     EMIT_(void *);      break;
+        case ARG_STR: {
+            unsigned short n;
+            const char *str = "(null)";
+            int prec = 6;
+            TAKE_(unsigned short, n);
+            if (n != LLOG_PACKED_NULL) {
+                if ((size_t) (aend - a) < n) return -EINVAL;
+                str = (const char *) a;
+                prec = n;
+                a += n;
+            }
+            /* The string isn't null terminated: bound it with the precision. */
+            char *dot = strchr(spec, '.');
+            if (dot) {
+                int cap = dot[1] == '*' ? star[--stars] : atoi(dot + 1);
+                if (cap >= 0 && cap < prec) prec = cap;
+                *dot = 0;
+            }
+            else {
+                spec[strlen(spec) - 1] = 0;
+            }
+            strcat(spec, ".*s");
+            char *out = total < size ? buf + total : (void *) 0;
+            size_t room = total < size ? size - total : 0;
+            int k = stars ? snprintf(out, room, spec, star[0], prec, str) : snprintf(out, room, spec, prec, str);
+            if (k < 0) return k;
+            total += (size_t) k;
+            break;
+        }
+        }
+    }
+    PUT_(p, strlen(p));
+#undef EMIT_
+#undef TAKE_
+#undef PUT_
+
+    if (size) buf[total < size ? total : size - 1] = 0;
+    return total > INT_MAX ? -EOVERFLOW : (int) total;
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Binary sink.
+ *
+ * A stream starts with a header and is followed by records, all in the byte order and type sizes of the
+ * writer, which the header describes:
+ *
+ *     header   "LLOGBIN" version:u8 byteorder:u32 sizes:u8[9] pad:u8[3]                        (24 bytes)
+ *     site     'S' pad:u8 filelen:u16 id:u32 line:u32 funclen:u16 fmtlen:u16 file func format  (16 bytes + strings)
+ *     event    'E' level:u8 arglen:u16 id:u32 nanoseconds:u64 args                             (16 bytes + args)
+ *     message  'M' level:u8 msglen:u16 line:u32 nanoseconds:u64 filelen:u16 funclen:u16 file func msg
+ *
+ * A site record is written the first time a call site logs to the stream, and later events refer to it by
+ * its id. Events are timestamped in nanoseconds since the Epoch and carry the packed arguments of their format
+ * (see llog_format_packed). Events whose arguments can't be packed are written preformatted as messages.
+ * A header may appear again later in the stream (e.g., appended by another process), in which case the sites
+ * defined before it are forgotten.
+ */
+#define LLOG_BINARY_VERSION 1U
+#define LLOG_BINARY_BOM 0x01020304UL
+
+typedef struct {
+    FILE *fp;
+    unsigned char defined[LLOG_MAX_SITES / CHAR_BIT];
+} binsink;
+
+static void _binary_header(FILE *fp)
+{
+    unsigned char header[24] = "LLOGBIN";
+    uint32_t bom = LLOG_BINARY_BOM;
+
+    header[7] = LLOG_BINARY_VERSION;
+    memcpy(header + 8, &bom, sizeof bom);
+    memcpy(header + 12, (const unsigned char[]){
+            sizeof(int), sizeof(long), sizeof(long long), sizeof(intmax_t), sizeof(size_t),
+            sizeof(ptrdiff_t), sizeof(double), sizeof(long double), sizeof(void *),
+        }, 9);
+    fwrite(header, sizeof header, 1, fp);
+}
+
+static void _binary_site(binsink *sink, const site *s, uint32_t id)
+{
+    unsigned char rec[16] = { 'S' };
+    uint16_t filelen = (uint16_t) strlen(s->file);
+    uint16_t funclen = (uint16_t) strlen(s->func);
+    uint16_t fmtlen = (uint16_t) strlen(s->format);
+    uint32_t line = (uint32_t) s->line;
+
+    memcpy(rec + 2, &filelen, 2);
+    memcpy(rec + 4, &id, 4);
+    memcpy(rec + 8, &line, 4);
+    memcpy(rec + 12, &funclen, 2);
+    memcpy(rec + 14, &fmtlen, 2);
+    fwrite(rec, sizeof rec, 1, sink->fp);
+    fwrite(s->file, 1, filelen, sink->fp);
+    fwrite(s->func, 1, funclen, sink->fp);
+    fwrite(s->format, 1, fmtlen, sink->fp);
+    sink->defined[id / CHAR_BIT] |= 1U << id % CHAR_BIT;
+}
+
+static void _binary_callback(llog_event event)
+{
+    binsink *sink = event.logobj;
+    unsigned char args[LLOG_BINARY_ARGS_SIZE];
+    const void *packed = event.packed;
+    size_t len = event.packedlen;
+    const char *format = packed ? event.origin : event.format;
+    uint64_t ns = (uint64_t) event.stamp.tv_sec * 1000000000U + (uint64_t) event.stamp.tv_nsec;
+    unsigned char rec[16];
+
+    /* The context and the fields of structured events are only written in text, after the message. */
+    site *s = _llog_has_fields(&event) ? (void *) 0 : _llog_site(event.file, event.func, event.line, format);
+    if (!packed && s && s->nargs >= 0) {
+        len = _llog_pack(s, args, sizeof args, event.args);
+        packed = len == SIZE_MAX ? (void *) 0 : args;
+    }
+
+    if (packed && s) {
+        uint32_t id = (uint32_t) (s - _llog_sites);
+        uint16_t arglen = (uint16_t) len;
+
+        if (!(sink->defined[id / CHAR_BIT] & 1U << id % CHAR_BIT)) {
+            _binary_site(sink, s, id);
+        }
+        rec[0] = 'E';
+        rec[1] = (unsigned char) event.level;
+        memcpy(rec + 2, &arglen, 2);
+        memcpy(rec + 4, &id, 4);
+        memcpy(rec + 8, &ns, 8);
+        fwrite(rec, sizeof rec, 1, sink->fp);
+        fwrite(packed, 1, len, sink->fp);
+        _llog_written += sizeof rec + len;
+    }
+    else {
+        char msg[LLOG_BINARY_ARGS_SIZE];
+        int n = event.msg ? snprintf(msg, sizeof msg, "%s", event.msg)
+              : packed ? llog_format_packed(msg, sizeof msg, format, packed, len)
+              : vsnprintf(msg, sizeof msg, format, event.args);
+        if (n >= 0 && _llog_has_fields(&event)) {
+            size_t k = (size_t) n < sizeof msg ? (size_t) n : sizeof msg - 1;
+            k += _llog_fields(msg + k, sizeof msg - k, &event);
+            n = k < INT_MAX ? (int) k : INT_MAX;
+        }
+        uint16_t msglen = n < 0 ? 0 : (size_t) n < sizeof msg ? (uint16_t) n : sizeof msg - 1;
+        uint16_t filelen = (uint16_t) strlen(event.file);
+        uint16_t funclen = (uint16_t) strlen(event.func);
+        uint32_t line = (uint32_t) event.line;
+
+        rec[0] = 'M';
+        rec[1] = (unsigned char) event.level;
+        memcpy(rec + 2, &msglen, 2);
+        memcpy(rec + 4, &line, 4);
+        memcpy(rec + 8, &ns, 8);
+        fwrite(rec, sizeof rec, 1, sink->fp);
+        fwrite(&filelen, 2, 1, sink->fp);
+        fwrite(&funclen, 2, 1, sink->fp);
+        fwrite(event.file, 1, filelen, sink->fp);
+        fwrite(event.func, 1, funclen, sink->fp);
+        fwrite(msg, 1, msglen, sink->fp);
+        _llog_written += sizeof rec + 4U + filelen + funclen + msglen;
+    }
+    if (event.level >= LLOG_ERROR) fflush(sink->fp);
+}
+
+static int _llog_add_binary_fp(llog_logger *logger, FILE *restrict fp, int level)
+{
+    if (!fp) return -EINVAL;
+    if (level < LLOG_TRACE || level > LLOG_FATAL) return -EINVAL;
+
+    binsink *sink = calloc(1, sizeof *sink);
+    if (!sink) return -ENOMEM;
+    sink->fp = fp;
+    _binary_header(fp);
+
+    int status = _llog_add_sink(logger, _binary_callback, sink, fp, level, SINK_FP, free);
+    if (status) free(sink);
+    return status;
+}
+
+LLOG_LOCAL
+int llog_add_binary_fp(FILE *restrict fp, int level)
+{
+    return _llog_add_binary_fp((void *) 0, fp, level);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * JSON lines sink.
+ */
+static void _json_callback(llog_event event)
+{
+    char out[1024];
+    char num[64];
+    llwriter w = { .buf = out, .size = sizeof out, .fp = event.logobj, };
+
+    int n = snprintf(num, sizeof num, "{\"time\":%lld.%09ld,\"level\":\"", (long long) event.stamp.tv_sec,
+                 (long) event.stamp.tv_nsec);
+    _w_put(&w, num, (size_t) n);
+    _w_puts(&w, LLEVEL_STR[event.level]);
+    _w_puts(&w, "\",\"file\":");
+    _w_escaped(&w, event.file);
+    _w_puts(&w, ",\"func\":");
+    _w_escaped(&w, event.func);
+    n = snprintf(num, sizeof num, ",\"line\":%lu,\"msg\":", event.line);
+    _w_put(&w, num, (size_t) n);
+    _w_escaped(&w, event.msg ? event.msg : "");
+    _w_event_fields(&w, &event, true);
+    _w_put(&w, "}\n", 2);
+    _w_end(&w);
+    _llog_written += w.len;
+
+    if (event.level >= LLOG_ERROR) fflush(event.logobj);
+}
+
+static int _llog_add_json_fp(llog_logger *logger, FILE *restrict fp, int level)
+{
+    if (!fp) return -EINVAL;
+    return _llog_add_sink(logger, _json_callback, fp, fp, level, SINK_FP, (void *) 0);
+}
+
+LLOG_LOCAL
+int llog_add_json_fp(FILE *restrict fp, int level)
+{
+    return _llog_add_json_fp((void *) 0, fp, level);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Gzip compression of rotated files.
+ *
+ * A small DEFLATE encoder, so that llog has no dependency: greedy LZ77 matching over a 32 KiB window with
+ * hash chains, coded with the fixed Huffman codes in a single block. Log files, full of repeated prefixes,
+ * compress about as well as with zlib's fast levels. The output is a regular gzip member.
+ */
+#define GZ_WSIZE 32768U
+#define GZ_HBITS 15U
+#define GZ_MIN_MATCH 3U
+#define GZ_MAX_MATCH 258U
+#define GZ_MAX_CHAIN 32U
+#define GZ_NONE -1LL
+
+typedef struct {
+    FILE *fp;
+    unsigned long long bits;
+    unsigned nbits;
+} gzbits;
+
+static const unsigned short _gz_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const unsigned char _gz_lextra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const unsigned short _gz_dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const unsigned char _gz_dextra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+/*
+ * Appends n bits, least significant first, as DEFLATE packs everything but Huffman codes.
+ */
+static void _gz_put(gzbits *b, unsigned value, unsigned n)
+{
+    b->bits |= (unsigned long long) value << b->nbits;
+    b->nbits += n;
+    while (b->nbits >= 8) {
+        putc((int) (b->bits & 0xFF), b->fp);
+        b->bits >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+/*
+ * Appends a Huffman code, which goes most significant bit first.
+ */
+static void _gz_code(gzbits *b, unsigned code, unsigned n)
+{
+    unsigned reversed = 0;
+    for (unsigned i = 0; i < n; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    _gz_put(b, reversed, n);
+}
+
+static void _gz_symbol(gzbits *b, unsigned symbol)
+{
+    if (symbol < 144)      _gz_code(b, 0x30 + symbol, 8);
+    else if (symbol < 256) _gz_code(b, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) _gz_code(b, symbol - 256, 7);
+    else                   _gz_code(b, 0xC0 + symbol - 280, 8);
+}
+
+static void _gz_match(gzbits *b, unsigned len, unsigned dist)
+{
+    unsigned l = 28;
+    while (_gz_lbase[l] > len) l--;
+    _gz_symbol(b, 257 + l);
+    _gz_put(b, len - _gz_lbase[l], _gz_lextra[l]);
+
+    unsigned d = 29;
+    while (_gz_dbase[d] > dist) d--;
+    _gz_code(b, d, 5);
+    _gz_put(b, dist - _gz_dbase[d], _gz_dextra[d]);
+}
+
+static void _gz_le32(FILE *fp, unsigned long value)
+{
+    for (int i = 0; i < 4; i++) {
+        putc((int) ((value >> (8 * i)) & 0xFF), fp);
+    }
+}
+
+/*
+ * Compresses the file at src into a gzip file at dst. Returns 0 on success, or -ENOMEM or -EIO.
+ */
+static int _gzip(const char *src, const char *dst)
+{
+    typedef struct {
+        unsigned char window[2 * GZ_WSIZE];
+        long long head[1U << GZ_HBITS];     // last position of each hash, GZ_NONE if none
+        long long prev[GZ_WSIZE];           // previous position with the same hash, by position % GZ_WSIZE
+        unsigned long crctable[256];
+    } gzstate;
+
+    gzstate *z = malloc(sizeof *z);
+    if (!z) return -ENOMEM;
+    FILE *in = fopen(src, "rb");
+    FILE *out = in ? fopen(dst, "wb") : (void *) 0;
+    if (!out) {
+        if (in) fclose(in);
+        free(z);
+        return -EIO;
+    }
+
+    for (unsigned long i = 0; i < 256; i++) {
+        unsigned long c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+        }
+        z->crctable[i] = c;
+    }
+    for (size_t i = 0; i < sizeof z->head / sizeof z->head[0]; i++) {
+        z->head[i] = GZ_NONE;
+    }
+
+    /* Header: no name, no time, Unix. */
+    static const unsigned char header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+    fwrite(header, 1, sizeof header, out);
+    gzbits b = { .fp = out };
+    _gz_put(&b, 1, 1);          // last block
+    _gz_put(&b, 1, 2);          // fixed Huffman codes
+
+    unsigned long crc = 0xFFFFFFFFUL;
+    unsigned long long total = 0;
+    long long start = 0;        // position of window[0] in the file
+    long long end = 0;          // position after the last byte read
+    long long pos = 0;
+    bool eof = false;
+    int status = 0;
+
+    for (;;) {
+        if (!eof && end - pos < (long long) GZ_MAX_MATCH) {
+            /* Keeps the last GZ_WSIZE bytes before pos, and fills the rest. */
+            if (pos - start > (long long) GZ_WSIZE) {
+                size_t shift = (size_t) (pos - start) - GZ_WSIZE;
+                memmove(z->window, z->window + shift, (size_t) (end - start) - shift);
+                start += (long long) shift;
+            }
+            size_t used = (size_t) (end - start);
+            size_t n = fread(z->window + used, 1, sizeof z->window - used, in);
+            for (size_t i = 0; i < n; i++) {
+                crc = z->crctable[(crc ^ z->window[used + i]) & 0xFF] ^ (crc >> 8);
+            }
+            end += (long long) n;
+            total += n;
+            if (n < sizeof z->window - used) {
+                eof = true;
+                if (ferror(in)) status = -EIO;
+            }
+        }
+        if (pos >= end) break;
+
+        const unsigned char *p = z->window + (pos - start);
+        size_t avail = (size_t) (end - pos);
+        unsigned bestlen = 0, bestdist = 0;
+        unsigned h = 0;
+        if (avail >= GZ_MIN_MATCH) {
+            h = ((unsigned) p[0] << 10 ^ (unsigned) p[1] << 5 ^ p[2]) & ((1U << GZ_HBITS) - 1);
+            size_t limit = avail < GZ_MAX_MATCH ? avail : GZ_MAX_MATCH;
+            long long cand = z->head[h];
+            for (unsigned chain = 0; cand != GZ_NONE && pos - cand <= (long long) GZ_WSIZE
+                                     && chain < GZ_MAX_CHAIN; chain++) {
+                const unsigned char *q = z->window + (cand - start);
+                unsigned len = 0;
+                while (len < limit && q[len] == p[len]) len++;
+                if (len > bestlen) {
+                    bestlen = len;
+                    bestdist = (unsigned) (pos - cand);
+                    if (len == limit) break;
+                }
+                cand = z->prev[cand % GZ_WSIZE];
+            }
+        }
+
+        unsigned advance = bestlen >= GZ_MIN_MATCH ? bestlen : 1;
+        if (bestlen >= GZ_MIN_MATCH) _gz_match(&b, bestlen, bestdist);
+        else _gz_symbol(&b, p[0]);
+
+        for (unsigned i = 0; i < advance; i++, pos++) {
+            if ((size_t) (end - pos) < GZ_MIN_MATCH) continue;
+            const unsigned char *s = z->window + (pos - start);
+            h = ((unsigned) s[0] << 10 ^ (unsigned) s[1] << 5 ^ s[2]) & ((1U << GZ_HBITS) - 1);
+            z->prev[pos % GZ_WSIZE] = z->head[h];
+            z->head[h] = pos;
+        }
+    }
+
+    _gz_symbol(&b, 256);        // end of block
+    _gz_put(&b, 0, 7);          // pads the last byte
+    _gz_le32(out, crc ^ 0xFFFFFFFFUL);
+    _gz_le32(out, (unsigned long) (total & 0xFFFFFFFFUL));
+
+    if (ferror(out)) status = -EIO;
+    if (fclose(out)) status = -EIO;
+    fclose(in);
+    free(z);
+    return status;
+}
+
+/*
+ * Rotated files are handed over under a temporary name, and a background thread shifts the generations and
+ * compresses them, one rotation at a time and in order. Pending rotations are finished at exit. Without the
+ * thread, the thread that rotated shifts the generations itself but leaves the new one uncompressed, so that
+ * no logging call waits for the compression of a whole file.
+ */
+typedef struct rotation {
+    struct rotation *next;
+    char *pending;                  // the rotated file, under its temporary name
+    char *path;
+    unsigned keep;
+    bool compress;
+} rotation;
+
+#define LLOG_ROTATION_NAME_SIZE 32U
+
+static int _rotation_name(char *buf, const char *path, unsigned generation, bool compressed)
+{
+    return snprintf(buf, strlen(path) + LLOG_ROTATION_NAME_SIZE, "%s.%u%s", path, generation,
+                    compressed ? ".gz" : "");
+}
+
+static void _rotation_run(rotation *r, bool gzip)
+{
+    size_t size = strlen(r->path) + LLOG_ROTATION_NAME_SIZE;
+    char *from = malloc(size);
+    char *to = malloc(size);
+    char *tmp = malloc(size + 4);
+
+    if (from && to && tmp) {
+        /* A generation whose compression failed is kept uncompressed, so both names are shifted. */
+        for (int compressed = 0; compressed <= (int) r->compress; compressed++) {
+            _rotation_name(to, r->path, r->keep, compressed);
+            remove(to);
+            for (unsigned i = r->keep - 1; i > 0; i--) {
+                _rotation_name(from, r->path, i, compressed);
+                _rotation_name(to, r->path, i + 1, compressed);
+                rename(from, to);
+            }
+        }
+        _rotation_name(to, r->path, 1, r->compress && gzip);
+        if (r->compress && gzip) {
+            /* The .gz file only appears complete; if compression fails, the file is kept as it is. */
+            snprintf(tmp, size + 4, "%s.tmp", to);
+            if (!_gzip(r->pending, tmp) && !rename(tmp, to)) {
+                remove(r->pending);
+            }
+            else {
+                remove(tmp);
+                _rotation_name(to, r->path, 1, false);
+                rename(r->pending, to);
+            }
+        }
+        else {
+            rename(r->pending, to);
+        }
+    }
+    free(tmp);
+    free(to);
+    free(from);
+    free(r->pending);
+    free(r->path);
+    free(r);
+}
+
+/*
+ * Runs the rotations of the list, which is last in first out, compressing the rotated files if gzip is set.
+ */
+static void _rotation_run_all(rotation *list, bool gzip)
+{
+    rotation *fifo = (void *) 0;
+    while (list) {
+        rotation *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo) {
+        rotation *next = fifo->next;
+        _rotation_run(fifo, gzip);
+        fifo = next;
+    }
+}
+
+static struct {
+    _Atomic(rotation *) pending;
+#if defined(LLOG_HAS_THREADS_)
+    atomic_bool started;            // the thread was created
+    atomic_bool stopping;           // the exiting thread runs the remaining rotations
+    llmutex_ mutex;
+    llcond_ pushed;
+    llthread_ thread;
+#endif
+} _llog_rotations = { .pending = (void *) 0, };
+
+#if defined(LLOG_HAS_THREADS_)
+static int _llog_rotate_in_background(void *arg)
+{
+    (void) arg;
+    _mutex_lock(&_llog_rotations.mutex);
+    for (;;) {
+        rotation *list = atomic_exchange(&_llog_rotations.pending, (rotation *) 0);
+        if (list) {
+            _mutex_unlock(&_llog_rotations.mutex);
+            _rotation_run_all(list, true);
+            _mutex_lock(&_llog_rotations.mutex);
+            continue;
+        }
+        if (atomic_load(&_llog_rotations.stopping)) break;
+        _cond_wait(&_llog_rotations.pushed, &_llog_rotations.mutex);
+    }
+    _mutex_unlock(&_llog_rotations.mutex);
+    return 0;
+}
+
+static void _llog_rotations_init(void)
+{
+    if (_mutex_init(&_llog_rotations.mutex)) return;
+    if (_cond_init(&_llog_rotations.pushed)) {
+        _mutex_destroy(&_llog_rotations.mutex);
+        return;
+    }
+    if (_thread_create(&_llog_rotations.thread, _llog_rotate_in_background, (void *) 0)) {
+        _cond_destroy(&_llog_rotations.pushed);
+        _mutex_destroy(&_llog_rotations.mutex);
+        return;
+    }
+    atomic_store(&_llog_rotations.started, true);
+}
+#endif
+
+static void _llog_rotation_push(rotation *r)
+{
+#if defined(LLOG_HAS_THREADS_)
+#  if defined(USE_C11THREADS_)
+    static once_flag rflag = ONCE_FLAG_INIT;
+    call_once(&rflag, _llog_rotations_init);
+#  else
+    static pthread_once_t rflag = PTHREAD_ONCE_INIT;
+    pthread_once(&rflag, _llog_rotations_init);
+#  endif
+    if (atomic_load(&_llog_rotations.started) && !atomic_load(&_llog_rotations.stopping)) {
+        r->next = atomic_load_explicit(&_llog_rotations.pending, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak(&_llog_rotations.pending, &r->next, r))
+            ;
+        /* The thread checks for rotations with the mutex held before it waits, so the signal isn't lost. */
+        _mutex_lock(&_llog_rotations.mutex);
+        _cond_signal(&_llog_rotations.pushed);
+        _mutex_unlock(&_llog_rotations.mutex);
+        return;
+    }
+#endif
+    /* Without a thread to hand it over to, the rotation is run right away, after the pending ones. */
+    r->next = atomic_exchange(&_llog_rotations.pending, (rotation *) 0);
+    _rotation_run_all(r, false);
+}
+
+static void _llog_rotations_finish(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    /* The thread finishes the rotations pushed before it is told to stop. */
+    atomic_store(&_llog_rotations.stopping, true);
+    if (atomic_load(&_llog_rotations.started)) {
+        _mutex_lock(&_llog_rotations.mutex);
+        _cond_signal(&_llog_rotations.pushed);
+        _mutex_unlock(&_llog_rotations.mutex);
+        _thread_join(_llog_rotations.thread);
+        atomic_store(&_llog_rotations.started, false);
+    }
+#endif
+    _rotation_run_all(atomic_exchange(&_llog_rotations.pending, (rotation *) 0), true);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Buffered file sinks.
+ *
+ * Lines are formatted straight into a buffer owned by the sink, which is written to the file when the next
+ * line doesn't fit in it, after an event of the flush level (and always after a LLOG_FATAL event), when the
+ * flush interval elapsed, and at exit. A line that doesn't fit is written along with the buffer in a single
+ * writev. With threads, a background thread writes the buffers whose interval elapsed while no event came.
+ */
+#if !defined(LLOG_FILE_SCRATCH_SIZE)
+#  define LLOG_FILE_SCRATCH_SIZE 1024U
+#endif
+#define LLOG_FLUSH_MAX_SLEEP_NS 100000000LL
+
+#if !defined(LLOG_POSIX_IO_)
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+typedef struct {
+    char *path;
+#if defined(LLOG_POSIX_IO_)
+    int fd;
+#else
+    FILE *fp;
+#endif
+    char *buf;
+    size_t size;
+    size_t used;
+    int flushlevel;
+    long long interval;             // nanoseconds, 0 if not flushed periodically
+    long long lastflush;            // nanoseconds since the Epoch
+    long long written;              // size of the file, in bytes
+    long long maxsize;              // bytes, 0 if not rotated by size
+    long long period;               // nanoseconds, 0 if not rotated periodically
+    long long rotateat;             // nanoseconds since the Epoch, LLONG_MAX if not rotated periodically
+    unsigned keep;
+    bool compress;
+} filesink;
+
+static long long _ns(const struct timespec *ts)
+{
+    return (long long) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static long long _now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return _ns(&ts);
+}
+
+/*
+ * Opens the file of the sink, and sets how much it already holds. Returns 0 or -errno.
+ */
+static int _file_open(filesink *f, bool truncate)
+{
+#if defined(LLOG_POSIX_IO_)
+    int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND);
+#  if defined(O_CLOEXEC)
+    flags |= O_CLOEXEC;
+#  endif
+    f->fd = open(f->path, flags, 0666);
+    if (f->fd < 0) return -(errno ? errno : EINVAL);
+    struct stat st;
+    f->written = !truncate && !fstat(f->fd, &st) ? (long long) st.st_size : 0;
+#else
+    f->fp = fopen(f->path, truncate ? "wb" : "ab");
+    if (!f->fp) return -(errno ? errno : EINVAL);
+    setvbuf(f->fp, (void *) 0, _IONBF, 0);
+    long size = !truncate && !fseek(f->fp, 0, SEEK_END) ? ftell(f->fp) : 0;
+    f->written = size > 0 ? size : 0;
+#endif
+    return 0;
+}
+
+static void _file_close(filesink *f)
+{
+#if defined(LLOG_POSIX_IO_)
+    close(f->fd);
+#else
+    if (f->fp) fclose(f->fp);
+#endif
+}
+
+static long long _file_next_rotation(const filesink *f, long long now)
+{
+    return f->period ? (now / f->period + 1) * f->period : LLONG_MAX;
+}
+
+/*
+ * Moves the file aside under a temporary name, reopens a new one in its place, and hands the old one over
+ * for the generations to be shifted (and compressed). Must be called with the sink locked.
+ */
+static void _file_rotate(filesink *f, long long now)
+{
+    rotation *r = malloc(sizeof *r);
+    size_t size = strlen(f->path) + LLOG_ROTATION_NAME_SIZE;
+    char *pending = malloc(size);
+    char *path = malloc(strlen(f->path) + 1);
+    f->rotateat = _file_next_rotation(f, now);
+    if (!r || !pending || !path) goto fail;
+
+    snprintf(pending, size, "%s.%lld.rotating", f->path, _now());
+    strcpy(path, f->path);
+    _file_close(f);
+    if (rename(f->path, pending)) {
+        /* Keeps writing to the same file. */
+        _file_open(f, false);
+        goto fail;
+    }
+    if (_file_open(f, true)) {
+        rename(pending, f->path);
+        _file_open(f, false);
+        goto fail;
+    }
+
+    *r = (rotation){ .pending = pending, .path = path, .keep = f->keep, .compress = f->compress, };
+    _llog_rotation_push(r);
+    return;
+
+fail:
+    free(path);
+    free(pending);
+    free(r);
+}
+
+/*
+ * Writes the iovec array completely, retrying on partial writes. Returns -EIO on failure.
+ */
+static int _file_writev(filesink *f, struct iovec *iov, int n)
+{
+#if defined(LLOG_POSIX_IO_)
+    for (;;) {
+        while (n && !iov->iov_len) {
+            iov++;
+            n--;
+        }
+        if (!n) return 0;
+
+        ssize_t w = writev(f->fd, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -EIO;
+        for (; n && (size_t) w >= iov->iov_len; iov++, n--) {
+            w -= (ssize_t) iov->iov_len;
+        }
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= (size_t) w;
+        }
+    }
+#else
+    if (!f->fp) return -EIO;
+    for (int i = 0; i < n; i++) {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f->fp) != iov[i].iov_len) return -EIO;
+    }
+    return fflush(f->fp) ? -EIO : 0;
+#endif
+}
+
+/*
+ * Writes the buffer and, if not null, the line after it, to a new file if the current one is due for
+ * rotation. The buffer is emptied even on failure. Must be called with the sink locked.
+ */
+static int _file_flush(filesink *f, const char *line, size_t len, long long now)
+{
+    /* Without room for both, the buffer and the line go out separately, each to a file with room for it. */
+    if (line && f->used && f->maxsize && f->written + (long long) (f->used + len) > f->maxsize) {
+        int status = _file_flush(f, (void *) 0, 0, now);
+        int s = _file_flush(f, line, len, now);
+        return status ? status : s;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = f->buf, .iov_len = f->used, },
+        { .iov_base = (char *) line, .iov_len = line ? len : 0, },
+    };
+    long long size = (long long) (iov[0].iov_len + iov[1].iov_len);
+    if (size && ((f->maxsize && f->written && f->written + size > f->maxsize) || now >= f->rotateat)) {
+        _file_rotate(f, now);
+    }
+    f->used = 0;
+    f->lastflush = now;
+    int status = _file_writev(f, iov, 2);
+    if (!status) f->written += size;
+    return status;
+}
+
+/*
+ * Formats the line of an event (without its newline) like _file_callback, the same way snprintf would.
+ */
+static int _file_line(char *restrict buf, size_t size, const llog_event *event)
+{
+    char datefmt[LLOG_TIME_SIZE];
+    char prefix[LLOG_LINE_SIZE];
+    _llog_time(datefmt, &event->stamp, true);
+
+    int n = snprintf(prefix, sizeof prefix, "%s %-7s [%s]:%s:%lu: ", datefmt, LLEVEL_STR[event->level],
+                     event->file, event->func, event->line);
+    if (n < 0) return n;
+
+    llwriter w = { .buf = buf, .size = size, };
+    _w_put(&w, prefix, (size_t) n < sizeof prefix ? (size_t) n : sizeof prefix - 1);
+    _w_put(&w, event->msg ? event->msg : "", event->msg ? event->msglen : 0);
+    if (_llog_has_fields(event)) _w_event_fields(&w, event, false);
+    _w_end(&w);
+    return w.len < INT_MAX ? (int) w.len : -1;
+}
+
+static void _buffered_callback(llog_event event)
+{
+    filesink *f = event.logobj;
+    long long now = _ns(&event.stamp);
+    size_t room = f->size - f->used;
+    int n = _file_line(f->buf ? f->buf + f->used : (void *) 0, room, &event);
+    if (n < 0) return;
+
+    _llog_written += (size_t) n + 1;
+    if ((size_t) n < room) {
+        f->buf[f->used + (size_t) n] = '\n';
+        f->used += (size_t) n + 1;
+        if (event.level >= f->flushlevel || event.level == LLOG_FATAL
+            || (f->interval && now - f->lastflush >= f->interval)) {
+            _file_flush(f, (void *) 0, 0, now);
+        }
+    }
+    else {
+        /* The line (cut off in the buffer) goes out along with the buffered lines. */
+        char scratch[LLOG_FILE_SCRATCH_SIZE];
+        char *line = (size_t) n < sizeof scratch ? scratch : malloc((size_t) n + 1);
+        size_t size = (size_t) n + 1;
+        if (!line) {
+            line = scratch;
+            size = sizeof scratch;
+        }
+        n = _file_line(line, size, &event);
+        if (n >= 0) {
+            size_t len = (size_t) n < size ? (size_t) n : size - 1;
+            line[len] = '\n';
+            _file_flush(f, line, len + 1, now);
+        }
+        if (line != scratch) free(line);
+    }
+}
+
+static void _file_release(void *arg)
+{
+    filesink *f = arg;
+    _file_flush(f, (void *) 0, 0, 0);
+    _file_close(f);
+    free(f->buf);
+    free(f->path);
+    free(f);
+}
+
+static int _socket_flush(void *arg);
+
+/*
+ * Flushes the sinks of a table like _llog_flush_sinks, and lowers *next to the time until the next one is due.
+ */
+static int _table_flush(const sinktable *table, bool all, long long now, long long *next)
+{
+    int status = 0;
+    for (size_t i = 0; table && i < table->n; i++) {
+        sink *s = table->sinks[i];
+        if (all && s->kind == SINK_SOCKET) {
+            if (_socket_flush(s->logobj)) status = -EIO;
+            continue;
+        }
+        if ((s->kind != SINK_FP && s->kind != SINK_FILE) || (!all && s->kind != SINK_FILE)) continue;
+        if (_sink_lock(s)) {
+            status = -ELOCK;
+            continue;
+        }
+        if (s->kind == SINK_FP) {
+            if (fflush(s->key)) status = -EIO;
+        }
+        else {
+            filesink *f = s->logobj;
+            if (all || (f->interval && now - f->lastflush >= f->interval)) {
+                if (f->used && _file_flush(f, (void *) 0, 0, now)) status = -EIO;
+                f->lastflush = now;
+            }
+            if (f->interval && f->lastflush + f->interval - now < *next) {
+                *next = f->lastflush + f->interval - now;
+            }
+        }
+        _sink_unlock(s);
+    }
+    return status;
+}
+
+/*
+ * Writes the buffers of the file sinks of every logger that are due (all of them, the file pointers and the
+ * sockets if all is true). Returns the time until the next one is due, in nanoseconds, or LLONG_MAX if no
+ * sink is flushed periodically.
+ */
+static int _llog_flush_sinks(bool all, long long *next)
+{
+    sinktable *table;
+    int status = _read_begin(&table);
+    if (status) return status;
+
+    long long now = _now();
+    *next = LLONG_MAX;
+    status = _table_flush(table, all, now, next);
+    for (llog_logger *logger = atomic_load_explicit(&_llog_loggers, memory_order_acquire); logger;
+         logger = atomic_load_explicit(&logger->next, memory_order_acquire)) {
+        int s = _table_flush(atomic_load_explicit(&logger->table, memory_order_acquire), all, now, next);
+        if (s && !status) status = s;
+    }
+
+    int end = _read_end();
+    return end ? end : status;
+}
+
+static void _llog_limits_flush(void);
+
+LLOG_LOCAL
+int llog_flush(void)
+{
+    long long next;
+    _llog_limits_flush();
+    return _llog_flush_sinks(true, &next);
+}
+
+static void _llog_reload_if_pending(void);
+
+#if defined(LLOG_HAS_THREADS_)
+/*
+ * The thread sleeps until the next flush is due, or until it is woken: by a new sink, at exit, or by the
+ * signal handler of llog_reload_on_signal. With POSIX, it waits on a pipe, which the handler can write to.
+ * Otherwise it waits on a condition variable, which a handler can't signal, and so checks for a pending
+ * reload at least every LLOG_FLUSH_MAX_SLEEP_NS.
+ */
+static struct {
+    atomic_flag started;
+    atomic_bool running;            // the thread was created, and is joined at exit
+    atomic_bool stopping;
+#if defined(LLOG_POSIX_IO_)
+    int wakefds[2];
+#else
+    bool woken;                     // since the thread last flushed
+    llmutex_ mutex;
+    llcond_ wakeup;
+#endif
+    llthread_ thread;
+} _llog_flusher = { .started = ATOMIC_FLAG_INIT, };
+
+#if defined(LLOG_POSIX_IO_)
+static atomic_int _llog_flusher_wakefd = -1;   // write end of the pipe, once the thread runs
+
+/*
+ * A signal received from now on leaves a wakeup in the pipe for the thread about to be created.
+ */
+static int _llog_flusher_init(void)
+{
+    if (pipe(_llog_flusher.wakefds)) return -(errno ? errno : EIO);
+    for (int i = 0; i < 2; i++) {
+        fcntl(_llog_flusher.wakefds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(_llog_flusher.wakefds[i], F_SETFL, fcntl(_llog_flusher.wakefds[i], F_GETFL) | O_NONBLOCK);
+    }
+    atomic_store_explicit(&_llog_flusher_wakefd, _llog_flusher.wakefds[1], memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * The pipe is left open: a signal handler may still write to it, and the descriptor mustn't be reused.
+ */
+static void _llog_flusher_destroy(void)
+{
+    atomic_store_explicit(&_llog_flusher_wakefd, -1, memory_order_relaxed);
+}
+
+/*
+ * Async-signal-safe. A full pipe already holds a wakeup.
+ */
+static void _llog_wake_flusher(void)
+{
+    int fd = atomic_load_explicit(&_llog_flusher_wakefd, memory_order_relaxed);
+    if (fd < 0) return;
+    int error = errno;
+    ssize_t n = write(fd, "", 1);
+    (void) n;
+    errno = error;
+}
+
+static void _llog_flusher_wait(long long timeout)
+{
+    struct pollfd pfd = { .fd = _llog_flusher.wakefds[0], .events = POLLIN, };
+    int ms = timeout / 1000000LL >= INT_MAX ? -1 : (int) ((timeout + 999999LL) / 1000000LL);
+    if (poll(&pfd, 1, ms) > 0) {
+        char buf[64];
+        while (read(_llog_flusher.wakefds[0], buf, sizeof buf) > 0)
+            ;
+    }
+}
+#else
+static int _llog_flusher_init(void)
+{
+    if (_mutex_init(&_llog_flusher.mutex)) return -ELOCK;
+    if (_cond_init(&_llog_flusher.wakeup)) {
+        _mutex_destroy(&_llog_flusher.mutex);
+        return -ELOCK;
+    }
+    return 0;
+}
+
+static void _llog_flusher_destroy(void)
+{
+    _cond_destroy(&_llog_flusher.wakeup);
+    _mutex_destroy(&_llog_flusher.mutex);
+}
+
+static void _llog_wake_flusher(void)
+{
+    if (!atomic_load_explicit(&_llog_flusher.running, memory_order_acquire)) return;
+    _mutex_lock(&_llog_flusher.mutex);
+    _llog_flusher.woken = true;
+    _cond_signal(&_llog_flusher.wakeup);
+    _mutex_unlock(&_llog_flusher.mutex);
+}
+
+static void _llog_flusher_wait(long long timeout)
+{
+    if (timeout > LLOG_FLUSH_MAX_SLEEP_NS) timeout = LLOG_FLUSH_MAX_SLEEP_NS;
+    long long deadline = _now() + timeout;
+    _mutex_lock(&_llog_flusher.mutex);
+    while (!atomic_load_explicit(&_llog_flusher.stopping, memory_order_acquire) && !_llog_flusher.woken
+           && _now() < deadline) {
+        _cond_timedwait(&_llog_flusher.wakeup, &_llog_flusher.mutex, deadline);
+    }
+    _llog_flusher.woken = false;
+    _mutex_unlock(&_llog_flusher.mutex);
+}
+#endif
+
+static int _llog_flush_periodically(void *arg)
+{
+    (void) arg;
+    while (!atomic_load_explicit(&_llog_flusher.stopping, memory_order_acquire)) {
+        long long next;
+        _llog_reload_if_pending();
+        if (_llog_flush_sinks(false, &next)) next = LLOG_FLUSH_MAX_SLEEP_NS;
+        if (next > 0) _llog_flusher_wait(next);
+    }
+    return 0;
+}
+
+/*
+ * Without it, the flush intervals are only checked when events come. Once started, it is woken so that
+ * it takes the interval of a new sink into account.
+ */
+static void _llog_start_flusher(void)
+{
+    if (!atomic_flag_test_and_set(&_llog_flusher.started)) {
+        if (_llog_flusher_init()) {
+            atomic_flag_clear(&_llog_flusher.started);
+            return;
+        }
+        if (_thread_create(&_llog_flusher.thread, _llog_flush_periodically, (void *) 0)) {
+            _llog_flusher_destroy();
+            atomic_flag_clear(&_llog_flusher.started);
+            return;
+        }
+        atomic_store_explicit(&_llog_flusher.running, true, memory_order_release);
+        return;
+    }
+    _llog_wake_flusher();
+}
+
+static void _llog_stop_flusher(void)
+{
+    if (!atomic_load_explicit(&_llog_flusher.running, memory_order_acquire)) return;
+#if defined(LLOG_POSIX_IO_)
+    atomic_store_explicit(&_llog_flusher.stopping, true, memory_order_release);
+    _llog_wake_flusher();
+#else
+    _mutex_lock(&_llog_flusher.mutex);
+    atomic_store_explicit(&_llog_flusher.stopping, true, memory_order_release);
+    _cond_signal(&_llog_flusher.wakeup);
+    _mutex_unlock(&_llog_flusher.mutex);
+#endif
+    _thread_join(_llog_flusher.thread);
+    atomic_store_explicit(&_llog_flusher.running, false, memory_order_relaxed);
+    _llog_flusher_destroy();
+}
+#endif
+
+static void _llog_files_atexit(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    /* Buffered events first reach the files, which the background thread no longer touches. */
+    llog_stop_async();
+    _llog_stop_flusher();
+#endif
+    llog_flush();
+    _llog_rotations_finish();
+}
+
+static void _llog_register_files_atexit(void)
+{
+    static atomic_flag registered = ATOMIC_FLAG_INIT;
+    if (!atomic_flag_test_and_set(&registered)) {
+        atexit(_llog_files_atexit);
+    }
+}
+
+static int _llog_add_file(llog_logger *logger, const char *restrict path, int level,
+                          const llog_file_opts *restrict opts)
+{
+    const llog_file_opts defaults = LLOG_FILE_DEFAULTS;
+    if (!opts) opts = &defaults;
+    if (!path) return -EINVAL;
+    if (opts->flushlevel < LLOG_TRACE || opts->flushlevel > LLOG_FATAL + 1) return -EINVAL;
+    if (opts->interval > LLONG_MAX / 1000000LL) return -EINVAL;
+    if (opts->period > LLONG_MAX / 1000000000LL || opts->maxsize > LLONG_MAX) return -EINVAL;
+    if ((opts->maxsize || opts->period) && !opts->keep) return -EINVAL;
+
+    /* A full buffer must fit in a file rotated by size. */
+    size_t bufsize = opts->maxsize && opts->bufsize > opts->maxsize ? (size_t) opts->maxsize : opts->bufsize;
+
+    filesink *f = calloc(1, sizeof *f);
+    if (!f) return -ENOMEM;
+    f->path = malloc(strlen(path) + 1);
+    f->buf = bufsize ? malloc(bufsize) : (void *) 0;
+    if (!f->path || (bufsize && !f->buf)) {
+        free(f->buf);
+        free(f->path);
+        free(f);
+        return -ENOMEM;
+    }
+    strcpy(f->path, path);
+    f->size = bufsize;
+    f->flushlevel = opts->flushlevel;
+    f->interval = (long long) opts->interval * 1000000LL;
+    f->lastflush = _now();
+    f->maxsize = (long long) opts->maxsize;
+    f->period = (long long) opts->period * 1000000000LL;
+    f->rotateat = _file_next_rotation(f, f->lastflush);
+    f->keep = opts->keep;
+    f->compress = opts->compress;
+
+    int status = _file_open(f, opts->truncate);
+    if (status) {
+        free(f->buf);
+        free(f->path);
+        free(f);
+        return status;
+    }
+
+    status = _llog_add_sink(logger, _buffered_callback, f, f->path, level, SINK_FILE, _file_release);
+    if (status) {
+        _file_release(f);
+        return status;
+    }
+
+    _llog_register_files_atexit();
+#if defined(LLOG_HAS_THREADS_)
+    if (f->interval) _llog_start_flusher();
+#endif
+    return 0;
+}
+
+LLOG_LOCAL
+int llog_add_file(const char *restrict path, int level, const llog_file_opts *restrict opts)
+{
+    return _llog_add_file((void *) 0, path, level, opts);
+}
+
+LLOG_LOCAL
+int llog_remove_file(const char *restrict path)
+{
+    if (!path) return -EINVAL;
+    return _llog_remove_sink((void *) 0, (void *) 0, (void *) path, SINK_FILE);
+}
+
+LLOG_LOCAL
+int llog_set_file_level(const char *restrict path, int level)
+{
+    return _llog_set_sink_level((void *) 0, (void *) 0, path, SINK_FILE, level);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Memory-mapped ring files.
+ *
+ * The file is mapped and used as a circular array of fixed-size slots, so that events survive a crash of
+ * the process (the kernel writes the pages back) without a system call per event. The layout is:
+ *
+ *     header  "LLOGRING" version:u32 slotsize:u32 nslots:u64 byteorder:u32 pad ... head:u64 at 64  (128 bytes)
+ *     slots   nslots slots of slotsize bytes
+ *
+ * head counts the slots ever reserved, so that slot i is at (i % nslots) and the file holds the slots
+ * [head - nslots, head). A record takes one or more consecutive slots (wrapping around the end), and its
+ * first slot starts with:
+ *
+ *     commit:u64 nanoseconds:u64 line:u32 level:u8 pad:u8 filelen:u16 funclen:u16 msglen:u16 nslots:u32
+ *
+ * followed by the file, function, and message. Writers reserve slots with a fetch-add on head, copy the
+ * record and only then store commit = i + 1 for a record starting at slot i. A reader therefore recognizes
+ * complete records by their commit, and skips the ones a writer didn't finish (see llog-decode). The sink
+ * needs no lock. A writer that the others lap (the whole ring is logged while it copies its record) can
+ * clobber a newer record, which the ring size makes unlikely.
+ */
+#if defined(LLOG_POSIX_IO_)
+#define LLOG_MMAP_VERSION 1U
+#define LLOG_MMAP_HEADER_SIZE 128U
+#define LLOG_MMAP_HEAD_OFFSET 64U
+#define LLOG_MMAP_SLOT_SIZE 64U
+#define LLOG_MMAP_RECORD_SIZE 32U
+#define LLOG_MMAP_MIN_SIZE 65536U
+#if !defined(LLOG_MMAP_MSG_SIZE)
+#  define LLOG_MMAP_MSG_SIZE 1024U
+#endif
+#define LLOG_MMAP_MAX_NAME 256U
+
+typedef struct {
+    char *path;
+    unsigned char *map;
+    size_t mapsize;
+    unsigned char *slots;
+    uint64_t nslots;                // power of two
+    _Atomic(uint64_t) *head;
+} mmapsink;
+
+/*
+ * Copies len bytes at offset of the record starting at slot i, wrapping around the end of the file.
+ */
+static void _mmap_copy(mmapsink *m, uint64_t i, size_t offset, const void *src, size_t len)
+{
+    size_t total = (size_t) m->nslots * LLOG_MMAP_SLOT_SIZE;
+    size_t pos = ((size_t) (i & (m->nslots - 1)) * LLOG_MMAP_SLOT_SIZE + offset) % total;
+    size_t first = len < total - pos ? len : total - pos;
+
+    memcpy(m->slots + pos, src, first);
+    memcpy(m->slots, (const unsigned char *) src + first, len - first);
+}
+
+static void _mmap_callback(llog_event event)
+{
+    mmapsink *m = event.logobj;
+    char msg[LLOG_MMAP_MSG_SIZE];
+    llwriter w = { .buf = msg, .size = sizeof msg, };
+    _w_put(&w, event.msg ? event.msg : "", event.msg ? event.msglen : 0);
+    if (_llog_has_fields(&event)) _w_event_fields(&w, &event, false);
+    _w_end(&w);
+    int n = w.len < INT_MAX ? (int) w.len : INT_MAX;
+
+    size_t filelen = strlen(event.file);
+    size_t funclen = strlen(event.func);
+    uint16_t lens[3] = {
+        (uint16_t) (filelen < LLOG_MMAP_MAX_NAME ? filelen : LLOG_MMAP_MAX_NAME),
+        (uint16_t) (funclen < LLOG_MMAP_MAX_NAME ? funclen : LLOG_MMAP_MAX_NAME),
+        (uint16_t) ((size_t) n < sizeof msg ? (size_t) n : sizeof msg - 1),
+    };
+    size_t len = LLOG_MMAP_RECORD_SIZE + lens[0] + lens[1] + lens[2];
+    uint32_t nslots = (uint32_t) ((len + LLOG_MMAP_SLOT_SIZE - 1) / LLOG_MMAP_SLOT_SIZE);
+    uint64_t i = atomic_fetch_add_explicit(m->head, nslots, memory_order_relaxed);
+
+    unsigned char rec[LLOG_MMAP_RECORD_SIZE - 8];
+    uint64_t ns = (uint64_t) event.stamp.tv_sec * 1000000000U + (uint64_t) event.stamp.tv_nsec;
+    uint32_t line = (uint32_t) event.line;
+    memcpy(rec, &ns, 8);
+    memcpy(rec + 8, &line, 4);
+    rec[12] = (unsigned char) event.level;
+    rec[13] = 0;
+    memcpy(rec + 14, lens, sizeof lens);
+    memcpy(rec + 20, &nslots, 4);
+
+    _mmap_copy(m, i, 8, rec, sizeof rec);
+    _mmap_copy(m, i, LLOG_MMAP_RECORD_SIZE, event.file, lens[0]);
+    _mmap_copy(m, i, LLOG_MMAP_RECORD_SIZE + lens[0], event.func, lens[1]);
+    _mmap_copy(m, i, LLOG_MMAP_RECORD_SIZE + lens[0] + lens[1], msg, lens[2]);
+
+    _Atomic(uint64_t) *commit = (void *) (m->slots + (size_t) (i & (m->nslots - 1)) * LLOG_MMAP_SLOT_SIZE);
+    atomic_store_explicit(commit, i + 1, memory_order_release);
+    _llog_written += (size_t) nslots * LLOG_MMAP_SLOT_SIZE;
+}
+
+static void _mmap_release(void *arg)
+{
+    mmapsink *m = arg;
+    munmap(m->map, m->mapsize);
+    free(m->path);
+    free(m);
+}
+
+/*
+ * Maps the file, keeping the slots of a previous run if it has the same layout.
+ */
+static int _mmap_open(mmapsink *m, uint64_t nslots)
+{
+    unsigned char header[LLOG_MMAP_HEAD_OFFSET] = "LLOGRING";
+    uint32_t version = LLOG_MMAP_VERSION, slotsize = LLOG_MMAP_SLOT_SIZE;
+    uint32_t bom = LLOG_BINARY_BOM;
+
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &slotsize, 4);
+    memcpy(header + 16, &nslots, 8);
+    memcpy(header + 24, &bom, 4);
+
+    int flags = O_RDWR | O_CREAT;
+#if defined(O_CLOEXEC)
+    flags |= O_CLOEXEC;
+#endif
+    int fd = open(m->path, flags, 0666);
+    if (fd < 0) return errno ? -errno : -EINVAL;
+
+    m->mapsize = LLOG_MMAP_HEADER_SIZE + (size_t) nslots * LLOG_MMAP_SLOT_SIZE;
+    struct stat st;
+    bool reuse = !fstat(fd, &st) && (size_t) st.st_size == m->mapsize;
+    if (!reuse && ftruncate(fd, (off_t) m->mapsize)) {
+        int error = errno ? errno : EINVAL;
+        close(fd);
+        return -error;
+    }
+    void *map = mmap((void *) 0, m->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno ? errno : EINVAL;
+    close(fd);
+    if (map == MAP_FAILED) return -error;
+
+    m->map = map;
+    m->slots = m->map + LLOG_MMAP_HEADER_SIZE;
+    m->nslots = nslots;
+    m->head = (void *) (m->map + LLOG_MMAP_HEAD_OFFSET);
+    if (!reuse || memcmp(m->map, header, sizeof header)) {
+        memset(m->map, 0, m->mapsize);
+        memcpy(m->map, header, sizeof header);
+        atomic_init(m->head, 0);
+    }
+    return 0;
+}
+
+static int _llog_add_mmap(llog_logger *logger, const char *restrict path, size_t size, int level)
+{
+    if (!path) return -EINVAL;
+    if (size < LLOG_MMAP_MIN_SIZE || size > (SIZE_MAX - LLOG_MMAP_HEADER_SIZE) / 2) return -EINVAL;
+
+    uint64_t nslots = 1;
+    while (nslots * LLOG_MMAP_SLOT_SIZE < size) nslots <<= 1;
+
+    mmapsink *m = calloc(1, sizeof *m);
+    if (!m) return -ENOMEM;
+    m->path = malloc(strlen(path) + 1);
+    if (!m->path) {
+        free(m);
+        return -ENOMEM;
+    }
+    strcpy(m->path, path);
+
+    int status = _mmap_open(m, nslots);
+    if (status) {
+        free(m->path);
+        free(m);
+        return status;
+    }
+    status = _llog_add_sink(logger, _mmap_callback, m, m->path, level, SINK_MMAP, _mmap_release);
+    if (status) _mmap_release(m);
+    return status;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#else
+
+static int _llog_add_mmap(llog_logger *logger, const char *restrict path, size_t size, int level)
+{
+    (void) logger;
+    (void) path;
+    (void) size;
+    (void) level;
+    return -EINVAL;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#endif
+
+LLOG_LOCAL
+int llog_add_mmap(const char *restrict path, size_t size, int level)
+{
+    return _llog_add_mmap((void *) 0, path, size, level);
+}
+
+LLOG_LOCAL
+int llog_remove_mmap(const char *restrict path)
+{
+    if (!path) return -EINVAL;
+    return _llog_remove_sink((void *) 0, (void *) 0, (void *) path, SINK_MMAP);
+}
+
+LLOG_LOCAL
+int llog_set_mmap_level(const char *restrict path, int level)
+{
+    return _llog_set_sink_level((void *) 0, (void *) 0, path, SINK_MMAP, level);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Socket sinks.
+ *
+ * Logging threads format each event into the buffer of the sink, under a lock of its own, and never touch
+ * the socket: a thread of the sink swaps the buffer with a second one and sends it, when it is half full or
+ * the interval elapsed. The thread sleeps on a condition variable until then, which the event that fills
+ * half of the buffer signals. On stream sockets the buffer holds the bytes to send, which go out in one write;
+ * on datagram sockets it holds the events prefixed by their length, each sent as a datagram.
+ *
+ * While the socket is unreachable, the thread leaves the events in the buffer (new ones are dropped when it
+ * is full) and reconnects after a delay that doubles on every failure, without holding the lock that
+ * llog_flush takes. A batch that fails to go out is
+ * dropped, from its first incompletely sent event. Sends time out after LLOG_SOCKET_TIMEOUT_MS, so that a
+ * stalled peer delays the thread only.
+ */
+#if !defined(LLOG_SOCKET_MSG_SIZE)
+#  define LLOG_SOCKET_MSG_SIZE 2048U
+#endif
+#define LLOG_SOCKET_TIMEOUT_MS 1000L
+#define LLOG_SOCKET_MIN_BACKOFF_NS 100000000LL
+#define LLOG_SOCKET_MAX_BACKOFF_NS 30000000000LL
+#define LLOG_SOCKET_MAX_APPNAME 48U
+
+static atomic_ullong _llog_socket_drops;
+
+#if defined(LLOG_POSIX_IO_) && defined(LLOG_HAS_THREADS_)
+#if !defined(MSG_NOSIGNAL)
+#  define MSG_NOSIGNAL 0
+#endif
+
+typedef struct {
+    char *address;
+    char *host;                     // or the path of a Unix socket
+    const char *port;
+    int family;                     // AF_UNIX, or AF_UNSPEC for the ones resolved
+    int type;                       // SOCK_STREAM or SOCK_DGRAM
+    bool rfc5424;
+    int facility;
+    long pid;
+    char appname[LLOG_SOCKET_MAX_APPNAME + 1];
+    char hostname[256];
+
+    llmutex_ bufmutex;              // guards buf and used
+    llcond_ halffull;               // signaled with bufmutex when used reaches size / 2, or on stopping
+    char *buf;
+    size_t size;
+    size_t used;
+
+    llmutex_ sendmutex;             // guards out, fd and the times, taken by the thread and llog_flush
+    char *out;
+    int fd;
+    long long interval;             // nanoseconds
+    long long lastsend;             // nanoseconds since the Epoch
+    long long retryat;              // nanoseconds since the Epoch, while disconnected
+    long long backoff;              // nanoseconds, 0 if the last connection succeeded
+    atomic_bool stopping;
+    llthread_ thread;
+} socksink;
+
+/*
+ * Splits the address into the family, type, host (or path) and port of the socket.
+ */
+static int _socket_parse(socksink *k, const char *address)
+{
+    static const struct {
+        const char *scheme;
+        int family;
+        int type;
+    } schemes[] = {
+        { "unix:", AF_UNIX, SOCK_STREAM, },
+        { "unixgram:", AF_UNIX, SOCK_DGRAM, },
+        { "tcp:", AF_UNSPEC, SOCK_STREAM, },
+        { "udp:", AF_UNSPEC, SOCK_DGRAM, },
+    };
+    const char *rest = (void *) 0;
+    for (size_t i = 0; i < sizeof schemes / sizeof schemes[0] && !rest; i++) {
+        size_t len = strlen(schemes[i].scheme);
+        if (!strncmp(address, schemes[i].scheme, len)) {
+            rest = address + len;
+            k->family = schemes[i].family;
+            k->type = schemes[i].type;
+        }
+    }
+    if (!rest || !*rest) return -EINVAL;
+
+    k->host = malloc(strlen(rest) + 1);
+    if (!k->host) return -ENOMEM;
+    strcpy(k->host, rest);
+    if (k->family == AF_UNIX) {
+        return strlen(rest) < sizeof ((struct sockaddr_un *) 0)->sun_path ? 0 : -EINVAL;
+    }
+
+    char *colon = strrchr(k->host, ':');
+    if (!colon || colon == k->host || !colon[1]) return -EINVAL;
+    *colon = 0;
+    k->port = colon + 1;
+    size_t len = strlen(k->host);
+    if (k->host[0] == '[' && k->host[len - 1] == ']' && len > 2) {
+        memmove(k->host, k->host + 1, len - 2);
+        k->host[len - 2] = 0;
+    }
+    return 0;
+}
+
+static int _socket_open(int family, int type)
+{
+#if defined(SOCK_CLOEXEC)
+    int fd = socket(family, type | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(family, type, 0);
+    if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    if (fd < 0) return -1;
+
+    struct timeval timeout = { .tv_sec = LLOG_SOCKET_TIMEOUT_MS / 1000,
+                               .tv_usec = LLOG_SOCKET_TIMEOUT_MS % 1000 * 1000, };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+#if defined(SO_NOSIGPIPE)
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){ 1 }, sizeof(int));
+#endif
+    return fd;
+}
+
+/*
+ * Resolves the address of the sink and connects a socket to it. Returns the descriptor or -errno. It only
+ * reads the address, so it is called without sendmutex: an unreachable host doesn't block llog_flush.
+ */
+static int _socket_connect(const socksink *k)
+{
+    if (k->family == AF_UNIX) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+        strcpy(addr.sun_path, k->host);
+        int fd = _socket_open(AF_UNIX, k->type);
+        if (fd < 0) return -(errno ? errno : EIO);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+            int error = errno ? errno : EIO;
+            close(fd);
+            return -error;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = k->type, };
+    struct addrinfo *list;
+    if (getaddrinfo(k->host, k->port, &hints, &list)) return -EINVAL;
+    int status = -EIO;
+    for (struct addrinfo *ai = list; ai; ai = ai->ai_next) {
+        int fd = _socket_open(ai->ai_family, ai->ai_socktype);
+        if (fd < 0) continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            status = fd;
+            break;
+        }
+        status = -(errno ? errno : EIO);
+        close(fd);
+    }
+    freeaddrinfo(list);
+    return status;
+}
+
+/*
+ * Connects the socket of the sink if it is disconnected and its backoff delay elapsed, outside sendmutex,
+ * and installs it under sendmutex. Only the thread of the sink, or its release once it is joined, connects.
+ */
+static void _socket_reconnect(socksink *k, long long now)
+{
+    _mutex_lock(&k->sendmutex);
+    bool due = k->fd < 0 && now >= k->retryat;
+    _mutex_unlock(&k->sendmutex);
+    if (!due) return;
+
+    int fd = _socket_connect(k);
+    _mutex_lock(&k->sendmutex);
+    if (fd < 0) {
+        k->backoff = k->backoff ? k->backoff * 2 : LLOG_SOCKET_MIN_BACKOFF_NS;
+        if (k->backoff > LLOG_SOCKET_MAX_BACKOFF_NS) k->backoff = LLOG_SOCKET_MAX_BACKOFF_NS;
+        k->retryat = now + k->backoff;
+    }
+    else {
+        k->fd = fd;
+        k->backoff = 0;
+    }
+    _mutex_unlock(&k->sendmutex);
+}
+
+static void _socket_disconnect(socksink *k, long long now)
+{
+    close(k->fd);
+    k->fd = -1;
+    k->retryat = now;
+}
+
+/*
+ * Counts the events of a stream batch that weren't completely sent.
+ */
+static unsigned long _socket_unsent(const socksink *k, size_t used, size_t sent)
+{
+    unsigned long n = 0;
+    for (size_t at = 0; at < used;) {
+        size_t end;
+        if (k->rfc5424) {
+            char *space;
+            end = (size_t) strtoul(k->out + at, &space, 10);
+            end += (size_t) (space - k->out) + 1;
+        }
+        else {
+            const char *newline = memchr(k->out + at, '\n', used - at);
+            end = newline ? (size_t) (newline - k->out) + 1 : used;
+        }
+        if (end > sent) n++;
+        at = end;
+    }
+    return n;
+}
+
+/*
+ * Sends the events of the buffer. Returns 0, or -EAGAIN if the socket is disconnected (see
+ * _socket_reconnect), or -EIO if events were dropped. Must be called with sendmutex.
+ */
+static int _socket_send(socksink *k, long long now)
+{
+    if (k->fd < 0) return -EAGAIN;
+
+    _mutex_lock(&k->bufmutex);
+    char *out = k->buf;
+    size_t used = k->used;
+    k->buf = k->out;
+    k->out = out;
+    k->used = 0;
+    _mutex_unlock(&k->bufmutex);
+    k->lastsend = now;
+
+    unsigned long dropped = 0;
+    if (k->type == SOCK_STREAM) {
+        size_t sent = 0;
+        while (sent < used) {
+            ssize_t n = send(k->fd, out + sent, used - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                dropped = _socket_unsent(k, used, sent);
+                _socket_disconnect(k, now);
+                break;
+            }
+            sent += (size_t) n;
+        }
+    }
+    else {
+        for (size_t at = 0; at < used;) {
+            uint32_t len;
+            memcpy(&len, out + at, sizeof len);
+            ssize_t n;
+            do {
+                n = send(k->fd, out + at + sizeof len, len, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            at += sizeof len + len;
+            if (n >= 0) continue;
+
+            /* A UDP peer that isn't listening yet doesn't make the socket unusable. */
+            dropped++;
+            if (k->family == AF_UNIX || (errno != ECONNREFUSED && errno != EMSGSIZE)) {
+                for (; at < used; at += sizeof len + len, dropped++) {
+                    memcpy(&len, out + at, sizeof len);
+                }
+                _socket_disconnect(k, now);
+            }
+        }
+    }
+    if (!dropped) return 0;
+    atomic_fetch_add_explicit(&_llog_socket_drops, dropped, memory_order_relaxed);
+    return -EIO;
+}
+
+static int _socket_flush(void *arg)
+{
+    socksink *k = arg;
+    _mutex_lock(&k->sendmutex);
+    int status = _socket_send(k, _now());
+    _mutex_unlock(&k->sendmutex);
+    return status == -EAGAIN ? -EIO : status;
+}
+
+static int _socket_run(void *arg)
+{
+    socksink *k = arg;
+    while (!atomic_load_explicit(&k->stopping, memory_order_acquire)) {
+        long long now = _now();
+        _socket_reconnect(k, now);
+
+        _mutex_lock(&k->sendmutex);
+        _mutex_lock(&k->bufmutex);
+        size_t used = k->used;
+        _mutex_unlock(&k->bufmutex);
+        if (used && (used >= k->size / 2 || now - k->lastsend >= k->interval)) _socket_send(k, now);
+
+        /* Until the next interval, or the end of the backoff, during which a full buffer waits too. */
+        bool connected = k->fd >= 0;
+        long long deadline = connected ? k->lastsend + k->interval : k->retryat;
+        if (deadline <= now) deadline = now + k->interval;
+        _mutex_unlock(&k->sendmutex);
+
+        _mutex_lock(&k->bufmutex);
+        while (!atomic_load_explicit(&k->stopping, memory_order_acquire) && (!connected || k->used < k->size / 2)
+               && _now() < deadline) {
+            _cond_timedwait(&k->halffull, &k->bufmutex, deadline);
+        }
+        _mutex_unlock(&k->bufmutex);
+    }
+    return 0;
+}
+
+/*
+ * Formats an event as a syslog message (RFC 5424), the same way snprintf would.
+ */
+static int _syslog_line(char *restrict buf, size_t size, const socksink *k, const llog_event *event)
+{
+    static const int severities[] = { 7, 7, 6, 4, 3, 2, };
+    struct tm tm;
+    if (!gmtime_r(&event->stamp.tv_sec, &tm)) return -1;
+
+    char header[LLOG_LINE_SIZE];
+    int n = snprintf(header, sizeof header, "<%d>1 %04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %s %s %ld - - ",
+                     k->facility * 8 + severities[event->level], tm.tm_year + 1900, tm.tm_mon + 1,
+                     tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, event->stamp.tv_nsec / 1000L,
+                     k->hostname, k->appname, k->pid);
+    if (n < 0) return n;
+
+    llwriter w = { .buf = buf, .size = size, };
+    _w_put(&w, header, (size_t) n < sizeof header ? (size_t) n : sizeof header - 1);
+    _w_put(&w, event->msg ? event->msg : "", event->msg ? event->msglen : 0);
+    if (_llog_has_fields(event)) _w_event_fields(&w, event, false);
+    _w_end(&w);
+    return w.len < INT_MAX ? (int) w.len : -1;
+}
+
+static void _socket_callback(llog_event event)
+{
+    socksink *k = event.logobj;
+    char line[LLOG_SOCKET_MSG_SIZE];
+    int n = k->rfc5424 ? _syslog_line(line, sizeof line, k, &event) : _file_line(line, sizeof line, &event);
+    if (n < 0) return;
+    size_t len = (size_t) n < sizeof line ? (size_t) n : sizeof line - 1;
+
+    char frame[24];
+    size_t framelen = 0;
+    if (k->type == SOCK_DGRAM) {
+        uint32_t len32 = (uint32_t) len;
+        memcpy(frame, &len32, sizeof len32);
+        framelen = sizeof len32;
+    }
+    else if (k->rfc5424) {
+        framelen = (size_t) snprintf(frame, sizeof frame, "%zu ", len);
+    }
+    else {
+        line[len++] = '\n';
+    }
+
+    _mutex_lock(&k->bufmutex);
+    if (k->size - k->used >= framelen + len) {
+        size_t used = k->used;
+        memcpy(k->buf + k->used, frame, framelen);
+        memcpy(k->buf + k->used + framelen, line, len);
+        k->used += framelen + len;
+        _llog_written += framelen + len;
+        if (used < k->size / 2 && k->used >= k->size / 2) _cond_signal(&k->halffull);
+    }
+    else {
+        atomic_fetch_add_explicit(&_llog_socket_drops, 1, memory_order_relaxed);
+    }
+    _mutex_unlock(&k->bufmutex);
+}
+
+static void _socket_free(socksink *k)
+{
+    free(k->buf);
+    free(k->out);
+    free(k->host);
+    free(k->address);
+    free(k);
+}
+
+static void _socket_release(void *arg)
+{
+    socksink *k = arg;
+    _mutex_lock(&k->bufmutex);
+    atomic_store_explicit(&k->stopping, true, memory_order_release);
+    _cond_signal(&k->halffull);
+    _mutex_unlock(&k->bufmutex);
+    _thread_join(k->thread);
+
+    /* The last events get a connection attempt of their own. */
+    k->retryat = 0;
+    long long now = _now();
+    _socket_reconnect(k, now);
+    _mutex_lock(&k->sendmutex);
+    _socket_send(k, now);
+    _mutex_unlock(&k->sendmutex);
+    if (k->fd >= 0) close(k->fd);
+    _cond_destroy(&k->halffull);
+    _mutex_destroy(&k->bufmutex);
+    _mutex_destroy(&k->sendmutex);
+    _socket_free(k);
+}
+
+static int _llog_add_socket(llog_logger *logger, const char *restrict address, int level,
+                            const llog_socket_opts *restrict opts)
+{
+    const llog_socket_opts defaults = LLOG_SOCKET_DEFAULTS;
+    if (!opts) opts = &defaults;
+    if (!address || !opts->bufsize || opts->bufsize > UINT32_MAX) return -EINVAL;
+    if (opts->interval > LLONG_MAX / 1000000LL || opts->facility < 0 || opts->facility > 23) return -EINVAL;
+
+    socksink *k = calloc(1, sizeof *k);
+    if (!k) return -ENOMEM;
+    k->fd = -1;
+    int status = _socket_parse(k, address);
+    if (status) {
+        _socket_free(k);
+        return status;
+    }
+    k->address = malloc(strlen(address) + 1);
+    k->buf = malloc(opts->bufsize);
+    k->out = malloc(opts->bufsize);
+    if (!k->address || !k->buf || !k->out) {
+        _socket_free(k);
+        return -ENOMEM;
+    }
+    strcpy(k->address, address);
+    k->size = opts->bufsize;
+    k->interval = (long long) opts->interval * 1000000LL;
+    k->lastsend = _now();
+    k->rfc5424 = opts->rfc5424;
+    k->facility = opts->facility;
+    k->pid = (long) getpid();
+    snprintf(k->appname, sizeof k->appname, "%s", opts->appname && *opts->appname ? opts->appname : "-");
+    if (gethostname(k->hostname, sizeof k->hostname - 1) || !k->hostname[0]) strcpy(k->hostname, "-");
+    for (char *c = k->appname; *c; c++) {
+        if (*c <= ' ' || *c > '~') *c = '_';
+    }
+
+    if (_mutex_init(&k->bufmutex)) {
+        _socket_free(k);
+        return -ELOCK;
+    }
+    if (_mutex_init(&k->sendmutex)) {
+        _mutex_destroy(&k->bufmutex);
+        _socket_free(k);
+        return -ELOCK;
+    }
+    if (_cond_init(&k->halffull)) {
+        _mutex_destroy(&k->sendmutex);
+        _mutex_destroy(&k->bufmutex);
+        _socket_free(k);
+        return -ELOCK;
+    }
+    status = _thread_create(&k->thread, _socket_run, k);
+    if (status) {
+        _cond_destroy(&k->halffull);
+        _mutex_destroy(&k->bufmutex);
+        _mutex_destroy(&k->sendmutex);
+        _socket_free(k);
+        return status;
+    }
+
+    status = _llog_add_sink(logger, _socket_callback, k, k->address, level, SINK_SOCKET, _socket_release);
+    if (status) {
+        _socket_release(k);
+        return status;
+    }
+    _llog_register_files_atexit();
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#else
+
+static int _socket_flush(void *arg)
+{
+    (void) arg;
+    return 0;
+}
+
+static int _llog_add_socket(llog_logger *logger, const char *restrict address, int level,
+                            const llog_socket_opts *restrict opts)
+{
+    (void) logger;
+    (void) address;
+    (void) level;
+    (void) opts;
+    return -EINVAL;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#endif
+
+LLOG_LOCAL
+int llog_add_socket(const char *restrict address, int level, const llog_socket_opts *restrict opts)
+{
+    return _llog_add_socket((void *) 0, address, level, opts);
+}
+
+LLOG_LOCAL
+int llog_remove_socket(const char *restrict address)
+{
+    if (!address) return -EINVAL;
+    return _llog_remove_sink((void *) 0, (void *) 0, (void *) address, SINK_SOCKET);
+}
+
+LLOG_LOCAL
+int llog_set_socket_level(const char *restrict address, int level)
+{
+    return _llog_set_sink_level((void *) 0, (void *) 0, address, SINK_SOCKET, level);
+}
+
+LLOG_LOCAL
+unsigned long long llog_socket_dropped(void)
+{
+    return atomic_load_explicit(&_llog_socket_drops, memory_order_relaxed);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Loggers.
+ *
+ * The default logger is the global state above; the others are kept in a list, newest first, which the
+ * configuration functions change locked and the dispatch reads in read sections. The hierarchy is kept as a
+ * parent pointer per logger, updated when a logger is created or destroyed, so that an event only follows
+ * pointers to reach the outputs of the ancestors. The thresholds of every logger are recomputed whenever a
+ * level or an output changes (see _llog_update_threshold).
+ */
+#if defined(LLOG_HAS_THREADS_)
+static void _llog_async_wait(void);
+#endif
+
+static bool _logger_name_valid(const char *name)
+{
+    if (!*name || *name == '.') return false;
+    for (const char *p = name; *p; p++) {
+        if (*p == '.' && (p[1] == '.' || !p[1])) return false;
+    }
+    return true;
+}
+
+/*
+ * Tells whether the logger named prefix is an ancestor of the one named name.
+ */
+static bool _logger_name_under(const char *name, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    return !strncmp(name, prefix, len) && name[len] == '.';
+}
+
+/*
+ * Returns the logger of that name, or a null pointer. Must be called locked.
+ */
+static llog_logger *_llog_logger_named(const char *name)
+{
+    for (llog_logger *logger = atomic_load_explicit(&_llog_loggers, memory_order_relaxed); logger;
+         logger = atomic_load_explicit(&logger->next, memory_order_relaxed)) {
+        if (!strcmp(logger->name, name)) return logger;
+    }
+    return (void *) 0;
+}
+
+#if defined(LLOG_HAS_THREADS_)
+/*
+ * Loggers by id, for the consumer of the asynchronous mode to find the logger of a record without walking
+ * the list. Ids aren't reused, so that a record of a destroyed logger finds a null pointer. The array grows
+ * under the global lock, and the one it replaces is freed once no read section uses it.
+ */
+typedef struct {
+    size_t size;
+    _Atomic(llog_logger *) loggers[];
+} loggerindex;
+
+static _Atomic(loggerindex *) _llog_logger_index;
+
+/*
+ * Makes room for the id in the index, and returns the array it replaced, if any. Must be called locked.
+ */
+static int _llog_logger_index_grow(unsigned long id, loggerindex **old)
+{
+    *old = atomic_load_explicit(&_llog_logger_index, memory_order_relaxed);
+    if (*old && id < (*old)->size) {
+        *old = (void *) 0;
+        return 0;
+    }
+    size_t size = *old ? (*old)->size * 2 : 16U;
+    loggerindex *index = malloc(sizeof *index + size * sizeof index->loggers[0]);
+    if (!index) return -ENOMEM;
+    index->size = size;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&index->loggers[i], *old && i < (*old)->size
+                    ? atomic_load_explicit(&(*old)->loggers[i], memory_order_relaxed) : (void *) 0);
+    }
+    atomic_store_explicit(&_llog_logger_index, index, memory_order_release);
+    return 0;
+}
+
+/*
+ * Returns the logger with that id, or a null pointer if it was destroyed. Must be called in a read section.
+ */
+static const llog_logger *_llog_logger_by_id(unsigned long id)
+{
+    loggerindex *index = atomic_load_explicit(&_llog_logger_index, memory_order_acquire);
+    return index && id < index->size ? atomic_load_explicit(&index->loggers[id], memory_order_acquire) : (void *) 0;
+}
+#endif
+
+LLOG_LOCAL
+int llog_logger_create(llog_logger **logger, const char *name)
+{
+    if (!logger || !name || !_logger_name_valid(name)) return -EINVAL;
+
+    size_t size = (sizeof(llog_logger) + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+    llog_logger *l = aligned_alloc(CACHELINE_SIZE, size);
+    char *copy = malloc(strlen(name) + 1);
+    if (!l || !copy) {
+        free(copy);
+        free(l);
+        return -ENOMEM;
+    }
+    memset(l, 0, sizeof *l);
+    strcpy(copy, name);
+    atomic_init(&l->threshold, LLOG_FATAL + 1);
+    atomic_init(&l->outputs, LLOG_FATAL + 1);
+    atomic_init(&l->table, (void *) 0);
+    atomic_init(&l->additive, true);
+    l->level = LLOG_INHERIT;
+    l->name = copy;
+
+    int status = _lock();
+    if (status) {
+        free(copy);
+        free(l);
+        return status;
+    }
+    if (_llog_logger_named(name)) {
+        free(copy);
+        free(l);
+        status = _unlock();
+        if (status) return status;
+        return -EINVAL;
+    }
+
+    static unsigned long ids;
+#if defined(LLOG_HAS_THREADS_)
+    loggerindex *oldindex;
+    if (_llog_logger_index_grow(ids + 1, &oldindex)) {
+        free(copy);
+        free(l);
+        status = _unlock();
+        if (status) return status;
+        return -ENOMEM;
+    }
+#endif
+    l->id = ++ids;
+
+    /* Its parent is the logger with the longest name above it, and it becomes the parent of the loggers
+     * below it that had the same. */
+    llog_logger *head = atomic_load_explicit(&_llog_loggers, memory_order_relaxed);
+    llog_logger *parent = (void *) 0;
+    for (llog_logger *o = head; o; o = atomic_load_explicit(&o->next, memory_order_relaxed)) {
+        if (_logger_name_under(name, o->name) && (!parent || strlen(o->name) > strlen(parent->name))) {
+            parent = o;
+        }
+    }
+    atomic_init(&l->parent, parent);
+    atomic_init(&l->next, head);
+    for (llog_logger *o = head; o; o = atomic_load_explicit(&o->next, memory_order_relaxed)) {
+        if (atomic_load_explicit(&o->parent, memory_order_relaxed) == parent && _logger_name_under(o->name, name)) {
+            atomic_store_explicit(&o->parent, l, memory_order_release);
+        }
+    }
+    atomic_store_explicit(&_llog_loggers, l, memory_order_release);
+#if defined(LLOG_HAS_THREADS_)
+    atomic_store_explicit(&atomic_load_explicit(&_llog_logger_index, memory_order_relaxed)->loggers[l->id], l,
+                          memory_order_release);
+#endif
+    _llog_update_threshold();
+    *logger = l;
+    status = _unlock();
+#if defined(LLOG_HAS_THREADS_)
+    if (oldindex) {
+        _llog_synchronize();
+        free(oldindex);
+    }
+#endif
+    return status;
+}
+
+LLOG_LOCAL
+int llog_logger_destroy(llog_logger *logger)
+{
+    if (!logger) return -EINVAL;
+#if defined(LLOG_HAS_THREADS_)
+    _llog_async_wait();
+#endif
+    int status = _lock();
+    if (status) return status;
+
+    llog_logger *parent = atomic_load_explicit(&logger->parent, memory_order_relaxed);
+    _Atomic(llog_logger *) *link = &_llog_loggers;
+    for (llog_logger *l; (l = atomic_load_explicit(link, memory_order_relaxed));) {
+        if (l == logger) {
+            atomic_store_explicit(link, atomic_load_explicit(&l->next, memory_order_relaxed),
+                                  memory_order_release);
+            continue;
+        }
+        if (atomic_load_explicit(&l->parent, memory_order_relaxed) == logger) {
+            atomic_store_explicit(&l->parent, parent, memory_order_release);
+        }
+        link = &l->next;
+    }
+#if defined(LLOG_HAS_THREADS_)
+    atomic_store_explicit(&atomic_load_explicit(&_llog_logger_index, memory_order_relaxed)->loggers[logger->id],
+                          (llog_logger *) 0, memory_order_release);
+#endif
+    _llog_update_threshold();
+    status = _unlock();
+#if defined(LLOG_HAS_THREADS_)
+    _llog_synchronize();
+#endif
+
+    sinktable *table = atomic_load_explicit(&logger->table, memory_order_relaxed);
+    for (size_t i = 0; table && i < table->n; i++) {
+        _sink_destroy(table->sinks[i]);
+    }
+    free(table);
+    free(logger->name);
+    free(logger);
+    return status;
+}
+
+/*
+ * Sets the level of the logger named name. Returns -EINVAL if there is none.
+ */
+static int _llog_set_named_level(const char *name, int level)
+{
+    int status = _lock();
+    if (status) return status;
+    llog_logger *logger = _llog_logger_named(name);
+    if (logger) {
+        logger->level = level;
+        _llog_update_threshold();
+    }
+    status = _unlock();
+    if (status) return status;
+    return logger ? 0 : -EINVAL;
+}
+
+/*
+ * Sets the level of the sinks of the logger of that name (see _llog_set_level_of).
+ */
+static int _llog_set_named_sink_level(const char *name, const void *key, int kind, int level)
+{
+    int status = _lock();
+    if (status) return status;
+    llog_logger *logger = _llog_logger_named(name);
+    size_t nset = logger ? _llog_set_level_of(logger, (void *) 0, key, kind, level) : 0;
+    status = _unlock();
+    if (status) return status;
+    return nset ? 0 : -EINVAL;
+}
+
+LLOG_LOCAL
+int llog_logger_set_level(llog_logger *logger, int level)
+{
+    if (!logger || (level != LLOG_INHERIT && !_valid_level(level))) return -EINVAL;
+    int status = _lock();
+    if (status) return status;
+    logger->level = level;
+    _llog_update_threshold();
+    return _unlock();
+}
+
+LLOG_LOCAL
+int llog_logger_set_additive(llog_logger *logger, bool additive)
+{
+    if (!logger) return -EINVAL;
+    int status = _lock();
+    if (status) return status;
+    atomic_store_explicit(&logger->additive, additive, memory_order_relaxed);
+    _llog_update_threshold();
+    return _unlock();
+}
+
+LLOG_LOCAL
+const char *llog_logger_name(const llog_logger *logger)
+{
+    return logger ? logger->name : (void *) 0;
+}
+
+LLOG_LOCAL
+int llog_logger_add_callback(llog_logger *logger, llog_callback logfunc, void *logobj, int level)
+{
+    if (!logfunc) return -EINVAL;
+    if (!logobj) return -EINVAL;
+    return _llog_add_sink(logger, logfunc, logobj, logobj, level, SINK_CALLBACK, (void *) 0);
+}
+
+LLOG_LOCAL
+int llog_logger_remove_callback(llog_logger *logger, llog_callback logfunc, void *logobj)
+{
+    if (!logfunc) return -EINVAL;
+    if (!logobj) return -EINVAL;
+    return _llog_remove_sink(logger, logfunc, logobj, SINK_CALLBACK);
+}
+
+LLOG_LOCAL
+int llog_logger_set_callback_level(llog_logger *logger, llog_callback logfunc, void *logobj, int level)
+{
+    if (!logfunc) return -EINVAL;
+    return _llog_set_sink_level(logger, logfunc, logobj, SINK_CALLBACK, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_fp(llog_logger *logger, FILE *restrict fp, int level)
+{
+    if (!fp) return -EINVAL;
+    return _llog_add_sink(logger, _file_callback, fp, fp, level, SINK_FP, (void *) 0);
+}
+
+LLOG_LOCAL
+int llog_logger_remove_fp(llog_logger *logger, FILE *restrict fp)
+{
+    if (!fp) return -EINVAL;
+    return _llog_remove_sink(logger, (void *) 0, fp, SINK_FP);
+}
+
+LLOG_LOCAL
+int llog_logger_set_fp_level(llog_logger *logger, FILE *restrict fp, int level)
+{
+    return _llog_set_sink_level(logger, (void *) 0, fp, SINK_FP, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_binary_fp(llog_logger *logger, FILE *restrict fp, int level)
+{
+    return _llog_add_binary_fp(logger, fp, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_json_fp(llog_logger *logger, FILE *restrict fp, int level)
+{
+    return _llog_add_json_fp(logger, fp, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_file(llog_logger *logger, const char *restrict path, int level,
+                         const llog_file_opts *restrict opts)
+{
+    return _llog_add_file(logger, path, level, opts);
+}
+
+LLOG_LOCAL
+int llog_logger_remove_file(llog_logger *logger, const char *restrict path)
+{
+    if (!path) return -EINVAL;
+    return _llog_remove_sink(logger, (void *) 0, (void *) path, SINK_FILE);
+}
+
+LLOG_LOCAL
+int llog_logger_set_file_level(llog_logger *logger, const char *restrict path, int level)
+{
+    return _llog_set_sink_level(logger, (void *) 0, path, SINK_FILE, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_mmap(llog_logger *logger, const char *restrict path, size_t size, int level)
+{
+    return _llog_add_mmap(logger, path, size, level);
+}
+
+LLOG_LOCAL
+int llog_logger_remove_mmap(llog_logger *logger, const char *restrict path)
+{
+    if (!path) return -EINVAL;
+    return _llog_remove_sink(logger, (void *) 0, (void *) path, SINK_MMAP);
+}
+
+LLOG_LOCAL
+int llog_logger_set_mmap_level(llog_logger *logger, const char *restrict path, int level)
+{
+    return _llog_set_sink_level(logger, (void *) 0, path, SINK_MMAP, level);
+}
+
+LLOG_LOCAL
+int llog_logger_add_socket(llog_logger *logger, const char *restrict address, int level,
+                           const llog_socket_opts *restrict opts)
+{
+    return _llog_add_socket(logger, address, level, opts);
+}
+
+LLOG_LOCAL
+int llog_logger_remove_socket(llog_logger *logger, const char *restrict address)
+{
+    if (!address) return -EINVAL;
+    return _llog_remove_sink(logger, (void *) 0, (void *) address, SINK_SOCKET);
+}
+
+LLOG_LOCAL
+int llog_logger_set_socket_level(llog_logger *logger, const char *restrict address, int level)
+{
+    return _llog_set_sink_level(logger, (void *) 0, address, SINK_SOCKET, level);
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Configuration reload.
+ *
+ * A configuration is a list of name=value settings. The signal handler installed by llog_reload_on_signal
+ * only raises a flag and wakes the background thread of the file sinks, which reloads the configuration from
+ * the environment and from a file. Without it, the next event logged checks the flag.
+ */
+#define LLOG_CONFIG_MAX_SIZE 65536U
+#define LLOG_CONFIG_SEPARATORS " \t\r\n,;"
+
+/* Set by a signal handler and cleared by any thread, which only lock-free atomics allow. */
+_Static_assert(ATOMIC_BOOL_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+               "llog_reload_on_signal requires lock-free atomic_bool and atomic_int");
+static atomic_bool _llog_reload_pending;
+
+static void _llog_on_signal(int signo)
+{
+    (void) signo;
+    atomic_store_explicit(&_llog_reload_pending, true, memory_order_relaxed);
+#if defined(LLOG_HAS_THREADS_) && defined(LLOG_POSIX_IO_)
+    _llog_wake_flusher();
+#endif
+}
+
+static int _strcasecmp(const char *a, const char *b)
+{
+    for (; *a && tolower((unsigned char) *a) == tolower((unsigned char) *b); a++, b++)
+        ;
+    return tolower((unsigned char) *a) - tolower((unsigned char) *b);
+}
+
+static int _level_named(const char *name)
+{
+    static const char *const names[] = { "trace", "debug", "info", "warn", "error", "fatal", };
+    for (int level = LLOG_TRACE; level <= LLOG_FATAL; level++) {
+        if (!_strcasecmp(name, names[level]) || !_strcasecmp(name, LLEVEL_STR[level])) return level;
+    }
+    return -1;
+}
+
+static int _bool_named(const char *name)
+{
+    if (!_strcasecmp(name, "true") || !strcmp(name, "1") || !_strcasecmp(name, "on")) return 1;
+    if (!_strcasecmp(name, "false") || !strcmp(name, "0") || !_strcasecmp(name, "off")) return 0;
+    return -1;
+}
+
+/*
+ * Returns the path or the address an output setting (file:, mmap: or socket:) names, and its kind of
+ * sink in *kind, or a null pointer if it names none.
+ */
+static const char *_sink_named(const char *setting, int *kind)
+{
+    if (!strncmp(setting, "file:", 5)) {
+        *kind = SINK_FILE;
+        return setting + 5;
+    }
+    if (!strncmp(setting, "mmap:", 5)) {
+        *kind = SINK_MMAP;
+        return setting + 5;
+    }
+    if (!strncmp(setting, "socket:", 7)) {
+        *kind = SINK_SOCKET;
+        return setting + 7;
+    }
+    return (void *) 0;
+}
+
+/*
+ * Applies a single name=value setting, modified in place.
+ */
+static int _llog_setting(char *setting)
+{
+    char *value = strrchr(setting, '=');
+    if (!value || value == setting) return -EINVAL;
+    *value++ = 0;
+
+    if (!strcmp(setting, "quiet")) {
+        int quiet = _bool_named(value);
+        if (quiet < 0) return -EINVAL;
+        return llog_set_quiet(quiet);
+    }
+
+    int kind;
+    const char *key;
+    if (!strncmp(setting, "logger:", 7)) {
+        /* logger:NAME/file:PATH sets an output of the logger, whose name ends at the first slash. */
+        char *output = strchr(setting + 7, '/');
+        if (output) {
+            *output++ = 0;
+            int level = _level_named(value);
+            if (level < 0 || !(key = _sink_named(output, &kind)) || !*key) return -EINVAL;
+            return _llog_set_named_sink_level(setting + 7, key, kind, level);
+        }
+        if (!_strcasecmp(value, "inherit")) return _llog_set_named_level(setting + 7, LLOG_INHERIT);
+        int level = _level_named(value);
+        if (level < 0) return -EINVAL;
+        return _llog_set_named_level(setting + 7, level);
+    }
+
+    int level = _level_named(value);
+    if (level < 0) return -EINVAL;
+    if (!strcmp(setting, "level")) return llog_set_level(level);
+    if ((key = _sink_named(setting, &kind))) return _llog_set_sink_level((void *) 0, (void *) 0, key, kind, level);
+    return -EINVAL;
+}
+
+LLOG_LOCAL
+int llog_configure(const char *spec)
+{
+    if (!spec) return -EINVAL;
+    char *copy = malloc(strlen(spec) + 1);
+    if (!copy) return -ENOMEM;
+    strcpy(copy, spec);
+
+    /* Comments run to the end of their line. */
+    for (char *hash = strchr(copy, '#'); hash; hash = strchr(hash, '#')) {
+        while (*hash && *hash != '\n') *hash++ = ' ';
+    }
+
+    int status = 0;
+    char *p = copy;
+    for (;;) {
+        p += strspn(p, LLOG_CONFIG_SEPARATORS);
+        if (!*p) break;
+        size_t len = strcspn(p, LLOG_CONFIG_SEPARATORS);
+        char *next = p[len] ? p + len + 1 : p + len;
+        p[len] = 0;
+        int s = _llog_setting(p);
+        if (s && !status) status = s;
+        p = next;
+    }
+    free(copy);
+    return status;
+}
+
+LLOG_LOCAL
+int llog_reload(void)
+{
+    int status = 0;
+    const char *path = getenv("LLOG_CONFIG_FILE");
+    if (path && *path) {
+        FILE *fp = fopen(path, "r");
+        char *buf = fp ? malloc(LLOG_CONFIG_MAX_SIZE + 1) : (void *) 0;
+        if (buf) {
+            size_t n = fread(buf, 1, LLOG_CONFIG_MAX_SIZE, fp);
+            buf[n] = 0;
+            status = ferror(fp) ? -EIO : llog_configure(buf);
+        }
+        else {
+            status = fp ? -ENOMEM : -(errno ? errno : EIO);
+        }
+        if (fp) fclose(fp);
+        free(buf);
+    }
+
+    /* The environment overrides the file. */
+    const char *spec = getenv("LLOG_CONFIG");
+    if (spec) {
+        int s = llog_configure(spec);
+        if (!status) status = s;
+    }
+    return status;
+}
+
+static void _llog_reload_if_pending(void)
+{
+    if (atomic_load_explicit(&_llog_reload_pending, memory_order_relaxed)
+        && atomic_exchange_explicit(&_llog_reload_pending, false, memory_order_relaxed)) {
+        llog_reload();
+    }
+}
+
+LLOG_LOCAL
+int llog_reload_on_signal(int signo)
+{
+#if defined(LLOG_HAS_THREADS_)
+    _llog_start_flusher();
+#endif
+#if defined(LLOG_POSIX_IO_)
+    struct sigaction action = { .sa_handler = _llog_on_signal, };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(signo, &action, (void *) 0)) return -EINVAL;
+#else
+    if (signal(signo, _llog_on_signal) == SIG_ERR) return -EINVAL;
+#endif
+    return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Asynchronous mode.
+ *
+ * Each producer thread owns a ring of fixed-size records, allocated on its first log in asynchronous
+ * mode. The rings are kept in a lock-free list, pushed at its head by the producers and unlinked only
+ * by the consumer, which formats and dispatches the records (see _llog_drain).
+ *
+ * A ring has a single producer and a single consumer, except with LLOG_ASYNC_DROP_OLDEST, where a
+ * producer that finds its ring full advances the head itself. The consumer therefore copies a record
+ * out and only then claims it with a CAS on the head: if the CAS fails, the record was dropped and the
+ * copy is discarded. With that policy the consumer also announces the record it copies in the ring's
+ * copying field before checking that the head still points to it, and a producer that dropped that
+ * record waits for the copy to end before overwriting it.
+ *
+ * The consumer sleeps on a condition variable once every ring is empty. It raises its sleeping flag and
+ * looks once more before waiting, and a producer checks the flag after publishing a record, each behind
+ * a fence, so that one of them sees the other. Producers that wait for room (LLOG_ASYNC_BLOCK) or for
+ * their records to be dispatched sleep on another condition variable, signaled by the consumer whenever
+ * it drained some records and someone is waiting.
+ */
+#if defined(LLOG_HAS_THREADS_)
+
+#if !defined(LLOG_ASYNC_ARGS_SIZE)
+#  define LLOG_ASYNC_ARGS_SIZE 224U
+#endif
+#define LLOG_ASYNC_BATCH 64U
+#define LLOG_ASYNC_MAX_KV 16U
+
+typedef struct {
+    int level;
+    unsigned long line;
+    const char *file;
+    const char *func;
+    const char *format;
+    site *site;
+    struct timespec stamp;
+    unsigned short len;
+    bool formatted;                         // args holds the message itself
+    unsigned char nkv;                      // fields packed in args after len (see _kv_pack)
+    unsigned char nctx;                     // context fields packed after them, the thread name first
+    bool named;
+    unsigned long tid;
+    unsigned long logger;                   // id of the logger, 0 for the default one
+    unsigned char args[LLOG_ASYNC_ARGS_SIZE];
+} record;
+
+typedef struct ring {
+    _Alignas(CACHELINE_SIZE) atomic_size_t head;  // next record to consume
+    atomic_size_t done;                           // every record before it was dispatched
+    atomic_size_t copying;                        // index plus one of the record being copied, or 0
+    _Alignas(CACHELINE_SIZE) atomic_size_t tail;  // next record to produce
+    _Alignas(CACHELINE_SIZE) struct ring *next;
+    atomic_bool orphaned;                         // the producer thread exited
+    size_t mask;
+    record *records;
+} ring;
+
+enum { ASYNC_OFF=0, ASYNC_STARTING, ASYNC_RUNNING, ASYNC_STOPPING };
+
+static struct {
+    _Alignas(CACHELINE_SIZE) atomic_int state;
+    int policy;
+    size_t capacity;
+    _Alignas(CACHELINE_SIZE) _Atomic(ring *) rings;
+    _Alignas(CACHELINE_SIZE) atomic_ullong dropped;
+    _Alignas(CACHELINE_SIZE) atomic_bool sleeping;  // the consumer waits for records to be pushed
+    atomic_uint waiting;                            // producers waiting for records to be drained
+    atomic_bool stop;
+    bool ready;                                     // mutex and condition variables initialized
+    llmutex_ mutex;
+    llcond_ pushed;
+    llcond_ drained;
+    llthread_ drain;
+} _llog_async = { .state = ASYNC_OFF, };
+
+static void _llog_async_init(void)
+{
+    if (_mutex_init(&_llog_async.mutex)) return;
+    if (_cond_init(&_llog_async.pushed)) {
+        _mutex_destroy(&_llog_async.mutex);
+        return;
+    }
+    if (_cond_init(&_llog_async.drained)) {
+        _cond_destroy(&_llog_async.pushed);
+        _mutex_destroy(&_llog_async.mutex);
+        return;
+    }
+    _llog_async.ready = true;
+}
+
+/*
+ * Wakes the consumer up if it sleeps. Called by producers after publishing a record.
+ */
+static void _llog_async_wake(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&_llog_async.sleeping, memory_order_relaxed)) return;
+    _mutex_lock(&_llog_async.mutex);
+    atomic_store_explicit(&_llog_async.sleeping, false, memory_order_relaxed);
+    _cond_signal(&_llog_async.pushed);
+    _mutex_unlock(&_llog_async.mutex);
+}
+
+/*
+ * Wakes the producers waiting for records to be drained, if any. Called by the consumer.
+ */
+static void _llog_async_notify(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&_llog_async.waiting, memory_order_relaxed)) return;
+    _mutex_lock(&_llog_async.mutex);
+    _cond_broadcast(&_llog_async.drained);
+    _mutex_unlock(&_llog_async.mutex);
+}
+
+/*
+ * Waits until the consumer moves *pos (the head or the done index of a ring) to target. Returns false
+ * if asynchronous mode was turned off meanwhile.
+ */
+static bool _ring_wait(const atomic_size_t *pos, size_t target)
+{
+    if (atomic_load_explicit(pos, memory_order_acquire) >= target) return true;
+
+    bool reached;
+    _mutex_lock(&_llog_async.mutex);
+    atomic_fetch_add_explicit(&_llog_async.waiting, 1, memory_order_seq_cst);
+    while (!(reached = atomic_load_explicit(pos, memory_order_seq_cst) >= target)
+           && atomic_load_explicit(&_llog_async.state, memory_order_acquire) == ASYNC_RUNNING) {
+        _cond_wait(&_llog_async.drained, &_llog_async.mutex);
+    }
+    atomic_fetch_sub_explicit(&_llog_async.waiting, 1, memory_order_relaxed);
+    _mutex_unlock(&_llog_async.mutex);
+    return reached;
+}
+
+static void _ring_orphan(ring *r)
+{
+    atomic_store_explicit(&r->orphaned, true, memory_order_release);
+}
+
+static ring *_ring_new(tstate *t)
+{
+    size_t size = (sizeof(ring) + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+    ring *r = aligned_alloc(CACHELINE_SIZE, size);
+    if (!r) return (void *) 0;
+    r->records = malloc(_llog_async.capacity * sizeof *r->records);
+    if (!r->records) {
+        free(r);
+        return (void *) 0;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->done, 0);
+    atomic_init(&r->copying, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->orphaned, false);
+    r->mask = _llog_async.capacity - 1;
+
+    r->next = atomic_load_explicit(&_llog_async.rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&_llog_async.rings, &r->next, r,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+    return t->ring = r;
+}
+
+static void _ring_free(ring *r)
+{
+    free(r->records);
+    free(r);
+}
+
+/*
+ * Copies fields in the record at offset *at of its arguments, and moves *at past them. Each field is stored
+ * as type:u8 keylen:u16 key, followed by 8 bytes for a number or, for a string, len:u16 and its characters.
+ * The lengths count the null character, and a null string has the length 0. Returns false if they don't fit.
+ */
+static bool _kv_pack(record *rec, size_t *at, const llog_kv *kv, size_t nkv)
+{
+    unsigned char *p = rec->args + *at;
+    unsigned char *end = rec->args + sizeof rec->args;
+
+    if (nkv > LLOG_ASYNC_MAX_KV) return false;
+    for (size_t i = 0; i < nkv; i++) {
+        const char *key = kv[i].key ? kv[i].key : "";
+        size_t keylen = strlen(key) + 1;
+        bool str = kv[i].type == LLOG_KV_TYPE_STR;
+        size_t vlen = str ? (kv[i].value.s ? strlen(kv[i].value.s) + 1 : 0) : 8;
+        size_t need = 3 + keylen + (str ? 2 : 0) + vlen;
+        if (keylen > UINT16_MAX || vlen > UINT16_MAX || need > (size_t) (end - p)) return false;
+
+        uint16_t len16 = (uint16_t) keylen;
+        *p++ = (unsigned char) kv[i].type;
+        memcpy(p, &len16, 2);
+        memcpy(p + 2, key, keylen);
+        p += 2 + keylen;
+        if (str) {
+            len16 = (uint16_t) vlen;
+            memcpy(p, &len16, 2);
+            if (vlen) memcpy(p + 2, kv[i].value.s, vlen);
+            p += 2 + vlen;
+        }
+        else {
+            memcpy(p, &kv[i].value, 8);
+            p += 8;
+        }
+    }
+    *at = (size_t) (p - rec->args);
+    return true;
+}
+
+/*
+ * Rebuilds n fields packed in the record at offset *at, pointing into it, and moves *at past them.
+ */
+static size_t _kv_unpack(const record *rec, size_t *at, llog_kv *kv, size_t n)
+{
+    const unsigned char *p = rec->args + *at;
+
+    for (size_t i = 0; i < n; i++) {
+        uint16_t len16;
+        kv[i].type = *p++;
+        memcpy(&len16, p, 2);
+        kv[i].key = (const char *) p + 2;
+        p += 2 + len16;
+        if (kv[i].type == LLOG_KV_TYPE_STR) {
+            memcpy(&len16, p, 2);
+            kv[i].value.s = len16 ? (const char *) p + 2 : (void *) 0;
+            p += 2 + len16;
+        }
+        else {
+            memcpy(&kv[i].value, p, 8);
+            p += 8;
+        }
+    }
+    *at = (size_t) (p - rec->args);
+    return n;
+}
+
+/*
+ * Returns 0 if the event was queued (or dropped), 1 if it must be logged synchronously
+ * because asynchronous mode was turned off meanwhile or its fields don't fit in a record,
+ * or a negative error code.
+ */
+static int _llog_async_push(const llog_logger *logger, int level, const char *restrict file,
+                            const char *restrict func, unsigned long line, const char *restrict format,
+                            va_list args, const llog_kv *kv, size_t nkv)
+{
+    tstate *t = _llog_thread();
+    if (!t) return -ENOMEM;
+    ring *r = t->ring;
+    if (!r && !(r = _ring_new(t))) return -ENOMEM;
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - head <= r->mask) break;
+
+        switch (_llog_async.policy) {
+        case LLOG_ASYNC_DROP_NEWEST:
+            atomic_fetch_add_explicit(&_llog_async.dropped, 1, memory_order_relaxed);
+            return 0;
+        case LLOG_ASYNC_DROP_OLDEST:
+            if (atomic_compare_exchange_strong_explicit(&r->head, &head, head + 1,
+                                                        memory_order_seq_cst, memory_order_acquire)) {
+                atomic_fetch_add_explicit(&_llog_async.dropped, 1, memory_order_relaxed);
+                /* The consumer may still be copying the record out (see _ring_drain). */
+                while (atomic_load_explicit(&r->copying, memory_order_seq_cst) == head + 1)
+                    _thread_yield();
+            }
+            break;
+        default:
+            if (!_ring_wait(&r->head, tail - r->mask)) return 1;
+            break;
+        }
+    }
+
+    record *rec = &r->records[tail & r->mask];
+    rec->logger = logger ? logger->id : 0;
+    rec->level = level;
+    rec->line = line;
+    rec->file = file;
+    rec->func = func;
+    rec->format = format;
+    timespec_get(&rec->stamp, TIME_UTC);
+
+    site *s = rec->site = _llog_site(file, func, line, format);
+    size_t len = SIZE_MAX;
+    if (s && s->nargs >= 0) {
+        va_list copy;
+        va_copy(copy, args);
+        len = _llog_pack(s, rec->args, sizeof rec->args, copy);
+        va_end(copy);
+    }
+    rec->formatted = len == SIZE_MAX;
+    if (rec->formatted) {
+        int n = vsnprintf((char *) rec->args, sizeof rec->args, format, args);
+        len = n < 0 ? 0 : (size_t) n < sizeof rec->args ? (size_t) n + 1 : sizeof rec->args;
+    }
+    rec->len = (unsigned short) len;
+
+    /* The context of the thread goes with the event. */
+    const llog_context *ctx = _llog_context();
+    size_t at = len;
+    if (nkv && !_kv_pack(rec, &at, kv, nkv)) return 1;
+    if (ctx->name && !_kv_pack(rec, &at, &LLOG_KV_STR("thread", ctx->name), 1)) return 1;
+    if (ctx->nkv && !_kv_pack(rec, &at, ctx->kv, ctx->nkv)) return 1;
+    rec->nkv = (unsigned char) nkv;
+    rec->named = ctx->name;
+    rec->nctx = (unsigned char) (ctx->nkv + rec->named);
+    rec->tid = ctx->id;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    _llog_async_wake();
+
+    /* Don't return before the crash context is out. */
+    if (level == LLOG_FATAL) _ring_wait(&r->done, tail + 1);
+    return 0;
+}
+
+/*
+ * Waits until the events the calling thread queued are dispatched.
+ */
+static void _llog_async_wait(void)
+{
+    ring *r = _llog_tstate ? _llog_tstate->ring : (void *) 0;
+    if (!r) return;
+    _ring_wait(&r->done, atomic_load_explicit(&r->tail, memory_order_relaxed));
+}
+
+static void _llog_dispatchf(const llog_logger *logger, const sinktable *table, llog_event *event, ...)
+{
+    va_list args;
+    va_start(args, event);
+    _llog_dispatch(logger, table, event, args);
+    va_end(args);
+}
+
+static void _ring_dispatch(const sinktable *table, const record rec[static 1], const char *msg)
+{
+    const llog_logger *logger = (void *) 0;
+    if (rec->logger) {
+        /* It may have been destroyed since. */
+        logger = _llog_logger_by_id(rec->logger);
+        if (!logger) {
+            counters *c = _llog_counters();
+            if (c) _count(&c->filtered, 1);
+            return;
+        }
+    }
+
+    llog_kv kv[LLOG_ASYNC_MAX_KV];
+    llog_kv ctxkv[LLOG_CTX_MAX + 1];
+    size_t at = rec->len;
+    size_t nkv = _kv_unpack(rec, &at, kv, rec->nkv);
+    size_t nctx = _kv_unpack(rec, &at, ctxkv, rec->nctx);
+    llog_context ctx = { .name = rec->named ? ctxkv[0].value.s : (void *) 0, .id = rec->tid,
+                         .kv = ctxkv + rec->named, .nkv = nctx - rec->named, };
+    llog_event event = { .level = rec->level, .file = rec->file, .func = rec->func, .line = rec->line,
+                         .format = "%s", .time = _llog_tm(rec->stamp.tv_sec), .stamp = rec->stamp,
+                         .kv = kv, .nkv = nkv, .ctx = &ctx, .msg = msg, .msglen = strlen(msg), };
+    if (!rec->formatted) {
+        event.packed = rec->args;
+        event.packedlen = rec->len;
+        event.origin = rec->format;
+    }
+    _llog_dispatchf(logger, table, &event, msg);
+}
+
+/*
+ * Dispatches up to LLOG_ASYNC_BATCH records of the ring. Returns how many were dispatched.
+ */
+static size_t _ring_drain(ring *r)
+{
+    record rec;
+    char small[512];
+    char *msg = small;
+    size_t msgsize = sizeof small;
+    size_t n = 0;
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    bool shared = _llog_async.policy == LLOG_ASYNC_DROP_OLDEST;
+    sinktable *table;
+
+    if (head == atomic_load_explicit(&r->tail, memory_order_acquire)) return 0;
+    if (_read_begin(&table)) return 0;
+    while (n < LLOG_ASYNC_BATCH) {
+        if (head == atomic_load_explicit(&r->tail, memory_order_acquire)) break;
+        if (shared) {
+            /* Once announced, a record the producer drops isn't overwritten before the copy ends. */
+            atomic_store_explicit(&r->copying, head + 1, memory_order_seq_cst);
+            size_t now = atomic_load_explicit(&r->head, memory_order_seq_cst);
+            if (now != head) {
+                atomic_store_explicit(&r->copying, 0, memory_order_release);
+                head = now;
+                continue;
+            }
+            rec = r->records[head & r->mask];
+            atomic_store_explicit(&r->copying, 0, memory_order_release);
+        }
+        else {
+            rec = r->records[head & r->mask];
+        }
+        if (!atomic_compare_exchange_strong_explicit(&r->head, &head, head + 1,
+                                                     memory_order_acq_rel, memory_order_acquire)) {
+            continue;   /* dropped by the producer while being copied */
+        }
+        head++;
+
+        if (rec.formatted) {
+            rec.args[sizeof rec.args - 1] = 0;
+            _ring_dispatch(table, &rec, (char *) rec.args);
+        }
+        else {
+            int k = llog_format_packed(msg, msgsize, rec.format, rec.args, rec.len);
+            if (k >= 0 && (size_t) k >= msgsize) {
+                char *big = malloc((size_t) k + 1);
+                if (big) {
+                    if (msg != small) free(msg);
+                    msg = big;
+                    msgsize = (size_t) k + 1;
+                    k = llog_format_packed(msg, msgsize, rec.format, rec.args, rec.len);
+                }
+            }
+            _ring_dispatch(table, &rec, k < 0 ? rec.format : msg);
+        }
+        atomic_store_explicit(&r->done, head, memory_order_release);
+        n++;
+    }
+    _read_end();
+    if (msg != small) free(msg);
+    return n;
+}
+
+/*
+ * Drains every ring once, freeing the ones whose thread exited. Only called by the consumer.
+ */
+static size_t _llog_async_drain(void)
+{
+    size_t n = 0;
+    ring *prev = (void *) 0;
+    ring *r = atomic_load_explicit(&_llog_async.rings, memory_order_acquire);
+
+    while (r) {
+        ring *next = r->next;
+        bool orphaned = atomic_load_explicit(&r->orphaned, memory_order_acquire);
+        size_t k = _ring_drain(r);
+        if (k) _llog_async_notify();
+        n += k;
+
+        if (orphaned && !k && atomic_load_explicit(&r->head, memory_order_acquire)
+                              == atomic_load_explicit(&r->tail, memory_order_acquire)) {
+            if (prev) {
+                prev->next = next;
+            }
+            else {
+                ring *expected = r;
+                if (!atomic_compare_exchange_strong_explicit(&_llog_async.rings, &expected, next,
+                                                             memory_order_acq_rel, memory_order_acquire)) {
+                    /* New rings were pushed meanwhile: r is no longer the head of the list. */
+                    for (prev = expected; prev->next != r; prev = prev->next)
+                        ;
+                    prev->next = next;
+                }
+            }
+            _ring_free(r);
+        }
+        else {
+            prev = r;
+        }
+        r = next;
+    }
+    return n;
+}
+
+static int _llog_drain(void *arg)
+{
+    (void) arg;
+
+    while (!atomic_load_explicit(&_llog_async.stop, memory_order_acquire)) {
+        if (_llog_async_drain()) continue;
+
+        /* Look once more after raising the flag, for records pushed before the producers could see it. */
+        atomic_store_explicit(&_llog_async.sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (_llog_async_drain()) {
+            atomic_store_explicit(&_llog_async.sleeping, false, memory_order_relaxed);
+            continue;
+        }
+        _mutex_lock(&_llog_async.mutex);
+        while (atomic_load_explicit(&_llog_async.sleeping, memory_order_relaxed)
+               && !atomic_load_explicit(&_llog_async.stop, memory_order_relaxed)) {
+            _cond_wait(&_llog_async.pushed, &_llog_async.mutex);
+        }
+        _mutex_unlock(&_llog_async.mutex);
+    }
+    return 0;
+}
+
+LLOG_LOCAL
+int llog_stop_async(void)
+{
+    int running = ASYNC_RUNNING;
+    if (!atomic_compare_exchange_strong_explicit(&_llog_async.state, &running, ASYNC_STOPPING,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        return 0;
+    }
+
+    /* Wakes up the consumer and the producers waiting for it, which see the state change. */
+    _mutex_lock(&_llog_async.mutex);
+    atomic_store_explicit(&_llog_async.stop, true, memory_order_release);
+    _cond_signal(&_llog_async.pushed);
+    _cond_broadcast(&_llog_async.drained);
+    _mutex_unlock(&_llog_async.mutex);
+    _thread_join(_llog_async.drain);
+    /* Events of producers that raced with the state change. */
+    while (_llog_async_drain())
+        ;
+    atomic_store_explicit(&_llog_async.state, ASYNC_OFF, memory_order_release);
+    return 0;
+}
+
+static void _llog_async_atexit(void)
+{
+    llog_stop_async();
+}
+
+LLOG_LOCAL
+int llog_start_async(size_t capacity, int policy)
+{
+    switch (policy) {
+    case LLOG_ASYNC_BLOCK:
+    case LLOG_ASYNC_DROP_NEWEST:
+    case LLOG_ASYNC_DROP_OLDEST:
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (!capacity || capacity > SIZE_MAX / 2 / sizeof(record)) return -EINVAL;
+
+#if defined(USE_C11THREADS_)
+    static once_flag aflag = ONCE_FLAG_INIT;
+    call_once(&aflag, _llog_async_init);
+#else
+    static pthread_once_t aflag = PTHREAD_ONCE_INIT;
+    pthread_once(&aflag, _llog_async_init);
+#endif
+    if (!_llog_async.ready) return -ELOCK;
+
+    int off = ASYNC_OFF;
+    if (!atomic_compare_exchange_strong_explicit(&_llog_async.state, &off, ASYNC_STARTING,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        return -EINVAL;
+    }
+
+    size_t pow2 = 1;
+    while (pow2 < capacity) pow2 <<= 1;
+    _llog_async.capacity = pow2;
+    _llog_async.policy = policy;
+    atomic_store_explicit(&_llog_async.stop, false, memory_order_relaxed);
+    atomic_store_explicit(&_llog_async.sleeping, false, memory_order_relaxed);
+
+    int status = _thread_create(&_llog_async.drain, _llog_drain, (void *) 0);
+    if (status) {
+        atomic_store_explicit(&_llog_async.state, ASYNC_OFF, memory_order_release);
+        return status;
+    }
+
+    static atomic_flag registered = ATOMIC_FLAG_INIT;
+    if (!atomic_flag_test_and_set(&registered)) {
+        atexit(_llog_async_atexit);
+    }
+    atomic_store_explicit(&_llog_async.state, ASYNC_RUNNING, memory_order_release);
+    return 0;
+}
+
+LLOG_LOCAL
+unsigned long long llog_async_dropped(void)
+{
+    return atomic_load_explicit(&_llog_async.dropped, memory_order_relaxed);
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#endif
+
+/*
+ * Logs an event with its fields (if any), queued in asynchronous mode or dispatched right away.
+ */
+static int _llog_emit(const llog_logger *logger, int level, const char *restrict file, const char *restrict func,
+                      unsigned long line, const llog_kv *kv, size_t nkv, const char *restrict format, va_list args)
+{
+    llog_event event = { .level = level, .file = file, .func = func, .line = line, .format = format,
+                         .kv = kv, .nkv = nkv, };
+    int status;
+
+#if defined(LLOG_HAS_THREADS_)
+    if (atomic_load_explicit(&_llog_async.state, memory_order_acquire) == ASYNC_RUNNING) {
+        va_list copy;
+        va_copy(copy, args);
+        status = _llog_async_push(logger, level, file, func, line, format, copy, kv, nkv);
+        va_end(copy);
+        if (status <= 0) return status;
+    }
+#endif
+
+    sinktable *table;
+    status = _read_begin(&table);
+    if (status) return status;
+
+    _llog_event_context(&event, (void *) 0);
+    event.ctx = _llog_context();
+    _llog_dispatch(logger, table, &event, args);
+    return _read_end();
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Flight recorder.
+ *
+ * Each thread records its events in a ring of its own, allocated on its first event and kept with its
+ * record (see tstate), without formatting them: a record holds the call site, the time and the packed
+ * arguments. A record is a seqlock: its writer clears its sequence number, fills it, and sets it to the
+ * index of the event plus one, so that a reader (possibly a signal handler interrupting the writer)
+ * recognizes and skips a record being overwritten.
+ *
+ * The dump formats the records itself, into a buffer on the stack written with write(2), since stdio,
+ * the time functions and malloc aren't async-signal-safe.
+ */
+#if !defined(LLOG_RECORDER_ARGS_SIZE)
+#  define LLOG_RECORDER_ARGS_SIZE 160U
+#endif
+#define LLOG_DUMP_BUFFER_SIZE 4096U
+
+#if defined(LLOG_POSIX_IO_)
+typedef struct {
+    atomic_size_t seq;
+    const char *file;
+    const char *func;
+    const char *format;
+    unsigned long line;
+    long long ns;
+    int level;
+    unsigned short len;             // of the packed arguments, LLOG_PACKED_NULL if they couldn't be packed
+    unsigned char args[LLOG_RECORDER_ARGS_SIZE];
+} flightrec;
+
+typedef struct flight {
+    atomic_size_t head;             // index of the next event
+    size_t mask;
+    flightrec recs[];
+} flight;
+
+static struct {
+    atomic_size_t nevents;          // per thread, 0 until set
+    atomic_int crashfd;
+} _llog_recorder = { .crashfd = -1, };
+
+#if !defined(LLOG_HAS_THREADS_)
+static _Atomic(flight *) _llog_flight_all;
+#endif
+
+static _Atomic(flight *) *_llog_flight_of(void)
+{
+#if defined(LLOG_HAS_THREADS_)
+    tstate *t = _llog_thread();
+    return t ? &t->flight : (void *) 0;
+#else
+    return &_llog_flight_all;
+#endif
+}
+
+static void _llog_record(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                         const char *restrict format, va_list args)
+{
+    _Atomic(flight *) *slot = _llog_flight_of();
+    if (!slot) return;
+    flight *f = atomic_load_explicit(slot, memory_order_relaxed);
+    if (!f) {
+        size_t n = atomic_load_explicit(&_llog_recorder.nevents, memory_order_relaxed);
+        f = n ? malloc(sizeof *f + n * sizeof f->recs[0]) : (void *) 0;
+        if (!f) return;
+        atomic_init(&f->head, 0);
+        f->mask = n - 1;
+        for (size_t i = 0; i < n; i++) atomic_init(&f->recs[i].seq, 0);
+        atomic_store_explicit(slot, f, memory_order_release);
+    }
+
+    size_t i = atomic_load_explicit(&f->head, memory_order_relaxed);
+    flightrec *r = &f->recs[i & f->mask];
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    r->file = file;
+    r->func = func;
+    r->format = format;
+    r->line = line;
+    r->ns = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    r->level = level;
+    r->len = LLOG_PACKED_NULL;
+
+    site *s = _llog_site(file, func, line, format);
+    if (s && s->nargs >= 0) {
+        va_list copy;
+        va_copy(copy, args);
+        size_t len = _llog_pack(s, r->args, sizeof r->args, copy);
+        va_end(copy);
+        if (len != SIZE_MAX) r->len = (unsigned short) len;
+    }
+    atomic_store_explicit(&r->seq, i + 1, memory_order_release);
+    atomic_store_explicit(&f->head, i + 1, memory_order_release);
+}
+
+LLOG_LOCAL
+int llog_start_recorder(size_t nevents, int level)
+{
+    if (!_valid_level(level)) return -EINVAL;
+    size_t n = 0;
+    if (nevents) {
+        if (nevents > SIZE_MAX / 2 / sizeof(flightrec)) return -EINVAL;
+        for (n = 1; n < nevents; n <<= 1)
+            ;
+        size_t expected = 0;
+        if (!atomic_compare_exchange_strong_explicit(&_llog_recorder.nevents, &expected, n,
+                                                     memory_order_relaxed, memory_order_relaxed)
+            && expected != n) {
+            return -EINVAL;
+        }
+    }
+
+    int status = _lock();
+    if (status) return status;
+    atomic_store_explicit(&_llog_recording, n ? level : LLOG_FATAL + 1, memory_order_relaxed);
+    _llog_update_threshold();
+    return _unlock();
+}
+
+/*
+ * Output of the dump, written when full.
+ */
+typedef struct {
+    int fd;
+    bool failed;
+    size_t used;
+    char buf[LLOG_DUMP_BUFFER_SIZE];
+} sigwriter;
+
+static void _sig_flush(sigwriter *w)
+{
+    for (size_t done = 0; done < w->used;) {
+        ssize_t n = write(w->fd, w->buf + done, w->used - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            w->failed = true;
+            break;
+        }
+        done += (size_t) n;
+    }
+    w->used = 0;
+}
+
+static void _sig_put(sigwriter *w, const char *s, size_t n)
+{
+    while (n) {
+        if (w->used == sizeof w->buf) _sig_flush(w);
+        size_t k = n < sizeof w->buf - w->used ? n : sizeof w->buf - w->used;
+        memcpy(w->buf + w->used, s, k);
+        w->used += k;
+        s += k;
+        n -= k;
+    }
+}
+
+static void _sig_puts(sigwriter *w, const char *s)
+{
+    _sig_put(w, s, strlen(s));
+}
+
+/*
+ * Writes value in base (8, 10 or 16), with at least width digits (none for 0 if width is 0, like printf).
+ */
+static void _sig_uint(sigwriter *w, unsigned long long value, unsigned base, int width, bool upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buf[24];
+    size_t i = sizeof buf;
+    while (value && i) {
+        buf[--i] = digits[value % base];
+        value /= base;
+    }
+    while (i && (int) (sizeof buf - i) < width) buf[--i] = '0';
+    _sig_put(w, buf + i, sizeof buf - i);
+}
+
+static void _sig_int(sigwriter *w, long long value, int width)
+{
+    if (value < 0) _sig_put(w, "-", 1);
+    _sig_uint(w, value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value, 10, width, false);
+}
+
+/*
+ * Writes a double with the given number of decimals (at most 9), or in magnitude only past 2^63.
+ */
+static void _sig_double(sigwriter *w, double value, int decimals)
+{
+    if (value != value) {
+        _sig_puts(w, "nan");
+        return;
+    }
+    if (value < 0) {
+        _sig_put(w, "-", 1);
+        value = -value;
+    }
+    if (value > 9.2e18) {
+        _sig_puts(w, value > DBL_MAX ? "inf" : "(large)");
+        return;
+    }
+    unsigned long long scale = 1;
+    if (decimals > 9) decimals = 9;
+    for (int i = 0; i < decimals; i++) scale *= 10;
+    unsigned long long whole = (unsigned long long) value;
+    unsigned long long frac = (unsigned long long) ((value - (double) whole) * (double) scale + 0.5);
+    if (frac >= scale) {
+        whole++;
+        frac -= scale;
+    }
+    _sig_uint(w, whole, 10, 1, false);
+    if (!decimals) return;
+    _sig_put(w, ".", 1);
+    _sig_uint(w, frac, 10, decimals, false);
+}
+
+/*
+ * Writes nanoseconds since the Epoch as an ISO 8601 UTC time, converting days to a civil date.
+ */
+static void _sig_time(sigwriter *w, long long ns)
+{
+    long long secs = ns / 1000000000LL;
+    long long days = secs / 86400, rem = secs % 86400;
+    if (rem < 0) {
+        rem += 86400;
+        days--;
+    }
+    long long z = days + 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    long long day = doy - (153 * mp + 2) / 5 + 1;
+    long long month = mp < 10 ? mp + 3 : mp - 9;
+    long long year = yoe + era * 400 + (month <= 2);
+
+    _sig_uint(w, (unsigned long long) year, 10, 4, false);
+    _sig_put(w, "-", 1);
+    _sig_uint(w, (unsigned long long) month, 10, 2, false);
+    _sig_put(w, "-", 1);
+    _sig_uint(w, (unsigned long long) day, 10, 2, false);
+    _sig_put(w, "T", 1);
+    _sig_uint(w, (unsigned long long) (rem / 3600), 10, 2, false);
+    _sig_put(w, ":", 1);
+    _sig_uint(w, (unsigned long long) (rem / 60 % 60), 10, 2, false);
+    _sig_put(w, ":", 1);
+    _sig_uint(w, (unsigned long long) (rem % 60), 10, 2, false);
+    _sig_put(w, ".", 1);
+    _sig_uint(w, (unsigned long long) (ns % 1000000000LL), 10, 9, false);
+    _sig_put(w, "Z", 1);
+}
+
+/*
+ * Renders the message of a record, like llog_format_packed but without snprintf.
+ */
+static void _sig_message(sigwriter *w, const flightrec *r)
+{
+    const unsigned char *a = r->args;
+    const unsigned char *aend = a + (r->len == LLOG_PACKED_NULL ? 0 : r->len);
+    const char *p = r->format;
+
+#define TAKE_(T, V)                                                            \
+    do {                                                                       \
+        if ((size_t) (aend - a) < sizeof(T)) goto raw;                         \
+        memcpy(&(V), a, sizeof(T));                                            \
+        a += sizeof(T);                                                        \
+    } while (0)
+
+    if (r->len == LLOG_PACKED_NULL) goto raw;
+    for (const char *q; (q = strchr(p, '%')); ) {
+        _sig_put(w, p, (size_t) (q - p));
+
+        int tag, stars, star[2] = { 0, -1, };
+        p = _llog_conv(q + 1, &tag, &stars);
+        if (!p) goto raw;
+        if (tag == ARG_NONE) {
+            _sig_put(w, "%", 1);
+            continue;
+        }
+        for (int i = 0; i < stars; i++) TAKE_(int, star[i]);
+        const char *dot = memchr(q, '.', (size_t) (p - q));
+        int prec = !dot ? -1 : dot[1] == '*' ? star[stars - 1] : 0;
+        for (const char *d = dot ? dot + 1 : p; d < p && *d >= '0' && *d <= '9'; d++) prec = prec * 10 + *d - '0';
+        int digits = prec < 0 ? 1 : prec;
+        char conv = p[-1];
+        bool isunsigned = conv == 'u' || conv == 'o' || conv == 'x' || conv == 'X';
+        unsigned base = conv == 'o' ? 8 : conv == 'x' || conv == 'X' ? 16 : 10;
+
+        switch (tag) {
+        case ARG_INT: {
+            int v;
+            TAKE_(int, v);
+            if (conv == 'c') {
+                char c = (char) v;
+                _sig_put(w, &c, 1);
+            }
+            else if (isunsigned) {
+                _sig_uint(w, (unsigned) v, base, digits, conv == 'X');
+            }
+            else {
+                _sig_int(w, v, digits);
+            }
+            break;
+        }
+#define INTEGER_(T)                                                                                     \
+        do {                                                                                            \
+            T v;                                                                                        \
+            TAKE_(T, v);                                                                                \
+            if (isunsigned) _sig_uint(w, (unsigned long long) v, base, digits, conv == 'X');            \
+            else _sig_int(w, (long long) v, digits);                                                    \
+        } while (0)
+        case ARG_LONG:    INTEGER_(long);      break;
+        case ARG_LLONG:   INTEGER_(long long); break;
+        case ARG_INTMAX:  INTEGER_(intmax_t);  break;
+        case ARG_SIZE:    INTEGER_(size_t);    break;
+        case ARG_PTRDIFF: INTEGER_(ptrdiff_t); break;
+#undef INTEGER_
+        case ARG_DOUBLE: {
+            double v;
+            TAKE_(double, v);
+            _sig_double(w, v, prec < 0 ? 6 : prec);
+            break;
+        }
+        case ARG_LDOUBLE: {
+            long double v;
+            TAKE_(long double, v);
+            _sig_double(w, (double) v, prec < 0 ? 6 : prec);
+            break;
+        }
+        case ARG_PTR: {
+            void *v;
+            TAKE_(void *, v);
+            _sig_put(w, "0x", 2);
+            _sig_uint(w, (unsigned long long) (uintptr_t) v, 16, 1, false);
+            break;
+        }
+        case ARG_STR: {
+            unsigned short n;
+            TAKE_(unsigned short, n);
+            if (n == LLOG_PACKED_NULL) {
+                _sig_puts(w, "(null)");
+                break;
+            }
+            if ((size_t) (aend - a) < n) goto raw;
+            _sig_put(w, (const char *) a, prec >= 0 && prec < n ? (size_t) prec : n);
+            a += n;
+            break;
+        }
+        }
+    }
+    _sig_puts(w, p);
+    return;
+
+raw:
+    /* Arguments missing or unexpected: the rest of the format is written as is. */
+    _sig_puts(w, p);
+#undef TAKE_
+}
+
+static void _sig_record(sigwriter *w, const flightrec *r)
+{
+    static const char pad[] = "       ";
+    const char *level = LLEVEL_STR[r->level];
+    size_t n = strlen(level);
+
+    _sig_time(w, r->ns);
+    _sig_put(w, " ", 1);
+    _sig_put(w, level, n);
+    _sig_put(w, pad, n < sizeof pad - 1 ? sizeof pad - n : 1);
+    _sig_put(w, "[", 1);
+    _sig_puts(w, r->file);
+    _sig_put(w, "]:", 2);
+    _sig_puts(w, r->func);
+    _sig_put(w, ":", 1);
+    _sig_uint(w, r->line, 10, 1, false);
+    _sig_put(w, ": ", 2);
+    _sig_message(w, r);
+    _sig_put(w, "\n", 1);
+}
+
+/*
+ * Writes the complete records of a ring, oldest first.
+ */
+static void _sig_flight(sigwriter *w, const flight *f, unsigned long thread)
+{
+    size_t head = atomic_load_explicit(&f->head, memory_order_acquire);
+    size_t n = f->mask + 1;
+
+    _sig_puts(w, "--- thread ");
+    _sig_uint(w, thread, 10, 1, false);
+    _sig_puts(w, thread ? " ---\n" : " (current) ---\n");
+    for (size_t i = head > n ? head - n : 0; i < head; i++) {
+        const flightrec *r = &f->recs[i & f->mask];
+        flightrec copy;
+        size_t offset = offsetof(flightrec, file);
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) != i + 1) continue;
+        memcpy((char *) &copy + offset, (const char *) r + offset, sizeof copy - offset);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&r->seq, memory_order_relaxed) != i + 1) continue;
+        if (copy.level < LLOG_TRACE || copy.level > LLOG_FATAL) continue;
+        _sig_record(w, &copy);
+    }
+}
+
+LLOG_LOCAL
+int llog_dump_recorder(int fd)
+{
+    sigwriter w = { .fd = fd, };
+    _sig_puts(&w, "--- llog flight recorder ---\n");
+
+    flight *mine = (void *) 0;
+#if defined(LLOG_HAS_THREADS_)
+    if (_llog_tstate) mine = atomic_load_explicit(&_llog_tstate->flight, memory_order_acquire);
+    if (mine) _sig_flight(&w, mine, 0);
+    unsigned long thread = 1;
+    for (tstate *t = atomic_load_explicit(&_llog_threads.threads, memory_order_acquire); t; t = t->next) {
+        flight *f = atomic_load_explicit(&t->flight, memory_order_acquire);
+        if (f && f != mine) _sig_flight(&w, f, thread++);
+    }
+#else
+    mine = atomic_load_explicit(&_llog_flight_all, memory_order_acquire);
+    if (mine) _sig_flight(&w, mine, 0);
+#endif
+    _sig_flush(&w);
+    return w.failed ? -EIO : 0;
+}
+
+static void _llog_on_crash(int signo)
+{
+    int saved = errno;
+    int fd = atomic_load_explicit(&_llog_recorder.crashfd, memory_order_relaxed);
+    sigwriter w = { .fd = fd, };
+    _sig_puts(&w, "--- llog: caught signal ");
+    _sig_uint(&w, (unsigned) signo, 10, 1, false);
+    _sig_puts(&w, " ---\n");
+    _sig_flush(&w);
+    llog_dump_recorder(fd);
+    errno = saved;
+
+    /* The handler was reset: the signal now terminates the process. */
+    raise(signo);
+}
+
+LLOG_LOCAL
+int llog_dump_on_crash(int fd)
+{
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, };
+    atomic_store_explicit(&_llog_recorder.crashfd, fd, memory_order_relaxed);
+
+    struct sigaction action = { .sa_handler = _llog_on_crash, };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (size_t i = 0; i < sizeof signals / sizeof signals[0]; i++) {
+        if (sigaction(signals[i], &action, (void *) 0)) return -EINVAL;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#else
+
+static void _llog_record(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                         const char *restrict format, va_list args)
+{
+    (void) level;
+    (void) file;
+    (void) func;
+    (void) line;
+    (void) format;
+    (void) args;
+}
+
+LLOG_LOCAL
+int llog_start_recorder(size_t nevents, int level)
+{
+    (void) nevents;
+    (void) level;
+    return -EINVAL;
+}
+
+LLOG_LOCAL
+int llog_dump_recorder(int fd)
+{
+    (void) fd;
+    return -EINVAL;
+}
+
+LLOG_LOCAL
+int llog_dump_on_crash(int fd)
+{
+    (void) fd;
+    return -EINVAL;
+}
+
+/*-------------------------------------------------------------------------------------------------------------*/
+#endif
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Rate limiting and duplicate suppression.
+ *
+ * Both are decided per call site, before anything is formatted, with atomics on the entry of the site in
+ * the call site table. The rate limit is a token bucket in its GCRA form: a site keeps the theoretical
+ * arrival time of its next event, which each event let through pushes back by the interval, and an event
+ * is let through unless it comes earlier than that by more than the burst allows. A duplicate is an event
+ * whose packed arguments (and fields) hash like those of the last event of its site let through, within the
+ * window. What was suppressed is reported from the same site before its next event, or by llog_flush.
+ */
+static struct {
+    atomic_llong interval;          // nanoseconds between events of a call site, 0 if not limited
+    atomic_llong tolerance;         // how early an event can come, in nanoseconds
+    atomic_llong window;            // in nanoseconds, 0 if duplicates aren't suppressed
+} _llog_limits;
+
+static uint64_t _hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Hashes the arguments and fields of an event, or returns 0 if they can't be packed.
+ */
+static uint64_t _llog_args_hash(const site *s, va_list args, const llog_kv *kv, size_t nkv)
+{
+    unsigned char buf[LLOG_BINARY_ARGS_SIZE];
+    size_t len = SIZE_MAX;
+    if (s->nargs >= 0) {
+        va_list copy;
+        va_copy(copy, args);
+        len = _llog_pack(s, buf, sizeof buf, copy);
+        va_end(copy);
+    }
+    if (len == SIZE_MAX) return 0;
+
+    uint64_t h = _hash(0xcbf29ce484222325ULL, buf, len);
+    for (size_t i = 0; i < nkv; i++) {
+        if (kv[i].key) h = _hash(h, kv[i].key, strlen(kv[i].key));
+        switch (kv[i].type) {
+        case LLOG_KV_TYPE_BOOL: h = _hash(h, &kv[i].value.b, sizeof kv[i].value.b);  break;
+        case LLOG_KV_TYPE_STR:
+            if (kv[i].value.s) h = _hash(h, kv[i].value.s, strlen(kv[i].value.s));
+            break;
+        default:                h = _hash(h, &kv[i].value.u, sizeof kv[i].value.u);  break;
+        }
+    }
+    return h | 1;
+}
+
+static int _llog_emitf(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                       const char *restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int status = _llog_emit((void *) 0, level, file, func, line, (void *) 0, 0, format, args);
+    va_end(args);
+    return status;
+}
+
+/*
+ * Logs, from the site, what was suppressed there since its last event.
+ */
+static void _llog_report(site *s, int level)
+{
+    unsigned long repeats = atomic_exchange_explicit(&s->repeats, 0, memory_order_relaxed);
+    unsigned long limited = atomic_exchange_explicit(&s->limited, 0, memory_order_relaxed);
+
+    if (repeats) {
+        _llog_emitf(level, s->file, s->func, s->line, "last message repeated %lu times", repeats);
+    }
+    if (limited) {
+        _llog_emitf(level, s->file, s->func, s->line, "%lu messages suppressed by the rate limit", limited);
+    }
+}
+
+/*
+ * Returns true if the event must be suppressed.
+ */
+static bool _llog_limit(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                        const char *restrict format, va_list args, const llog_kv *kv, size_t nkv)
+{
+    long long interval = atomic_load_explicit(&_llog_limits.interval, memory_order_relaxed);
+    long long window = atomic_load_explicit(&_llog_limits.window, memory_order_relaxed);
+    if ((!interval && !window) || level == LLOG_FATAL) return false;
+
+    site *s = _llog_site(file, func, line, format);
+    if (!s) return false;
+    atomic_store_explicit(&s->level, level, memory_order_relaxed);
+    long long now = _now();
+
+    uint64_t hash = 0;
+    if (window) {
+        hash = _llog_args_hash(s, args, kv, nkv);
+        if (hash && hash == atomic_load_explicit(&s->lasthash, memory_order_relaxed)
+            && now - atomic_load_explicit(&s->lastns, memory_order_relaxed) < window) {
+            atomic_fetch_add_explicit(&s->repeats, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+    if (interval) {
+        long long tolerance = atomic_load_explicit(&_llog_limits.tolerance, memory_order_relaxed);
+        long long tat = atomic_load_explicit(&s->tat, memory_order_relaxed);
+        for (;;) {
+            long long t = tat > now ? tat : now;
+            if (t - now > tolerance) {
+                atomic_fetch_add_explicit(&s->limited, 1, memory_order_relaxed);
+                return true;
+            }
+            if (atomic_compare_exchange_weak_explicit(&s->tat, &tat, t + interval,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+    if (window) {
+        atomic_store_explicit(&s->lasthash, hash, memory_order_relaxed);
+        atomic_store_explicit(&s->lastns, now, memory_order_relaxed);
+    }
+    if (atomic_load_explicit(&s->repeats, memory_order_relaxed)
+        || atomic_load_explicit(&s->limited, memory_order_relaxed)) {
+        _llog_report(s, level);
+    }
+    return false;
+}
+
+static void _llog_limits_flush(void)
+{
+    for (size_t i = 0; i < LLOG_MAX_SITES; i++) {
+        site *s = &_llog_sites[i];
+        if (atomic_load_explicit(&s->state, memory_order_acquire) != SITE_READY) continue;
+        if (atomic_load_explicit(&s->repeats, memory_order_relaxed)
+            || atomic_load_explicit(&s->limited, memory_order_relaxed)) {
+            _llog_report(s, atomic_load_explicit(&s->level, memory_order_relaxed));
+        }
+    }
+}
+
+LLOG_LOCAL
+int llog_set_rate_limit(unsigned long rate, unsigned long burst)
+{
+    if (rate > 1000000000UL || (rate && !burst) || burst > LLONG_MAX / 1000000000LL) return -EINVAL;
+
+    long long interval = rate ? 1000000000LL / (long long) rate : 0;
+    atomic_store_explicit(&_llog_limits.tolerance, interval * ((long long) burst - 1), memory_order_relaxed);
+    atomic_store_explicit(&_llog_limits.interval, interval, memory_order_relaxed);
+    return 0;
+}
+
+LLOG_LOCAL
+int llog_set_dedup(unsigned long window)
+{
+    if (window > LLONG_MAX / 1000000LL) return -EINVAL;
+    atomic_store_explicit(&_llog_limits.window, (long long) window * 1000000LL, memory_order_relaxed);
     return 0;
 }
+
+/*
+ * Logs an event with the logger (the default one if null) unless the rate limit or the duplicate suppression
+ * drop it.
+ */
+static int _llog_vlog(const llog_logger *logger, int level, const char *restrict file, const char *restrict func,
+                      unsigned long line, const llog_kv *kv, size_t nkv, const char *restrict format, va_list args)
+{
+    counters *c = _llog_counters();
+    if (c) _count(&c->events[level], 1);
+    if (level >= atomic_load_explicit(&_llog_recording, memory_order_relaxed)) {
+        _llog_record(level, file, func, line, format, args);
+        if (level < atomic_load_explicit(logger ? &logger->outputs : &_llog_outputs, memory_order_relaxed)) {
+            if (c) _count(&c->filtered, 1);
+            return 0;
+        }
+    }
+    _llog_reload_if_pending();
+    if (_llog_limit(level, file, func, line, format, args, kv, nkv)) {
+        if (c) _count(&c->limited, 1);
+        return 0;
+    }
+    return _llog_emit(logger, level, file, func, line, kv, nkv, format, args);
+}
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 5, 6)))
+#endif
+LLOG_LOCAL
+int _llog_log(int level, const char *restrict file, const char *restrict func,
+              unsigned long line, const char *restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int status = _llog_vlog((void *) 0, level, file, func, line, (void *) 0, 0, format, args);
+    va_end(args);
+    return status;
+}
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 6, 7)))
+#endif
+LLOG_LOCAL
+int _llog_logger_log(const llog_logger *logger, int level, const char *restrict file, const char *restrict func,
+                     unsigned long line, const char *restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int status = _llog_vlog(logger, level, file, func, line, (void *) 0, 0, format, args);
+    va_end(args);
+    return status;
+}
+
+static int _llog_logf_kv(const llog_logger *logger, int level, const char *restrict file,
+                         const char *restrict func, unsigned long line, const llog_kv *kv, size_t nkv,
+                         const char *restrict format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int status = _llog_vlog(logger, level, file, func, line, kv, nkv, format, args);
+    va_end(args);
+    return status;
+}
+
+LLOG_LOCAL
+int _llog_log_kv(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                 const char *restrict msg, const llog_kv *kv, size_t nkv)
+{
+    return _llog_logf_kv((void *) 0, level, file, func, line, kv, nkv, "%s", msg ? msg : "");
+}
+
+LLOG_LOCAL
+int _llog_logger_log_kv(const llog_logger *logger, int level, const char *restrict file,
+                        const char *restrict func, unsigned long line, const char *restrict msg,
+                        const llog_kv *kv, size_t nkv)
+{
+    return _llog_logf_kv(logger, level, file, func, line, kv, nkv, "%s", msg ? msg : "");
+}
+
+/*------------------------------------------------------------------------------------------------------------*/
+/*
+ * Statistics snapshot.
+ */
+static void _sink_stats(llog_sink_stats *out, sink *s, const llog_logger *logger)
+{
+    static const char *const kinds[] = { "callback", "fp", "file", "mmap", "socket", };
+    *out = (llog_sink_stats){
+        .kind = s == &_llog.stderrsink ? "stderr"
+              : s->cbfunc == _json_callback ? "json"
+              : s->cbfunc == _binary_callback ? "binary"
+              : kinds[s->kind],
+        .logger = logger,
+        .level = atomic_load_explicit(&s->level, memory_order_relaxed),
+        .events = atomic_load_explicit(&s->events, memory_order_relaxed),
+        .bytes = atomic_load_explicit(&s->bytes, memory_order_relaxed),
+        .nanoseconds = atomic_load_explicit(&s->nanoseconds, memory_order_relaxed),
+        .lockwait = atomic_load_explicit(&s->lockwait, memory_order_relaxed),
+    };
+    if (s->slot >= 0) {
+        unsigned long long events, bytes;
+        _slot_totals(s->slot, &events, &bytes);
+        out->events += events - s->baseevents;
+        out->bytes += bytes - s->basebytes;
+    }
+    if (s == &_llog.stderrsink) {
+        out->id = stderr;
+        out->level = atomic_load_explicit(&_llog.level, memory_order_relaxed);
+    }
+    else if (s->kind == SINK_CALLBACK || s->kind == SINK_FP) {
+        out->id = s->key;
+    }
+    else {
+        snprintf(out->name, sizeof out->name, "%s", (const char *) s->key);
+    }
+}
+
+static void _counters_add(llog_stats *stats, counters *c)
+{
+    for (int level = LLOG_TRACE; level <= LLOG_FATAL; level++) {
+        stats->events[level] += atomic_load_explicit(&c->events[level], memory_order_relaxed);
+    }
+    stats->filtered += atomic_load_explicit(&c->filtered, memory_order_relaxed);
+    stats->limited += atomic_load_explicit(&c->limited, memory_order_relaxed);
+    stats->lockwait += atomic_load_explicit(&c->lockwait, memory_order_relaxed);
+}
+
+LLOG_LOCAL
+int llog_get_stats(llog_stats *restrict stats, llog_sink_stats *restrict sinks, size_t *restrict nsinks)
+{
+    if (!stats || (nsinks && *nsinks && !sinks)) return -EINVAL;
+
+    *stats = (llog_stats){ .socketdropped = llog_socket_dropped(), };
+#if defined(LLOG_HAS_THREADS_)
+    stats->asyncdropped = llog_async_dropped();
+    for (tstate *t = atomic_load_explicit(&_llog_threads.threads, memory_order_acquire); t; t = t->next) {
+        _counters_add(stats, &t->counters);
+    }
+#else
+    _counters_add(stats, &_llog_counters_all);
+#endif
+    if (!nsinks) return 0;
+
+    sinktable *table;
+    int status = _read_begin(&table);
+    if (status) return status;
+    size_t size = *nsinks;
+    if (size) _sink_stats(&sinks[0], &_llog.stderrsink, (void *) 0);
+    *nsinks = 1;
+    const llog_logger *logger = (void *) 0;
+    for (;;) {
+        for (size_t i = 0; table && i < table->n; i++, ++*nsinks) {
+            if (*nsinks < size) _sink_stats(&sinks[*nsinks], table->sinks[i], logger);
+        }
+        logger = logger ? atomic_load_explicit(&logger->next, memory_order_acquire)
+                        : atomic_load_explicit(&_llog_loggers, memory_order_acquire);
+        if (!logger) break;
+        table = atomic_load_explicit(&logger->table, memory_order_acquire);
+    }
+    return _read_end();
+}
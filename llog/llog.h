@@ -12,10 +12,11 @@
  */
 
 #if defined(__STDC_VERSION__)
-#  if (__STDC_VERSION__ >= 201112L)
-#    if !defined(__STDC_NO_THREADS__)
-#      define USE_C11THREADS_ 1
-#    endif
+#  if (__STDC_VERSION__ < 201112L)
+#    error "llog requires C11 (timespec_get, atomics, _Thread_local and aligned_alloc)."
+#  endif
+#  if !defined(__STDC_NO_THREADS__)
+#    define USE_C11THREADS_ 1
 #  endif
 #  if defined(__unix__) && !defined(USE_C11THREADS_)
 #    include <unistd.h>
@@ -45,6 +46,13 @@
 #  endif
 #endif
 
+#if defined(USE_C11THREADS_) || defined(USE_PTHREADS_) || defined(USE_WINPTHREADS_)
+#  define LLOG_HAS_THREADS_ 1
+#  define LLOG_TLS_ _Thread_local
+#else
+#  define LLOG_TLS_
+#endif
+
 #if defined(LLOG_COMPILE_WITH_DLL)  // Compiling with a shared library
 #  if !defined(_WIN32) && defined(__GNUC__) && __GNUC__ >= 4
 #    define LLOG_LOCAL __attribute__((visibility("hidden")))  // When compiled with a shared lib, only interface with the lib
@@ -59,6 +67,10 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#if defined(__STDC_NO_ATOMICS__)
+#  error "llog requires C11 atomics."
+#endif
+#include <stdatomic.h>
 
 enum {
     LLOG_TRACE=0,
@@ -69,6 +81,56 @@ enum {
     LLOG_FATAL
 };
 
+/**
+ * @brief Level of a logger that takes the level of its parent (see @c llog_logger_set_level).
+ */
+#define LLOG_INHERIT (-1)
+
+/**
+ * @brief A typed field of a structured event (see @c llog_info_kv).
+ */
+typedef struct {
+    const char *key;
+    int type;                ///< One of the @c LLOG_KV_TYPE_ values
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        bool b;
+        const char *s;
+    } value;
+} llog_kv;
+
+enum {
+    LLOG_KV_TYPE_INT=0,
+    LLOG_KV_TYPE_UINT,
+    LLOG_KV_TYPE_DOUBLE,
+    LLOG_KV_TYPE_BOOL,
+    LLOG_KV_TYPE_STR
+};
+
+/**
+ * @name Field constructors.
+ * @brief Fields of the structured log macros. @c K is the key and @c V the value.
+ */
+///@{
+#define LLOG_KV_INT(K, V)    ((llog_kv){ .key = (K), .type = LLOG_KV_TYPE_INT, .value.i = (V) })
+#define LLOG_KV_UINT(K, V)   ((llog_kv){ .key = (K), .type = LLOG_KV_TYPE_UINT, .value.u = (V) })
+#define LLOG_KV_DOUBLE(K, V) ((llog_kv){ .key = (K), .type = LLOG_KV_TYPE_DOUBLE, .value.d = (V) })
+#define LLOG_KV_BOOL(K, V)   ((llog_kv){ .key = (K), .type = LLOG_KV_TYPE_BOOL, .value.b = (V) })
+#define LLOG_KV_STR(K, V)    ((llog_kv){ .key = (K), .type = LLOG_KV_TYPE_STR, .value.s = (V) })
+///@}
+
+/**
+ * @brief Diagnostic context of the thread that logged an event.
+ */
+typedef struct {
+    const char *name;        ///< Name of the thread, null if it wasn't named
+    unsigned long id;        ///< Number of the thread, in the order threads first logged (from 1)
+    const llog_kv *kv;       ///< Context fields, outermost first
+    size_t nkv;              ///< Number of fields in @c kv
+} llog_context;
+
 typedef struct {
     int level;               ///< Logging level
     unsigned long line;      ///< Line number
@@ -76,18 +138,96 @@ typedef struct {
     const char *file;        ///< File name
     const char *func;        ///< Function name
     void *logobj;            ///< i.e. a file stream
-    struct tm *time;         ///< Log time
+    struct tm *time;         ///< Log time, local or UTC (valid during the callback)
+    struct timespec stamp;   ///< Log time, with nanosecond resolution
+    const void *packed;      ///< Arguments captured at the call site, if formatting was deferred
+    size_t packedlen;        ///< Number of bytes in @c packed
+    const char *origin;      ///< Format string @c packed was captured for
+    const llog_kv *kv;       ///< Fields of a structured event
+    size_t nkv;              ///< Number of fields in @c kv
+    const llog_context *ctx; ///< Context of the thread that logged the event (valid during the callback)
+    const char *msg;         ///< Message formatted once for all the outputs (valid during the callback)
+    size_t msglen;           ///< Length of @c msg
+    const char *logger;      ///< Name of the logger it was logged with, null for the default one
     va_list args;            ///< Argument list provided to the format string
 } llog_event;
 
+enum {
+    LLOG_ASYNC_BLOCK=0,      ///< Producers wait for room in their buffer
+    LLOG_ASYNC_DROP_NEWEST,  ///< The event being logged is discarded
+    LLOG_ASYNC_DROP_OLDEST   ///< The oldest buffered event is discarded
+};
+
+/**
+ * @brief Buffering and rotation options of @c llog_add_file.
+ */
+typedef struct {
+    size_t bufsize;          ///< Size of the buffer, in bytes (0 writes every event)
+    unsigned long interval;  ///< Maximum time an event stays buffered, in milliseconds (0 for no limit)
+    int flushlevel;          ///< Events of this level or above are written immediately
+    bool truncate;           ///< Truncates the file instead of appending to it
+    unsigned long long maxsize; ///< Rotates the file before it exceeds this size, in bytes (0 for no limit)
+    unsigned long period;    ///< Rotates the file at multiples of this many seconds since the Epoch (0 never)
+    unsigned keep;           ///< Number of rotated files kept, as path.1 (the newest) to path.keep
+    bool compress;           ///< Compresses the rotated files with gzip, as path.1.gz to path.keep.gz
+} llog_file_opts;
+
+/**
+ * @brief Default options of @c llog_add_file: a 64 KiB buffer, written at least every
+ * second and after events of level @c LLOG_ERROR or above.
+ */
+#define LLOG_FILE_DEFAULTS { .bufsize = 65536U, .interval = 1000UL, .flushlevel = LLOG_ERROR, .truncate = false, \
+                            .maxsize = 0U, .period = 0UL, .keep = 5U, .compress = false, }
+
+/**
+ * @brief Batching and framing options of @c llog_add_socket.
+ */
+typedef struct {
+    size_t bufsize;          ///< Events waiting to be sent, in bytes; the ones that don't fit are dropped
+    unsigned long interval;  ///< Maximum time an event waits to be sent, in milliseconds
+    bool rfc5424;            ///< Sends syslog messages (RFC 5424) instead of the lines of @c llog_add_file
+    int facility;            ///< Syslog facility of the messages (1 is user-level)
+    const char *appname;     ///< Syslog APP-NAME of the messages, or null for none
+} llog_socket_opts;
+
+/**
+ * @brief Default options of @c llog_add_socket: 1 MiB of lines, sent at least every
+ * 100 milliseconds.
+ */
+#define LLOG_SOCKET_DEFAULTS { .bufsize = 1048576U, .interval = 100UL, .rfc5424 = false, .facility = 1, \
+                               .appname = (void *) 0, }
+
+enum {
+    LLOG_TIME_SECONDS=0,     ///< Timestamps without fractional seconds
+    LLOG_TIME_MILLIS,        ///< Timestamps with milliseconds
+    LLOG_TIME_MICROS,        ///< Timestamps with microseconds
+    LLOG_TIME_NANOS,         ///< Timestamps with nanoseconds
+    LLOG_TIME_UTC=4,         ///< UTC instead of local time
+    LLOG_TIME_ISO8601=8      ///< ISO 8601 timestamps, with their date and UTC offset
+};
+
 typedef void (*llog_callback)(llog_event event);
+
+/**
+ * @brief A named logger, with its own level and outputs (see @c llog_logger_create).
+ */
+typedef struct llog_logger llog_logger;
 typedef int (*llog_lock)(bool lockit /* or unlock it */, void *lockobj);
 
+/**
+ * @brief Calls below this level compile to nothing (their arguments are never
+ * evaluated). Can be defined at compile time, e.g., @c -DLLOG_MIN_LEVEL=LLOG_INFO.
+ */
+#if !defined(LLOG_MIN_LEVEL)
+#  define LLOG_MIN_LEVEL LLOG_TRACE
+#endif
+
 /**
  * @name Log macros.
  * @brief Log with trace, debug, info, warn, error, or fatal options.
  *
  * @remark Called with @a F as formatting string and its matching arguments.
+ * @remark The arguments are only evaluated if some output accepts the level.
  *
  * @retval 0 on success
  * @retval -ELOCK on locking/unlocking protocol failure
@@ -101,6 +241,79 @@ typedef int (*llog_lock)(bool lockit /* or unlock it */, void *lockobj);
 #define llog_fatal(...) _llog_with_context(LLOG_FATAL, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
 ///@}
 
+/**
+ * @name Logger macros.
+ * @brief Log with the logger @a L (see @c llog_logger_create), or with the default logger
+ * if it is null, e.g., @c llog_logger_debug(http, "request %d", id) and
+ * @c llog_logger_info_kv(http, "connected", LLOG_KV_INT("conn", id)).
+ *
+ * @remark @a L is evaluated twice.
+ *
+ * @return @see Log macros
+ */
+///@{
+#define llog_logger_trace(L, ...) _llog_logger_with_context(L, LLOG_TRACE, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_logger_debug(L, ...) _llog_logger_with_context(L, LLOG_DEBUG, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_logger_info(L, ...)  _llog_logger_with_context(L, LLOG_INFO, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_logger_warn(L, ...)  _llog_logger_with_context(L, LLOG_WARN, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_logger_error(L, ...) _llog_logger_with_context(L, LLOG_ERROR, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_logger_fatal(L, ...) _llog_logger_with_context(L, LLOG_FATAL, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+
+#define llog_logger_trace_kv(L, M, ...) _llog_logger_kv_with_context(L, LLOG_TRACE, M, __VA_ARGS__)
+#define llog_logger_debug_kv(L, M, ...) _llog_logger_kv_with_context(L, LLOG_DEBUG, M, __VA_ARGS__)
+#define llog_logger_info_kv(L, M, ...)  _llog_logger_kv_with_context(L, LLOG_INFO, M, __VA_ARGS__)
+#define llog_logger_warn_kv(L, M, ...)  _llog_logger_kv_with_context(L, LLOG_WARN, M, __VA_ARGS__)
+#define llog_logger_error_kv(L, M, ...) _llog_logger_kv_with_context(L, LLOG_ERROR, M, __VA_ARGS__)
+#define llog_logger_fatal_kv(L, M, ...) _llog_logger_kv_with_context(L, LLOG_FATAL, M, __VA_ARGS__)
+///@}
+
+/**
+ * @name Structured log macros.
+ * @brief Log the message @a M (not a format string) with one or more typed fields,
+ * e.g., @c llog_info_kv("connected", LLOG_KV_INT("conn", id), LLOG_KV_STR("peer", addr)).
+ *
+ * @remark Text outputs write the fields after the message as key="value" pairs, and
+ * @c llog_add_json_fp writes them as members of the event's object.
+ *
+ * @return @see Log macros
+ */
+///@{
+#define llog_trace_kv(M, ...) _llog_kv_with_context(LLOG_TRACE, M, __VA_ARGS__)
+#define llog_debug_kv(M, ...) _llog_kv_with_context(LLOG_DEBUG, M, __VA_ARGS__)
+#define llog_info_kv(M, ...)  _llog_kv_with_context(LLOG_INFO, M, __VA_ARGS__)
+#define llog_warn_kv(M, ...)  _llog_kv_with_context(LLOG_WARN, M, __VA_ARGS__)
+#define llog_error_kv(M, ...) _llog_kv_with_context(LLOG_ERROR, M, __VA_ARGS__)
+#define llog_fatal_kv(M, ...) _llog_kv_with_context(LLOG_FATAL, M, __VA_ARGS__)
+///@}
+
+/**
+ * @name Sampling log macros.
+ * @brief Log only one in @a N calls of the call site, or each call with probability @a P,
+ * e.g., @c llog_debug_every_n(1000, "request %d", id) or @c llog_debug_sampled(0.01, "request %d", id).
+ *
+ * @remark The arguments are only evaluated, and the event only logged, if the call is sampled.
+ * @remark Calls filtered by the level don't count, so the first call of a call site accepted
+ * by the level is logged.
+ * @remark The @c _every_n macros are statements, since each call site keeps its own counter.
+ * An @a N of 1 or less logs every call. The @c _sampled macros return 0 if the call isn't sampled and
+ * draw from a per-thread pseudo-random generator.
+ *
+ * @return @see Log macros
+ */
+///@{
+#define llog_trace_every_n(N, ...) _llog_every_n(LLOG_TRACE, N, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_debug_every_n(N, ...) _llog_every_n(LLOG_DEBUG, N, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_info_every_n(N, ...)  _llog_every_n(LLOG_INFO, N, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_warn_every_n(N, ...)  _llog_every_n(LLOG_WARN, N, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_error_every_n(N, ...) _llog_every_n(LLOG_ERROR, N, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+
+#define llog_trace_sampled(P, ...) _llog_sampled(LLOG_TRACE, P, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_debug_sampled(P, ...) _llog_sampled(LLOG_DEBUG, P, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_info_sampled(P, ...)  _llog_sampled(LLOG_INFO, P, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_warn_sampled(P, ...)  _llog_sampled(LLOG_WARN, P, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+#define llog_error_sampled(P, ...) _llog_sampled(LLOG_ERROR, P, _FIRST_ARG(__VA_ARGS__) "%.0d", _BUTFIRST_ARGS(__VA_ARGS__))
+///@}
+
 /**
  * @brief If no default locking API was found this can be used to set a locking
  * mechanism.
@@ -117,8 +330,11 @@ int llog_set_lock(llog_lock lockfunc, void *lockobj);
 
 /**
  * @brief Enables quiet mode. When set to true, nothing is outputted to stderr.
+ *
+ * @retval 0 on success
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
  */
-void llog_set_quiet(bool quiet);
+int llog_set_quiet(bool quiet);
 
 /**
  * @brief Sets the log level. All logs below the provided @c level won't
@@ -132,6 +348,85 @@ void llog_set_quiet(bool quiet);
  */
 int llog_set_level(int level);
 
+/**
+ * @brief Sets the format of the timestamps written to @c stderr and to text files, and
+ * whether @c llog_event.time is in local time or UTC.
+ *
+ * @param flags one of @c LLOG_TIME_SECONDS, @c LLOG_TIME_MILLIS, @c LLOG_TIME_MICROS, or
+ * @c LLOG_TIME_NANOS, combined with @c LLOG_TIME_UTC and @c LLOG_TIME_ISO8601 (e.g.,
+ * @c LLOG_TIME_MICROS|LLOG_TIME_UTC|LLOG_TIME_ISO8601 writes 2024-01-31T12:34:56.789012Z)
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c flags is an invalid value
+ */
+int llog_set_time_format(int flags);
+
+/**
+ * @brief Limits how many events each call site can log: on average @c rate per second, and
+ * up to @c burst in a row. Events of level @c LLOG_FATAL are never limited.
+ *
+ * The number of events dropped is logged from the same call site before its next event, or by
+ * @c llog_flush.
+ *
+ * @param rate events per second and per call site, 0 to disable the limit
+ * @param burst events a call site can log in a row after being idle
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c burst is 0 while @c rate isn't, or either is too large
+ */
+int llog_set_rate_limit(unsigned long rate, unsigned long burst);
+
+/**
+ * @brief Drops the events identical (same call site, arguments and fields) to the last one
+ * logged from their call site less than @c window milliseconds before. Events of level
+ * @c LLOG_FATAL are never dropped.
+ *
+ * How many times an event was repeated is logged from the same call site before its next
+ * different event, or by @c llog_flush.
+ *
+ * @param window in milliseconds, 0 to log duplicates
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c window is too large
+ */
+int llog_set_dedup(unsigned long window);
+
+/**
+ * @brief Pushes a field onto the diagnostic context of the calling thread. Its events
+ * carry the context in @c llog_event.ctx, and text and JSON outputs write its fields
+ * before those of the event, until it is popped.
+ *
+ * @remark @c key and @c value are copied. Pushing and popping are thread-local: they
+ * don't lock nor allocate.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c key or @c value is null
+ * @retval -EOVERFLOW if the context is full
+ */
+int llog_ctx_push(const char *restrict key, const char *restrict value);
+
+/**
+ * @brief Pops the field pushed last onto the diagnostic context of the calling thread.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if the context is empty
+ */
+int llog_ctx_pop(void);
+
+/**
+ * @brief Pops every field of the diagnostic context of the calling thread.
+ */
+void llog_ctx_clear(void);
+
+/**
+ * @brief Names the calling thread in its diagnostic context (written as the thread field).
+ *
+ * @param name copied (and truncated if too long), or null to remove the name
+ *
+ * @retval 0 on success
+ */
+int llog_set_thread_name(const char *name);
+
 /**
  * @brief Adds a new callback function. The provided function can be callled with
  * the log data.
@@ -139,13 +434,31 @@ int llog_set_level(int level);
  * @retval 0 on success
  * @retval -EINVAL if an invalid argument is passed
  * @retval -EOVERFLOW if the number of callbacks reached its maximum
+ * @retval -ENOMEM if memory couldn't be allocated
  * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
  *
+ * @remark Each callback is called under its own lock, so a callback is never called
+ * concurrently with itself, but different callbacks can be called concurrently.
+ *
  * @warning Calling macros or functions of this module inside @a logfunc
  * will result in undefined behavior.
  */
 int llog_add_callback(llog_callback logfunc, void *logobj, int level);
 
+/**
+ * @brief Removes a callback function added with @c llog_add_callback. It can be
+ * called while other threads are logging: when it returns, @c logfunc is not being
+ * called with @c logobj anymore.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if no callback matches @c logfunc and @c logobj
+ * @retval -ENOMEM if memory couldn't be allocated
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ *
+ * @warning Calling it inside a callback will result in undefined behavior.
+ */
+int llog_remove_callback(llog_callback logfunc, void *logobj);
+
 /**
  * @brief Adds a new file pointer to which the log can be written.
  *
@@ -153,6 +466,462 @@ int llog_add_callback(llog_callback logfunc, void *logobj, int level);
  */
 int llog_add_fp(FILE *restrict fp, int level);
 
+/**
+ * @brief Removes a file pointer added with @c llog_add_fp or @c llog_add_binary_fp.
+ * When it returns, @c fp is not being written to anymore and can be closed.
+ *
+ * @return @see @c llog_remove_callback
+ */
+int llog_remove_fp(FILE *restrict fp);
+
+/**
+ * @brief Adds a file pointer to which the log is written in the compact binary format
+ * described in the README, which can be converted back to text by @c llog-decode.
+ *
+ * @return @see @c llog_add_callback
+ * @retval -ENOMEM if the sink couldn't be allocated
+ *
+ * @remark @c fp must be opened in binary mode. It is flushed after events of level
+ * @c LLOG_ERROR or above.
+ */
+int llog_add_binary_fp(FILE *restrict fp, int level);
+
+/**
+ * @brief Adds a file pointer to which the log is written as JSON lines, one object per
+ * event with its time (seconds since the Epoch), level, file, function, line, message,
+ * and the fields of structured events, e.g.:
+ *
+ * {"time":1706704496.123456789,"level":"INFO","file":"a.c","func":"f","line":7,"msg":"connected","conn":3}
+ *
+ * @return @see @c llog_add_callback
+ * @retval -ENOMEM if the sink couldn't be allocated
+ *
+ * @remark @c fp is flushed after events of level @c LLOG_ERROR or above.
+ */
+int llog_add_json_fp(FILE *restrict fp, int level);
+
+/**
+ * @brief Opens (or creates) the file at @c path and writes the log to it through a
+ * buffer, instead of issuing a write for each event like @c llog_add_fp.
+ *
+ * The buffer is written when it is full, after an event of level @c opts->flushlevel or
+ * above, when @c opts->interval elapsed since it was last written, after a @c LLOG_FATAL
+ * event, and at exit.
+ *
+ * With @c opts->maxsize or @c opts->period, the file is rotated when a write would make it
+ * larger than @c opts->maxsize, or when the first write after a multiple of @c opts->period
+ * comes (e.g., 86400 rotates at midnight UTC): it is renamed, a new file is opened in its
+ * place, and a background thread shifts the older files and compresses the rotated one if
+ * @c opts->compress is set. The oldest generation beyond @c opts->keep is deleted. Without
+ * threads, the logging call that rotates shifts the files itself, and doesn't compress them.
+ * The buffer is made no larger than @c opts->maxsize, so that only a single line longer than
+ * it makes a file exceed it.
+ *
+ * @param opts buffering and rotation options, or null for @c LLOG_FILE_DEFAULTS
+ *
+ * @return @see @c llog_add_callback
+ * @retval -errno if the file couldn't be opened
+ * @retval -EINVAL if @c opts->keep is 0 while the file is rotated
+ */
+int llog_add_file(const char *restrict path, int level, const llog_file_opts *restrict opts);
+
+/**
+ * @brief Removes the files added with @c llog_add_file for @c path, after writing their
+ * buffers, and closes them.
+ *
+ * @return @see @c llog_remove_callback
+ */
+int llog_remove_file(const char *restrict path);
+
+/**
+ * @brief Logs what the rate limit and the duplicate suppression dropped so far, writes the
+ * buffers of the files added with @c llog_add_file, and flushes the file pointers added with
+ * @c llog_add_fp or @c llog_add_binary_fp.
+ *
+ * @retval 0 on success
+ * @retval -EIO if a file couldn't be written
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ *
+ * @remark In asynchronous mode, events still waiting to be dispatched aren't written.
+ */
+int llog_flush(void);
+
+/**
+ * @brief Maps the file at @c path (created if needed) and uses it as a ring buffer of
+ * the last @c size bytes of the log, which survives a crash of the process (even by
+ * @c SIGKILL) and can be recovered with @c llog-decode.
+ *
+ * Logging threads don't lock the sink nor issue system calls: each event is formatted
+ * and copied into space reserved with an atomic increment. A file left by a previous
+ * run with the same size is kept, and new events follow its last ones.
+ *
+ * @param size size of the ring, in bytes (rounded up to a power of two, at least 64 KiB)
+ *
+ * @return @see @c llog_add_callback
+ * @retval -errno if the file couldn't be opened or mapped
+ *
+ * @remark Only available on POSIX systems; elsewhere it returns @c -EINVAL. Messages are
+ * truncated to @c LLOG_MMAP_MSG_SIZE bytes. The pages aren't synced to the disk, so the
+ * events may not survive a crash of the system.
+ */
+int llog_add_mmap(const char *restrict path, size_t size, int level);
+
+/**
+ * @brief Removes the ring files added with @c llog_add_mmap for @c path, and unmaps them.
+ *
+ * @return @see @c llog_remove_callback
+ */
+int llog_remove_mmap(const char *restrict path);
+
+/**
+ * @brief Sends the log to the socket at @c address, from a background thread, so that
+ * the logging threads never wait for the network.
+ *
+ * The address is one of:
+ *
+ * unix:/run/app.sock      Unix stream socket
+ * unixgram:/run/app.sock  Unix datagram socket
+ * tcp:host:port           TCP connection (an IPv6 host goes in brackets)
+ * udp:host:port           UDP datagrams
+ *
+ * Events are formatted into a buffer of @c opts->bufsize bytes, which the thread sends when
+ * it is half full or @c opts->interval elapsed, in a single write on stream sockets and one
+ * datagram per event otherwise. While the socket is unreachable, the events stay in the
+ * buffer and the thread reconnects with an exponential backoff (up to 30 seconds); the
+ * events that don't fit in the buffer are dropped and counted (see @c llog_socket_dropped).
+ *
+ * On stream sockets, lines end with a newline, and syslog messages are framed by octet
+ * counting (RFC 6587). The buffers are sent by @c llog_flush and at exit.
+ *
+ * @param opts batching and framing options, or null for @c LLOG_SOCKET_DEFAULTS
+ *
+ * @return @see @c llog_add_callback
+ * @retval -EINVAL if the address is invalid
+ *
+ * @remark Only available on POSIX systems with threads; elsewhere it returns @c -EINVAL.
+ * Messages are truncated to @c LLOG_SOCKET_MSG_SIZE bytes.
+ */
+int llog_add_socket(const char *restrict address, int level, const llog_socket_opts *restrict opts);
+
+/**
+ * @brief Removes the sockets added with @c llog_add_socket for @c address, after sending
+ * their buffers, and closes them.
+ *
+ * @return @see @c llog_remove_callback
+ */
+int llog_remove_socket(const char *restrict address);
+
+/**
+ * @brief Returns the number of events the sockets added with @c llog_add_socket dropped
+ * so far, because their buffer was full or they couldn't be sent.
+ */
+unsigned long long llog_socket_dropped(void);
+
+#if !defined(LLOG_STATS_NAME_SIZE)
+#  define LLOG_STATS_NAME_SIZE 256U
+#endif
+
+/**
+ * @brief Counters of an output, see @c llog_get_stats.
+ */
+typedef struct {
+    const char *kind;        ///< "stderr", "callback", "fp", "json", "binary", "file", "mmap" or "socket"
+    const llog_logger *logger; ///< Logger of the output, null for the default one
+    const void *id;          ///< @c logobj of a callback, or the @c FILE pointer of the file pointers
+    char name[LLOG_STATS_NAME_SIZE]; ///< Path of a file or ring file, or address of a socket
+    int level;
+    unsigned long long events;       ///< Events the output accepted
+    unsigned long long bytes;        ///< Bytes llog produced for it (0 for callbacks)
+    unsigned long long nanoseconds;  ///< Time spent in its callback, while timings are enabled
+    unsigned long long lockwait;     ///< Time spent waiting for its lock, in nanoseconds, likewise
+} llog_sink_stats;
+
+/**
+ * @brief Counters of the logging functions, added up over all the threads.
+ */
+typedef struct {
+    unsigned long long events[LLOG_FATAL + 1]; ///< Events logged, per level
+    unsigned long long filtered;     ///< Events that no output accepted
+    unsigned long long limited;      ///< Events dropped by the rate limit or the duplicate suppression
+    unsigned long long asyncdropped; ///< @see @c llog_async_dropped
+    unsigned long long socketdropped; ///< @see @c llog_socket_dropped
+    unsigned long long lockwait;     ///< Time spent waiting for the global lock, in nanoseconds
+} llog_stats;
+
+/**
+ * @brief Takes a snapshot of the counters of llog, and of its outputs if @c nsinks is not
+ * null.
+ *
+ * Events are counted once they pass the lowest level of the outputs, which the logging
+ * macros check without calling into llog. The counters are kept per thread and only added
+ * up here, so that counting costs next to nothing; the counters of a thread survive it,
+ * those of an output are lost with it.
+ *
+ * @param sinks array receiving the counters of the outputs, stderr first, then those of the
+ * default logger and those of the other loggers
+ * @param nsinks on input, the size of @c sinks; on output, the number of outputs, which may
+ * be larger (only the first ones are described then)
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c stats is null, or @c sinks is null while @c *nsinks is not 0
+ */
+int llog_get_stats(llog_stats *restrict stats, llog_sink_stats *restrict sinks, size_t *restrict nsinks);
+
+/**
+ * @brief Enables or disables the measurement of the time spent in the outputs and waiting
+ * for locks, which costs a few clock readings per output and event (off by default).
+ */
+void llog_set_stats_timing(bool enabled);
+
+/**
+ * @name Output levels.
+ * @brief Change the level of outputs already added (matched like in the removal functions),
+ * while other threads are logging.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c level is an invalid value or no such output was added
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ */
+///@{
+int llog_set_callback_level(llog_callback logfunc, void *logobj, int level);
+int llog_set_fp_level(FILE *restrict fp, int level);
+int llog_set_file_level(const char *restrict path, int level);
+int llog_set_mmap_level(const char *restrict path, int level);
+int llog_set_socket_level(const char *restrict address, int level);
+///@}
+
+/**
+ * @brief Creates a logger named @c name, for a library or a subsystem to log with its own
+ * level and outputs through the @c llog_logger_ macros, independently of the default
+ * logger the other macros log with.
+ *
+ * Loggers form a hierarchy by their dotted names: the parent of "net.http" is the logger
+ * named "net" if there is one, and otherwise the default logger, whatever the order they
+ * were created in. A logger takes the level of its parent until it is given one (see
+ * @c llog_logger_set_level), and its events also go to the outputs of its ancestors, up to
+ * the default logger and @c stderr, unless it isn't additive (see @c llog_logger_set_additive).
+ * Outputs only check their own level: the level of an ancestor doesn't filter the events of
+ * its descendants.
+ *
+ * @param logger receives the logger
+ * @param name non-empty dotted name, not used by another logger
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c name is invalid or already used
+ * @retval -ENOMEM if memory couldn't be allocated
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ */
+int llog_logger_create(llog_logger **logger, const char *name);
+
+/**
+ * @brief Removes a logger and its outputs. Its children take its parent as theirs.
+ *
+ * When it returns, no thread is using the logger anymore, except threads logging with it,
+ * which must not. In asynchronous mode, the events the calling thread logged with it are
+ * dispatched first; those of other threads not yet dispatched are discarded.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c logger is null
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ */
+int llog_logger_destroy(llog_logger *logger);
+
+/**
+ * @brief Sets the level below which the logger discards its events, or @c LLOG_INHERIT
+ * for the level of its parent (the default, @c LLOG_TRACE for the top-level loggers).
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c logger is null or @c level is an invalid value
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ */
+int llog_logger_set_level(llog_logger *logger, int level);
+
+/**
+ * @brief Tells whether the events of the logger also go to the outputs of its ancestors
+ * (true by default).
+ *
+ * @return @see @c llog_logger_set_level
+ */
+int llog_logger_set_additive(llog_logger *logger, bool additive);
+
+/**
+ * @brief Returns the name of a logger, or a null pointer for the default one.
+ */
+const char *llog_logger_name(const llog_logger *logger);
+
+/**
+ * @name Logger outputs.
+ * @brief Add outputs to a logger, remove them and set their level, like the functions of
+ * the same name without @c logger_ do for the default logger (which a null @c logger
+ * stands for).
+ *
+ * @return @see @c llog_add_callback, @c llog_remove_callback, @c llog_set_callback_level
+ */
+///@{
+int llog_logger_add_callback(llog_logger *logger, llog_callback logfunc, void *logobj, int level);
+int llog_logger_remove_callback(llog_logger *logger, llog_callback logfunc, void *logobj);
+int llog_logger_set_callback_level(llog_logger *logger, llog_callback logfunc, void *logobj, int level);
+int llog_logger_add_fp(llog_logger *logger, FILE *restrict fp, int level);
+int llog_logger_remove_fp(llog_logger *logger, FILE *restrict fp);
+int llog_logger_set_fp_level(llog_logger *logger, FILE *restrict fp, int level);
+int llog_logger_add_binary_fp(llog_logger *logger, FILE *restrict fp, int level);
+int llog_logger_add_json_fp(llog_logger *logger, FILE *restrict fp, int level);
+int llog_logger_add_file(llog_logger *logger, const char *restrict path, int level,
+                         const llog_file_opts *restrict opts);
+int llog_logger_remove_file(llog_logger *logger, const char *restrict path);
+int llog_logger_set_file_level(llog_logger *logger, const char *restrict path, int level);
+int llog_logger_add_mmap(llog_logger *logger, const char *restrict path, size_t size, int level);
+int llog_logger_remove_mmap(llog_logger *logger, const char *restrict path);
+int llog_logger_set_mmap_level(llog_logger *logger, const char *restrict path, int level);
+int llog_logger_add_socket(llog_logger *logger, const char *restrict address, int level,
+                           const llog_socket_opts *restrict opts);
+int llog_logger_remove_socket(llog_logger *logger, const char *restrict address);
+int llog_logger_set_socket_level(llog_logger *logger, const char *restrict address, int level);
+///@}
+
+/**
+ * @brief Applies a configuration: settings of the form name=value, separated by spaces,
+ * commas, semicolons or newlines, with comments from # to the end of the line.
+ *
+ * level=debug            level of stderr (see @c llog_set_level)
+ * quiet=true             quiet mode (see @c llog_set_quiet)
+ * file:app.log=trace     level of a file added with @c llog_add_file
+ * mmap:app.ring=info     level of a ring file added with @c llog_add_mmap
+ * socket:udp:host:514=warn  level of a socket added with @c llog_add_socket
+ * logger:net.http=debug  level of a logger (see @c llog_logger_set_level), or inherit
+ * logger:net.http/file:http.log=trace  level of an output of a logger, named like the
+ *                        outputs above (the name of the logger ends at the first slash)
+ *
+ * Levels are named trace, debug, info, warn, error or fatal, in any case.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if a setting is invalid (the valid ones are applied)
+ * @retval -ENOMEM if the configuration couldn't be copied
+ */
+int llog_configure(const char *spec);
+
+/**
+ * @brief Applies the configuration in the file named by the @c LLOG_CONFIG_FILE environment
+ * variable, then the one in the @c LLOG_CONFIG environment variable, if they are set.
+ *
+ * @return @see @c llog_configure
+ * @retval -errno if the file couldn't be read
+ */
+int llog_reload(void);
+
+/**
+ * @brief Reloads the configuration (see @c llog_reload) when the process receives the
+ * signal @c signo, e.g., @c SIGHUP.
+ *
+ * @remark The signal handler only raises a flag and wakes a background thread, which reloads
+ * right away (within 100 milliseconds without POSIX). Without threads, the next event logged does.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if the handler couldn't be installed
+ */
+int llog_reload_on_signal(int signo);
+
+/**
+ * @brief Keeps the last events of each thread in memory, from @c level up whatever the
+ * levels of the outputs, for @c llog_dump_recorder to write them after a crash.
+ *
+ * Nothing is formatted: an event is recorded as its call site, timestamp and packed
+ * arguments (see @c llog_format_packed), in a ring of @c nevents records of its thread,
+ * allocated on the first event the thread logs. Events of a level below every output are
+ * recorded and discarded without being dispatched.
+ *
+ * @param nevents records per thread (rounded up to a power of two), or 0 to stop recording
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if @c level is an invalid value, or @c nevents differs from the size
+ * set by a previous call
+ * @retval -ELOCK if an error occurred in the locking/unlocking mechanism
+ *
+ * @remark Only available on POSIX systems; elsewhere it returns @c -EINVAL. Arguments are
+ * truncated to @c LLOG_RECORDER_ARGS_SIZE bytes, and the fields of structured events aren't
+ * recorded.
+ */
+int llog_start_recorder(size_t nevents, int level);
+
+/**
+ * @brief Writes the events kept by the recorder to the file descriptor @c fd, one line per
+ * event and oldest first for each thread, starting with the calling thread.
+ *
+ * It is async-signal-safe: it only reads memory and calls @c write(2), so it can be called
+ * from a signal handler, even while the process is logging. Timestamps are in UTC. The
+ * width and the flags of the conversions are ignored, and floating-point numbers are
+ * written in fixed-point notation.
+ *
+ * @retval 0 on success
+ * @retval -EIO if the events couldn't be written
+ * @retval -EINVAL if the recorder isn't available
+ */
+int llog_dump_recorder(int fd);
+
+/**
+ * @brief Installs a handler of @c SIGSEGV, @c SIGBUS, @c SIGILL, @c SIGFPE and @c SIGABRT
+ * that writes the events kept by the recorder to @c fd (see @c llog_dump_recorder), then
+ * lets the signal terminate the process with its default action.
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if the handler couldn't be installed
+ */
+int llog_dump_on_crash(int fd);
+
+/**
+ * @brief Formats arguments captured in the deferred (packed) representation used by the
+ * asynchronous mode, the same way @c snprintf would format them with @c format.
+ *
+ * @param buf where the null-terminated message is written. Can be null if @c size is 0
+ * @param size size of @c buf
+ * @param format the format string the arguments were captured for
+ * @param args the packed arguments
+ * @param len number of bytes in @c args
+ *
+ * @return the number of characters that would have been written if @c size were large
+ * enough, not counting the terminating null character
+ * @retval -EINVAL if @c args doesn't match @c format or @c format isn't supported
+ */
+int llog_format_packed(char *restrict buf, size_t size, const char *restrict format,
+                       const void *restrict args, size_t len);
+
+#if defined(LLOG_HAS_THREADS_)
+/**
+ * @brief Switches to asynchronous mode. From now on, each logging thread copies its
+ * events into its own lock-free ring buffer of @c capacity events, and a background
+ * thread formats and dispatches them to @c stderr and the registered callbacks.
+ *
+ * Formatting is deferred: a logging thread only records the call site, the time, and
+ * a binary copy of the arguments (see @c llog_format_packed).
+ *
+ * @param capacity number of events buffered per thread (rounded up to a power of two).
+ * It applies to the buffers of threads that haven't logged in asynchronous mode yet.
+ * @param policy what to do when a thread's buffer is full. One of @c LLOG_ASYNC_BLOCK,
+ * @c LLOG_ASYNC_DROP_NEWEST, or @c LLOG_ASYNC_DROP_OLDEST
+ *
+ * @retval 0 on success
+ * @retval -EINVAL if an invalid argument is passed or asynchronous mode is already on
+ * @retval -ENOMEM if the background thread couldn't be created
+ *
+ * @remark Arguments are truncated to @c LLOG_ASYNC_ARGS_SIZE bytes. A @c LLOG_FATAL
+ * event only returns after it has been dispatched. Pending events are flushed at exit.
+ */
+int llog_start_async(size_t capacity, int policy);
+
+/**
+ * @brief Flushes the pending events, stops the background thread, and goes back to
+ * synchronous logging.
+ *
+ * @retval 0 on success
+ */
+int llog_stop_async(void);
+
+/**
+ * @brief Number of events discarded by the overflow policy since the program started.
+ */
+unsigned long long llog_async_dropped(void);
+#endif
+
 /*
  * These are not required by the Standard.
  *
@@ -181,6 +950,18 @@ int llog_add_fp(FILE *restrict fp, int level);
 #    error "ELOCK constant is too large."
 #  endif
 #endif
+#if !defined(ENOMEM)
+#  define ENOMEM (ELOCK + EFAULT - EOF + ERANGE)
+#  if (ENOMEM >= INT_MAX)
+#    error "ENOMEM constant is too large."
+#  endif
+#endif
+#if !defined(EIO)
+#  define EIO (ENOMEM + EFAULT - EOF + EDOM)
+#  if (EIO >= INT_MAX)
+#    error "EIO constant is too large."
+#  endif
+#endif
 
 /*
  * Extracts the first argument from __VA_ARGS__
@@ -193,18 +974,107 @@ int llog_add_fp(FILE *restrict fp, int level);
 #define _BUTFIRST_ARGS(...) _BUTFIRST_ARGS_AUX(__VA_ARGS__, 0)
 #define _BUTFIRST_ARGS_AUX(_first, ...) __VA_ARGS__
 
-#define _llog_with_context(LVL, F, ...) _llog_log(LVL, __FILE__, __func__, __LINE__+0UL, "" F "", __VA_ARGS__)
+#define _llog_with_context(LVL, F, ...)                                                   \
+    ((LVL) >= LLOG_MIN_LEVEL && _llog_enabled(LVL)                                        \
+     ? _llog_log(LVL, __FILE__, __func__, __LINE__+0UL, "" F "", __VA_ARGS__) : 0)
+
+/*
+ * Lowest level accepted by stderr or a callback, kept up to date by the configuration
+ * functions so that filtered calls don't reach _llog_log.
+ */
+extern atomic_int _llog_threshold;
+
+static inline bool _llog_enabled(int level)
+{
+    return level >= atomic_load_explicit(&_llog_threshold, memory_order_relaxed);
+}
 
 int _llog_log(int level, const char *restrict file, const char *restrict func,
               unsigned long line, const char *restrict format, ...);
 
-/**
- * @warning This is NOT thread-safe.
+/*
+ * Whether the call is one of the 1 in n counted by calls. An n of 1 or less samples every call.
  */
+static inline bool _llog_nth_call(atomic_ulong *calls, long long n)
+{
+    return n <= 1 || atomic_fetch_add_explicit(calls, 1, memory_order_relaxed) % (unsigned long long) n == 0;
+}
+
+#define _llog_every_n(LVL, N, F, ...)                                                     \
+    do {                                                                                  \
+        static atomic_ulong _llog_calls;                                                  \
+        if ((LVL) >= LLOG_MIN_LEVEL && _llog_enabled(LVL) && _llog_nth_call(&_llog_calls, (N))) { \
+            (void) _llog_log(LVL, __FILE__, __func__, __LINE__+0UL, "" F "", __VA_ARGS__); \
+        }                                                                                 \
+    } while (0)
+
+#define _llog_sampled(LVL, P, F, ...)                                                     \
+    ((LVL) >= LLOG_MIN_LEVEL && _llog_enabled(LVL) && _llog_sample(P)                     \
+     ? _llog_log(LVL, __FILE__, __func__, __LINE__+0UL, "" F "", __VA_ARGS__) : 0)
+
+/*
+ * State of the xorshift64* generator of the calling thread, seeded on first use.
+ */
+extern LLOG_TLS_ unsigned long long _llog_random;
+
+unsigned long long _llog_seed(void);
+
+static inline bool _llog_sample(double p)
+{
+    unsigned long long x = _llog_random ? _llog_random : _llog_seed();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    _llog_random = x;
+    /* The top 53 bits, uniform in [0, 1). */
+    return (double) ((x * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53 < p;
+}
+
+/*
+ * The fields are passed as an array; sizeof doesn't evaluate them a second time.
+ */
+#define _llog_kv_with_context(LVL, M, ...)                                                \
+    ((LVL) >= LLOG_MIN_LEVEL && _llog_enabled(LVL)                                        \
+     ? _llog_log_kv(LVL, __FILE__, __func__, __LINE__+0UL, M,                             \
+                    (const llog_kv[]){ __VA_ARGS__ },                                     \
+                    sizeof((llog_kv[]){ __VA_ARGS__ }) / sizeof(llog_kv)) : 0)
+
+int _llog_log_kv(int level, const char *restrict file, const char *restrict func, unsigned long line,
+                 const char *restrict msg, const llog_kv *kv, size_t nkv);
+
+#define _llog_logger_with_context(L, LVL, F, ...)                                         \
+    ((LVL) >= LLOG_MIN_LEVEL && _llog_logger_enabled(L, LVL)                              \
+     ? _llog_logger_log(L, LVL, __FILE__, __func__, __LINE__+0UL, "" F "", __VA_ARGS__) : 0)
+
+#define _llog_logger_kv_with_context(L, LVL, M, ...)                                      \
+    ((LVL) >= LLOG_MIN_LEVEL && _llog_logger_enabled(L, LVL)                              \
+     ? _llog_logger_log_kv(L, LVL, __FILE__, __func__, __LINE__+0UL, M,                   \
+                           (const llog_kv[]){ __VA_ARGS__ },                              \
+                           sizeof((llog_kv[]){ __VA_ARGS__ }) / sizeof(llog_kv)) : 0)
+
+/*
+ * A logger starts with its threshold, on a cache line of its own: the lowest level accepted
+ * by its outputs and those of its ancestors, or by its level if higher.
+ */
+static inline bool _llog_logger_enabled(const llog_logger *logger, int level)
+{
+    const atomic_int *threshold = logger ? (const atomic_int *) (const void *) logger : &_llog_threshold;
+    return level >= atomic_load_explicit((atomic_int *) threshold, memory_order_relaxed);
+}
+
+int _llog_logger_log(const llog_logger *logger, int level, const char *restrict file, const char *restrict func,
+                     unsigned long line, const char *restrict format, ...);
+
+int _llog_logger_log_kv(const llog_logger *logger, int level, const char *restrict file,
+                        const char *restrict func, unsigned long line, const char *restrict msg,
+                        const llog_kv *kv, size_t nkv);
+
+struct tm *_llog_tm(time_t second);
+
 static inline void _llog_event_context(llog_event event[static 1], void *logobj)
 {
-    time_t now = time(0);
-    event->time = localtime(&now);
+    timespec_get(&event->stamp, TIME_UTC);
+    event->time = _llog_tm(event->stamp.tv_sec);
     event->logobj = logobj;
 }
 
@@ -1,22 +1,97 @@
 /**
  * @file example.c
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "memstats.h"
 
+/*
+ * Samples every 10 ms while the process grows for a second, then prints the summary of its RSS and the
+ * samples as CSV.
+ */
+static int sample(void)
+{
+    struct memstats_sampler *sampler = memstats_sampler_start(10UL, 256U);
+    if (!sampler) {
+        perror("memstats_sampler_start");
+        return EXIT_FAILURE;
+    }
+
+    char *blocks[100] = { 0 };
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = malloc(1 << 20);
+        if (blocks[i]) memset(blocks[i], i, 1 << 20);
+        nanosleep(&(struct timespec){ .tv_nsec = 10000000L }, (void *) 0);
+    }
+
+    struct memstats_summary rss;
+    if (!memstats_sampler_summary(sampler, MEMSTATS_VMRSS, 0UL, &rss) && rss.count) {
+        printf("VmRSS over %zu samples: min %lld kB, mean %.0f kB, p50 %lld kB, p99 %lld kB, max %lld kB\n",
+               rss.count, rss.min, rss.mean, rss.p50, rss.p99, rss.max);
+    }
+    memstats_sampler_csv(sampler, stdout);
+    memstats_sampler_stop(sampler);
+
+    for (int i = 0; i < 100; i++) free(blocks[i]);
+    return EXIT_SUCCESS;
+}
+
+static void pressure(int measure, int level, long long value, void *arg)
+{
+    (void) arg;
+    static const char *const levels[] = { "normal", "soft", "hard" };
+    printf("%s %s at %lld kB\n", measure == MEMSTATS_WATCH_RSS ? "RSS" : "available", levels[level], value);
+}
+
+/*
+ * Watches the RSS while the process grows by 100 MB then shrinks back, with thresholds 40 and 80 MB above
+ * where it starts.
+ */
+static int watch(void)
+{
+    struct memstats_watchdog *watchdog = memstats_watchdog_start(10UL);
+    if (!watchdog) {
+        perror("memstats_watchdog_start");
+        return EXIT_FAILURE;
+    }
+    long long rss = memstats_memused();
+    if (memstats_watchdog_add(watchdog, MEMSTATS_WATCH_RSS, rss + 40 * 1024, rss + 80 * 1024, 10 * 1024,
+                              pressure, (void *) 0)) {
+        perror("memstats_watchdog_add");
+        memstats_watchdog_stop(watchdog);
+        return EXIT_FAILURE;
+    }
+
+    char *blocks[100] = { 0 };
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = malloc(1 << 20);
+        if (blocks[i]) memset(blocks[i], i, 1 << 20);
+        nanosleep(&(struct timespec){ .tv_nsec = 5000000L }, (void *) 0);
+    }
+    for (int i = 99; i >= 0; i--) {
+        free(blocks[i]);
+        nanosleep(&(struct timespec){ .tv_nsec = 5000000L }, (void *) 0);
+    }
+    nanosleep(&(struct timespec){ .tv_nsec = 50000000L }, (void *) 0);
+    memstats_watchdog_stop(watchdog);
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
     if (argc == 2) {
-        if (strlen(argv[1]) != 2 || argv[1][0] != '-' || argv[1][1] != 'm') {
-            fprintf(stderr, "Usage:\n%s [-m]\n", argv[0]);
+        if (strlen(argv[1]) != 2 || argv[1][0] != '-' || !strchr("msw", argv[1][1])) {
+            fprintf(stderr, "Usage:\n%s [-m | -s | -w]\n", argv[0]);
             return EXIT_FAILURE;
         }
+        if (argv[1][1] == 's') return sample();
+        if (argv[1][1] == 'w') return watch();
     }
     else if (argc > 2) {
-        fprintf(stderr, "Usage:\n%s [-m]\n", argv[0]);
+        fprintf(stderr, "Usage:\n%s [-m | -s | -w]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
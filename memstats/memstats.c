@@ -55,16 +55,28 @@
  *           Dennis Trujillo         dptrujillo@lanl.gov, dptru10@gmail.com
  *
  */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <sys/time.h>
 #include <sys/types.h>
-#include <sys/sysctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #ifdef __APPLE_CC__
+#include <sys/resource.h>
+#include <sys/sysctl.h>
 #include <mach/mach_host.h>
 #include <mach/task.h>
 #endif
@@ -75,9 +87,237 @@
 
 #include "memstats.h"
 
-pid_t pid;
-FILE *statfp    = (void *) 0;
-FILE *meminfofp = (void *) 0;
+#ifndef __APPLE_CC__
+/*
+ * The fields come early in their files, and lines cut by the end of the buffer are ignored.
+ */
+#define MEMSTATS_BUFSIZE 4096
+
+/*
+ * Descriptors of /proc/self/status, /proc/meminfo, /proc/self/statm and /proc/self/smaps_rollup (-1 before
+ * Linux 4.14), kept open: the kernel regenerates a /proc file for each read from its start, so a reading is
+ * a single pread, which threads can do concurrently. Opened in a given generation of the process (see
+ * handle_files), since /proc/self is resolved at open time.
+ */
+struct procfiles {
+    unsigned generation;
+    int statusfd;
+    int meminfofd;
+    int statmfd;
+    int rollupfd;
+};
+#endif
+
+/*
+ * A handle only holds its current procfiles, replaced as a whole when the process changed.
+ */
+struct memstats_handle {
+#ifndef __APPLE_CC__
+    _Atomic(struct procfiles *) files;
+#else
+    char unused;
+#endif
+};
+
+#ifndef __APPLE_CC__
+/*
+ * Number of fork() calls the process descends from, counted by the child handler of pthread_atfork.
+ */
+static atomic_uint generation;
+
+static void count_fork(void)
+{
+    atomic_fetch_add_explicit(&generation, 1, memory_order_relaxed);
+}
+
+static void register_fork_handler(void)
+{
+    pthread_atfork((void *) 0, (void *) 0, count_fork);
+}
+
+static struct procfiles *files_open(unsigned gen)
+{
+    struct procfiles *files = malloc(sizeof *files);
+    if (!files) return (void *) 0;
+
+    files->generation = gen;
+    files->statusfd  = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+    files->meminfofd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    files->statmfd   = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    files->rollupfd  = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if (files->statusfd < 0 || files->meminfofd < 0 || files->statmfd < 0) {
+        int err = errno;
+        if (files->statusfd >= 0) close(files->statusfd);
+        if (files->meminfofd >= 0) close(files->meminfofd);
+        if (files->statmfd >= 0) close(files->statmfd);
+        if (files->rollupfd >= 0) close(files->rollupfd);
+        free(files);
+        errno = err;
+        return (void *) 0;
+    }
+    return files;
+}
+
+static void files_close(struct procfiles *files)
+{
+    close(files->statusfd);
+    close(files->meminfofd);
+    close(files->statmfd);
+    if (files->rollupfd >= 0) close(files->rollupfd);
+}
+
+/*
+ * Returns the descriptors of the handle for the calling process, reopening them in a child after fork(),
+ * where the inherited ones still show the parent. A fork is detected by the generation the atfork handler
+ * increments, which costs an atomic load where getpid() would be a system call. Only the thread that
+ * installs the new ones closes the old ones: every thread of the child sees that their generation is not
+ * its own, so none reads them. Their memory is left to threads that may still be checking it.
+ */
+static struct procfiles *handle_files(struct memstats_handle *h)
+{
+    unsigned gen = atomic_load_explicit(&generation, memory_order_relaxed);
+    struct procfiles *files = atomic_load_explicit(&h->files, memory_order_acquire);
+
+    while (!files || files->generation != gen) {
+        struct procfiles *fresh = files_open(gen);
+        if (!fresh) return (void *) 0;
+        if (atomic_compare_exchange_strong_explicit(&h->files, &files, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            if (files) files_close(files);
+            return fresh;
+        }
+        /* Another thread installed its own meanwhile. */
+        files_close(fresh);
+        free(fresh);
+    }
+    return files;
+}
+
+/*
+ * Scans the "Key:   value kB" lines of a /proc file in a single pass, and stores the value of each of
+ * the n keys in values. Returns the number of keys found; the values of the others are left alone.
+ */
+static int scan_fields(const char *buf, size_t len, const char *const keys[], long long values[], int n)
+{
+    const char *end = buf + len;
+    int found = 0;
+
+    for (const char *p = buf; p < end && found < n;) {
+        const char *eol = memchr(p, '\n', (size_t) (end - p));
+        if (!eol) break;
+        const char *colon = memchr(p, ':', (size_t) (eol - p));
+        if (colon) {
+            size_t keylen = (size_t) (colon - p);
+            for (int i = 0; i < n; i++) {
+                if (strncmp(keys[i], p, keylen) || keys[i][keylen]) continue;
+
+                const char *q = colon + 1;
+                while (q < eol && (*q == ' ' || *q == '\t')) q++;
+                long long value = 0LL;
+                for (; q < eol && *q >= '0' && *q <= '9'; q++) value = value * 10 + (*q - '0');
+                values[i] = value;
+                found++;
+                break;
+            }
+        }
+        p = eol + 1;
+    }
+    return found;
+}
+
+/*
+ * Reads the n fields keys of the /proc file open on fd. Returns the number of fields found, or -1 if the
+ * file couldn't be read.
+ */
+static int proc_scan(int fd, const char *const keys[], long long values[], int n)
+{
+    char buf[MEMSTATS_BUFSIZE];
+
+    ssize_t len;
+    do {
+        len = pread(fd, buf, sizeof buf, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) return -1;
+
+    return scan_fields(buf, (size_t) len, keys, values, n);
+}
+
+/*
+ * Like proc_scan, but returns 0, or -1 if the file couldn't be read or a field is missing.
+ */
+static int proc_fields(int fd, const char *const keys[], long long values[], int n)
+{
+    int found = proc_scan(fd, keys, values, n);
+    if (found < 0) return -1;
+    if (found != n) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+static int read_status(struct memstats_handle *h, const char *const keys[], long long values[], int n)
+{
+    struct procfiles *files = handle_files(h);
+    return files ? proc_fields(files->statusfd, keys, values, n) : -1;
+}
+
+static int read_meminfo(struct memstats_handle *h, const char *const keys[], long long values[], int n)
+{
+    struct procfiles *files = handle_files(h);
+    return files ? proc_fields(files->meminfofd, keys, values, n) : -1;
+}
+#endif
+
+struct memstats_handle *memstats_open(void)
+{
+    struct memstats_handle *h = malloc(sizeof *h);
+    if (!h) return (void *) 0;
+
+#ifndef __APPLE_CC__
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, register_fork_handler);
+    struct procfiles *files = files_open(atomic_load_explicit(&generation, memory_order_relaxed));
+    if (!files) {
+        free(h);
+        return (void *) 0;
+    }
+    atomic_init(&h->files, files);
+#endif
+    return h;
+}
+
+void memstats_close(struct memstats_handle *h)
+{
+    if (!h) return;
+
+#ifndef __APPLE_CC__
+    struct procfiles *files = atomic_load_explicit(&h->files, memory_order_relaxed);
+    if (files) files_close(files);
+    free(files);
+#endif
+    free(h);
+}
+
+/*
+ * The handle of the functions without one, opened on first use and shared by the threads.
+ */
+static _Atomic(struct memstats_handle *) defaulthandle;
+
+static struct memstats_handle *default_handle(void)
+{
+    struct memstats_handle *h = atomic_load_explicit(&defaulthandle, memory_order_acquire);
+    if (h) return h;
+
+    struct memstats_handle *fresh = memstats_open();
+    if (!fresh) return (void *) 0;
+    if (!atomic_compare_exchange_strong_explicit(&defaulthandle, &h, fresh,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        memstats_close(fresh);
+        return h;
+    }
+    return fresh;
+}
 
 long long memstats_memused(void)
 {
@@ -99,53 +339,14 @@ long long memstats_memused(void)
      */
     struct task_basic_info tinfo;
     mach_msg_type_number_t tinfocount = TASK_BASIC_INFO_COUNT;
-    task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t) &tinfo, &tinfocount);
-
-    memcurrent = tinfo.resident_size;
-#else
-    char procstatfile[50];
-    int memdebug = 0;
-
-    if (!statfp) {
-        pid = getpid();
-        sprintf(procstatfile, "/proc/%d/status", pid);
-        statfp = fopen(procstatfile, "r");
-        if (!statfp) {
-            return -1LL;
-        }
-    }
-
-    int err = fflush(statfp);
-    if (err) {
-        fprintf(stderr, "fflush %s failed: %s\n", procstatfile, strerror(err));
-        return -1LL;
-    }
-
-    err = fseek(statfp, 0L, 0);
-    if (err) {
-        fprintf(stderr, "fseek %s failed: %s\n", procstatfile, strerror(err));
+    if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t) &tinfo, &tinfocount) != KERN_SUCCESS) {
         return -1LL;
     }
 
-    char *str = malloc(140 * sizeof *str);
-    while (!feof(statfp)) {
-        str = fgets(str, 132, statfp);
-        if (!str) fprintf(stderr, "Warning: Error in reading %s for memory stats\n", procstatfile);
-
-        char *p = strtok(str, ":");
-        if (!strcmp(p, "VmRSS")) {
-            p = strtok('\0', " ");
-            p = strtok('\0', " ");
-
-            memcurrent = strtoll(p, (void *) 0, 10); // * 1024
-            if (memdebug) printf("VmRSS %lld\n", memcurrent);
-            break;
-        }
-    }
-    free(str);
-
-    fclose(statfp);
-    statfp = (void *) 0;
+    memcurrent = (long long) tinfo.resident_size / 1024;
+#else
+    struct memstats_handle *h = default_handle();
+    if (!h || read_status(h, (const char *const[]){ "VmRSS" }, &memcurrent, 1)) return -1LL;
 #endif
 
     return memcurrent;
@@ -154,49 +355,15 @@ long long memstats_memused(void)
 long long memstats_mempeak(void)
 {
     long long memcurrent = 0LL;
-    char procstatfile[50];
-    int memdebug = 0;
-
-    if (!statfp) {
-        pid = getpid();
-        sprintf(procstatfile, "/proc/%d/status", pid);
-        statfp = fopen(procstatfile, "r");
-        if (!statfp) {
-            return -1LL;
-        }
-    }
-
-    int err = fflush(statfp);
-    if (err) {
-        fprintf(stderr, "fflush %s failed: %s\n", procstatfile, strerror(err));
-        return -1LL;
-    }
-
-    err = fseek(statfp, 0L, 0);
-    if (err) {
-        fprintf(stderr, "fseek %s failed: %s\n", procstatfile, strerror(err));
-        return -1LL;
-    }
-
-    char *str = malloc(140 * sizeof *str);
-    while (!feof(statfp)) {
-        str = fgets(str, 132, statfp);
-        if (!str) fprintf(stderr, "Warning: Error in reading %s for memory stats\n", procstatfile);
 
-        char *p = strtok(str, ":");
-        if (!strcmp(p, "VmHWM")) {
-            p = strtok('\0', " ");
-            p = strtok('\0', " ");
-
-            memcurrent = strtoll(p, (void *) 0, 10);
-            if (memdebug) printf("VmHWM %lld\n", memcurrent);
-            break;
-        }
-    }
-    free(str);
-
-    fclose(statfp);
-    statfp = (void *) 0;
+#ifdef __APPLE_CC__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return -1LL;
+    memcurrent = usage.ru_maxrss / 1024;
+#else
+    struct memstats_handle *h = default_handle();
+    if (!h || read_status(h, (const char *const[]){ "VmHWM" }, &memcurrent, 1)) return -1LL;
+#endif
 
     return memcurrent;
 }
@@ -218,102 +385,792 @@ long long memstats_memfree(void)
 
     freemem = vmstat.free_count * pagesize / 1024;
 #else
-    char buf[260];
-    int memdebug = 0;
+    struct memstats_handle *h = default_handle();
+    if (!h || read_meminfo(h, (const char *const[]){ "MemFree" }, &freemem, 1)) return -1LL;
+#endif
 
-    freemem = -1LL;
+    return freemem;
+}
 
-    if (!meminfofp) {
-        meminfofp = fopen("/proc/meminfo", "r");
-        if (!meminfofp) {
-            fprintf(stderr, "fopen failed: \n");
-            return -1LL;
-        }
+long long memstats_memtotal(void)
+{
+    long long totalmem = 0LL;
+
+#ifdef __APPLE_CC__
+    int mib[2] = { [0] = CTL_HW, [1] = HW_MEMSIZE };
+    size_t length = sizeof totalmem;
+    sysctl(mib, 2, &totalmem, &length, (void *) 0, 0);
+    totalmem /= 1024;
+#else
+    struct memstats_handle *h = default_handle();
+    if (!h || read_meminfo(h, (const char *const[]){ "MemTotal" }, &totalmem, 1)) return -1LL;
+#endif
+
+    return totalmem;
+}
+
+int memstats_read(struct memstats_handle *h, struct memstats *stats)
+{
+    if (!h || !stats) {
+        errno = EINVAL;
+        return -1;
     }
 
-    int err = fflush(meminfofp);
-    if (err) {
-        fprintf(stderr, "fflush failed: %s\n", strerror(err));
-        return -1LL;
+#ifdef __APPLE_CC__
+    stats->used  = memstats_memused();
+    stats->peak  = memstats_mempeak();
+    stats->free  = memstats_memfree();
+    stats->total = memstats_memtotal();
+    if (stats->used < 0 || stats->peak < 0 || stats->free < 0 || stats->total < 0) return -1;
+#else
+    long long status[2], meminfo[2];
+    struct procfiles *files = handle_files(h);
+    if (!files) return -1;
+    if (proc_fields(files->statusfd, (const char *const[]){ "VmRSS", "VmHWM" }, status, 2)) return -1;
+    if (proc_fields(files->meminfofd, (const char *const[]){ "MemFree", "MemTotal" }, meminfo, 2)) return -1;
+
+    stats->used  = status[0];
+    stats->peak  = status[1];
+    stats->free  = meminfo[0];
+    stats->total = meminfo[1];
+#endif
+
+    return 0;
+}
+
+int memstats_snapshot(struct memstats *stats)
+{
+    struct memstats_handle *h = default_handle();
+    return h ? memstats_read(h, stats) : -1;
+}
+
+/*
+ * Detailed figures, in bytes.
+ */
+#ifndef __APPLE_CC__
+/*
+ * Reads the n fields keys of a /proc file like proc_fields, and converts them from kB to bytes.
+ */
+static int proc_bytes(int fd, const char *const keys[], long long values[], int n)
+{
+    if (proc_fields(fd, keys, values, n)) return -1;
+    for (int i = 0; i < n; i++) values[i] *= 1024LL;
+    return 0;
+}
+#endif
+
+int memstats_read_statm(struct memstats_handle *h, struct memstats_statm *statm)
+{
+    if (!h || !statm) {
+        errno = EINVAL;
+        return -1;
     }
 
-    err = fseek(meminfofp, 0L, 0);
-    if (err) {
-        fprintf(stderr, "fseek failed: %s\n", strerror(err));
-        return -1LL;
+#ifdef __APPLE_CC__
+    errno = ENOSYS;
+    return -1;
+#else
+    struct procfiles *files = handle_files(h);
+    if (!files) return -1;
+
+    char buf[128];
+    ssize_t len;
+    do {
+        len = pread(files->statmfd, buf, sizeof buf, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) return -1;
+
+    /* size resident shared text lib data dt, in pages. */
+    long long pages[7] = { 0 };
+    int n = 0;
+    for (const char *p = buf, *end = buf + len; p < end && n < 7; n++) {
+        while (p < end && *p == ' ') p++;
+        if (p == end || *p < '0' || *p > '9') break;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) pages[n] = pages[n] * 10 + (*p - '0');
+    }
+    if (n < 6) {
+        errno = ENOENT;
+        return -1;
     }
 
-    char *p;
-    while (!feof(meminfofp)) {
-        if (fgets(buf, 255, meminfofp)) {
-            p = strtok(buf, ":");
-            if (memdebug) printf("p: |%s|\n", p);
-            if (!strcmp(p, "MemFree")) {
-                p = strtok('\0', " ");
-                freemem = strtoll(p, (void *) 0, 10);
-                break;
-            }
-        }
+    long long pagesize = sysconf(_SC_PAGESIZE);
+    statm->size     = pages[0] * pagesize;
+    statm->resident = pages[1] * pagesize;
+    statm->file     = pages[2] * pagesize;
+    statm->anon     = (pages[1] - pages[2]) * pagesize;
+    statm->text     = pages[3] * pagesize;
+    statm->data     = pages[5] * pagesize;
+    return 0;
+#endif
+}
+
+int memstats_read_rollup(struct memstats_handle *h, struct memstats_rollup *rollup)
+{
+    if (!h || !rollup) {
+        errno = EINVAL;
+        return -1;
     }
 
-    fclose(meminfofp);
-    meminfofp = (void *) 0;
+#ifdef __APPLE_CC__
+    errno = ENOSYS;
+    return -1;
+#else
+    struct procfiles *files = handle_files(h);
+    if (!files) return -1;
+    if (files->rollupfd < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    static const char *const keys[] = {
+        "Rss", "Pss", "Pss_Anon", "Pss_File", "Pss_Shmem", "Shared_Clean", "Shared_Dirty", "Private_Clean",
+        "Private_Dirty", "Anonymous", "AnonHugePages", "Swap", "SwapPss", "Locked",
+    };
+    long long v[sizeof keys / sizeof keys[0]];
+    int n = (int) (sizeof keys / sizeof keys[0]);
+
+    /* The Pss_ lines only appeared in Linux 5.8. */
+    for (int i = 0; i < n; i++) v[i] = -1LL;
+    int found = proc_scan(files->rollupfd, keys, v, n);
+    if (found < 0) return -1;
+    for (int i = 0; i < n; i++) {
+        if (v[i] >= 0) v[i] *= 1024LL;
+    }
+    if (v[0] < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *rollup = (struct memstats_rollup){
+        .rss = v[0], .pss = v[1], .pss_anon = v[2], .pss_file = v[3], .pss_shmem = v[4],
+        .shared_clean = v[5], .shared_dirty = v[6], .private_clean = v[7], .private_dirty = v[8],
+        .anon = v[9], .anon_huge = v[10], .swap = v[11], .swap_pss = v[12], .locked = v[13],
+    };
+    return 0;
 #endif
+}
 
-    return freemem;
+int memstats_read_system(struct memstats_handle *h, struct memstats_system *system)
+{
+    if (!h || !system) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef __APPLE_CC__
+    long long total = memstats_memtotal(), free = memstats_memfree();
+    if (total < 0 || free < 0) return -1;
+    *system = (struct memstats_system){
+        .total = total * 1024LL, .free = free * 1024LL, .available = -1LL, .swaptotal = -1LL, .swapfree = -1LL,
+    };
+    return 0;
+#else
+    struct procfiles *files = handle_files(h);
+    if (!files) return -1;
+
+    long long v[5];
+    if (proc_bytes(files->meminfofd,
+                   (const char *const[]){ "MemTotal", "MemFree", "MemAvailable", "SwapTotal", "SwapFree" }, v, 5)) {
+        return -1;
+    }
+    *system = (struct memstats_system){
+        .total = v[0], .free = v[1], .available = v[2], .swaptotal = v[3], .swapfree = v[4],
+    };
+    return 0;
+#endif
 }
 
-long long memstats_memtotal(void)
+/*
+ * Sampler.
+ *
+ * The thread of a sampler reads every field at each interval into a ring of slots, which it alone writes.
+ * Readers copy slots without locking: each slot is a seqlock, whose sequence number is cleared while its
+ * sample is written and then set to the index of the sample plus one, so that a reader recognizes and
+ * skips a slot overwritten while being copied. The stop request goes through a condition variable, so
+ * that the thread sleeps between samples and still stops at once.
+ */
+static const char *const fieldnames[MEMSTATS_NFIELDS] = {
+    "VmPeak", "VmSize", "VmLck", "VmPin", "VmHWM", "VmRSS", "VmData", "VmStk", "VmExe", "VmLib", "VmPTE",
+    "VmSwap", "MemFree",
+};
+
+struct slot {
+    atomic_size_t seq;
+    atomic_llong time;
+    atomic_llong values[MEMSTATS_NFIELDS];
+};
+
+struct memstats_sampler {
+    struct memstats_handle *h;
+    long long interval;                 /* in nanoseconds */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;                           /* guarded by mutex */
+    atomic_size_t next;                 /* index of the next sample */
+    size_t capacity;
+    struct slot slots[];
+};
+
+static long long clock_ns(clockid_t clock)
 {
-    long long totalmem = 0LL;
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 #ifdef __APPLE_CC__
-    int mib[2] = { [0] = CTL_HW, [1] = HW_MEMSIZE };
-    size_t length = sizeof totalmem;
-    sysctl(mib, 2, &totalmem, &length, (void *) 0, 0);
-    totalmem /= 1024;
+#define SAMPLER_CLOCK CLOCK_REALTIME
 #else
-    char buf[260];
-    int memdebug = 0;
+#define SAMPLER_CLOCK CLOCK_MONOTONIC
+#endif
 
-    totalmem = -1LL;
+/*
+ * Reads every field, -1 for those that aren't available. Returns 0, or -1 if none is.
+ */
+static int sample_fields(struct memstats_handle *h, long long values[MEMSTATS_NFIELDS])
+{
+    for (int i = 0; i < MEMSTATS_NFIELDS; i++) values[i] = -1LL;
 
-    if (!meminfofp) {
-        meminfofp = fopen("/proc/meminfo", "r");
-        if (!meminfofp) {
-            fprintf(stderr, "fopen failed: \n");
-            return -1LL;
-        }
+#ifdef __APPLE_CC__
+    (void) h;
+    values[MEMSTATS_VMRSS]   = memstats_memused();
+    values[MEMSTATS_VMHWM]   = memstats_mempeak();
+    values[MEMSTATS_MEMFREE] = memstats_memfree();
+    return values[MEMSTATS_VMRSS] < 0 && values[MEMSTATS_MEMFREE] < 0 ? -1 : 0;
+#else
+    struct procfiles *files = handle_files(h);
+    if (!files) return -1;
+    int found = proc_scan(files->statusfd, fieldnames, values, MEMSTATS_MEMFREE);
+    int memfree = proc_scan(files->meminfofd, &fieldnames[MEMSTATS_MEMFREE], &values[MEMSTATS_MEMFREE], 1);
+    return found > 0 || memfree > 0 ? 0 : -1;
+#endif
+}
+
+static void sampler_record(struct memstats_sampler *s)
+{
+    long long values[MEMSTATS_NFIELDS];
+    if (sample_fields(s->h, values)) return;
+
+    size_t i = atomic_load_explicit(&s->next, memory_order_relaxed);
+    struct slot *slot = &s->slots[i % s->capacity];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->time, clock_ns(CLOCK_REALTIME), memory_order_relaxed);
+    for (int k = 0; k < MEMSTATS_NFIELDS; k++) {
+        atomic_store_explicit(&slot->values[k], values[k], memory_order_relaxed);
     }
+    atomic_store_explicit(&slot->seq, i + 1, memory_order_release);
+    atomic_store_explicit(&s->next, i + 1, memory_order_release);
+}
 
-    int err = fflush(meminfofp);
-    if (err) {
-        fprintf(stderr, "fflush failed: %s\n", strerror(err));
-        return -1LL;
+static void *sampler_run(void *arg)
+{
+    struct memstats_sampler *s = arg;
+    long long deadline = clock_ns(SAMPLER_CLOCK);
+
+    pthread_mutex_lock(&s->mutex);
+    while (!s->stop) {
+        pthread_mutex_unlock(&s->mutex);
+        sampler_record(s);
+        pthread_mutex_lock(&s->mutex);
+
+        /* A late sample doesn't make the next ones come in a burst. */
+        long long now = clock_ns(SAMPLER_CLOCK);
+        deadline += s->interval;
+        if (deadline < now) deadline = now;
+        struct timespec ts = { .tv_sec = deadline / 1000000000LL, .tv_nsec = deadline % 1000000000LL };
+        while (!s->stop && pthread_cond_timedwait(&s->cond, &s->mutex, &ts) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return (void *) 0;
+}
+
+struct memstats_sampler *memstats_sampler_start(unsigned long interval, size_t capacity)
+{
+    if (!interval || !capacity || capacity > (SIZE_MAX - sizeof(struct memstats_sampler)) / sizeof(struct slot)) {
+        errno = EINVAL;
+        return (void *) 0;
     }
 
-    err = fseek(meminfofp, 0L, 0);
+    struct memstats_sampler *s = calloc(1, sizeof *s + capacity * sizeof s->slots[0]);
+    if (!s) return (void *) 0;
+    s->h = memstats_open();
+    if (!s->h) {
+        free(s);
+        return (void *) 0;
+    }
+    s->interval = (long long) interval * 1000000LL;
+    s->capacity = capacity;
+    atomic_init(&s->next, 0);
+    for (size_t i = 0; i < capacity; i++) atomic_init(&s->slots[i].seq, 0);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __APPLE_CC__
+    pthread_condattr_setclock(&attr, SAMPLER_CLOCK);
+#endif
+    int err = pthread_mutex_init(&s->mutex, (void *) 0);
+    if (!err) {
+        err = pthread_cond_init(&s->cond, &attr);
+        if (err) pthread_mutex_destroy(&s->mutex);
+    }
+    pthread_condattr_destroy(&attr);
+    if (!err) {
+        err = pthread_create(&s->thread, (void *) 0, sampler_run, s);
+        if (err) {
+            pthread_cond_destroy(&s->cond);
+            pthread_mutex_destroy(&s->mutex);
+        }
+    }
     if (err) {
-        fprintf(stderr, "fseek failed: %s\n", strerror(err));
-        return -1LL;
+        memstats_close(s->h);
+        free(s);
+        errno = err;
+        return (void *) 0;
     }
+    return s;
+}
 
-    char *p;
-    while (!feof(meminfofp)) {
-        if (fgets(buf, 255, meminfofp)) {
-            p = strtok(buf, ":");
-            if (memdebug) printf("p: |%s|\n", p);
-            if (!strcmp(p, "MemTotal")) {
-                p = strtok('\0', " ");
-                totalmem = strtoll(p, (void *) 0, 10);
-                break;
+void memstats_sampler_stop(struct memstats_sampler *s)
+{
+    if (!s) return;
+
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, (void *) 0);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    memstats_close(s->h);
+    free(s);
+}
+
+size_t memstats_sampler_samples(struct memstats_sampler *s, struct memstats_sample *samples, size_t n)
+{
+    if (!s || !samples) return 0;
+
+    size_t next = atomic_load_explicit(&s->next, memory_order_acquire);
+    size_t avail = next < s->capacity ? next : s->capacity;
+    if (n > avail) n = avail;
+
+    size_t copied = 0;
+    for (size_t i = next - n; i < next; i++) {
+        struct slot *slot = &s->slots[i % s->capacity];
+        struct memstats_sample *out = &samples[copied];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != i + 1) continue;
+        out->time = atomic_load_explicit(&slot->time, memory_order_relaxed);
+        for (int k = 0; k < MEMSTATS_NFIELDS; k++) {
+            out->values[k] = atomic_load_explicit(&slot->values[k], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        /* Overwritten by a newer sample meanwhile. */
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != i + 1) continue;
+        copied++;
+    }
+    return copied;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of n sorted values.
+ */
+static long long percentile(const long long *sorted, size_t n, int p)
+{
+    size_t rank = ((size_t) p * n + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+int memstats_sampler_summary(struct memstats_sampler *s, int field, unsigned long window,
+                             struct memstats_summary *summary)
+{
+    if (!s || !summary || field < 0 || field >= MEMSTATS_NFIELDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct memstats_sample *samples = malloc(s->capacity * sizeof *samples);
+    long long *values = malloc(s->capacity * sizeof *values);
+    if (!samples || !values) {
+        free(samples);
+        free(values);
+        return -1;
+    }
+
+    size_t n = memstats_sampler_samples(s, samples, s->capacity);
+    long long since = n && window ? samples[n - 1].time - (long long) window * 1000000LL : 0;
+    size_t count = 0;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        if (samples[i].time < since || samples[i].values[field] < 0) continue;
+        values[count++] = samples[i].values[field];
+        sum += (double) samples[i].values[field];
+    }
+    free(samples);
+
+    *summary = (struct memstats_summary){ .count = count, };
+    if (count) {
+        qsort(values, count, sizeof *values, compare_values);
+        summary->min  = values[0];
+        summary->max  = values[count - 1];
+        summary->mean = sum / (double) count;
+        summary->p50  = percentile(values, count, 50);
+        summary->p90  = percentile(values, count, 90);
+        summary->p99  = percentile(values, count, 99);
+    }
+    free(values);
+    return 0;
+}
+
+int memstats_sampler_csv(struct memstats_sampler *s, FILE *fp)
+{
+    if (!s || !fp) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct memstats_sample *samples = malloc(s->capacity * sizeof *samples);
+    if (!samples) return -1;
+    size_t n = memstats_sampler_samples(s, samples, s->capacity);
+
+    fputs("time", fp);
+    for (int k = 0; k < MEMSTATS_NFIELDS; k++) fprintf(fp, ",%s", fieldnames[k]);
+    fputc('\n', fp);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(fp, "%lld.%09lld", samples[i].time / 1000000000LL, samples[i].time % 1000000000LL);
+        for (int k = 0; k < MEMSTATS_NFIELDS; k++) {
+            if (samples[i].values[k] < 0) fputc(',', fp);
+            else fprintf(fp, ",%lld", samples[i].values[k]);
+        }
+        fputc('\n', fp);
+    }
+    free(samples);
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * Watchdog.
+ *
+ * The thread of a watchdog sleeps in poll, on a pipe that wakes it up for new watches and for stopping, and
+ * on the pressure descriptors the kernel offers, with the interval as timeout. Whatever woke it up, it reads
+ * the measures and updates the level of every watch. The watches are a list under a mutex, which the thread
+ * holds while calling back, so that a removed watch is never called afterwards.
+ */
+struct watch {
+    struct watch *next;
+    int measure;
+    long long soft;
+    long long hard;
+    long long hysteresis;
+    int level;
+    memstats_watch_callback callback;
+    void *arg;
+};
+
+struct memstats_watchdog {
+    struct memstats_handle *h;
+    int interval;                       /* in milliseconds, for poll */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    struct watch *watches;              /* guarded by mutex */
+    int stop;                           /* guarded by mutex */
+    int wakefd[2];
+    int psifd;                          /* -1 if not available */
+    int eventsfd;                       /* -1 if not available */
+};
+
+/*
+ * Neither end blocks: the thread drains whatever was written, and a pipe already full still wakes it up.
+ */
+static int pipe_open(int fds[2])
+{
+    if (pipe(fds)) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+static void watchdog_wake(struct memstats_watchdog *w)
+{
+    ssize_t len;
+    do {
+        len = write(w->wakefd[1], "", 1);
+    } while (len < 0 && errno == EINTR);
+}
+
+#ifndef __APPLE_CC__
+/*
+ * Opens a trigger of /proc/pressure/memory, which reports when the tasks of the system stalled on memory for
+ * 100 ms within 2 s. Unprivileged processes may only create triggers whose window is a multiple of 2 s.
+ */
+static int psi_open(void)
+{
+    static const char trigger[] = "some 100000 2000000";
+    int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0 && write(fd, trigger, sizeof trigger) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*
+ * Opens the memory.events of the cgroup v2 of the process, whose counters of high, max and oom events the
+ * kernel notifies with POLLPRI.
+ */
+static int events_open(void)
+{
+    char buf[MEMSTATS_BUFSIZE];
+    int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (len <= 0) return -1;
+    buf[len] = 0;
+
+    /* The line of the unified hierarchy is "0::PATH". */
+    char *line = buf;
+    while (line && strncmp(line, "0::", 3)) {
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    if (!line) return -1;
+    char *end = strchr(line, '\n');
+    if (end) *end = 0;
+
+    char path[sizeof buf + 32];
+    snprintf(path, sizeof path, "/sys/fs/cgroup%s/memory.events", line + 3);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+#endif
+
+/*
+ * Reads the measures, -1 for those that aren't available.
+ */
+static void watchdog_measure(struct memstats_watchdog *w, long long values[2])
+{
+#ifdef __APPLE_CC__
+    (void) w;
+    values[MEMSTATS_WATCH_RSS]       = memstats_memused();
+    values[MEMSTATS_WATCH_AVAILABLE] = memstats_memfree();
+#else
+    static const char *const rss[] = { "VmRSS" }, *const available[] = { "MemAvailable", "MemFree" };
+    long long meminfo[2] = { -1LL, -1LL };
+    values[MEMSTATS_WATCH_RSS] = -1LL;
+    struct procfiles *files = handle_files(w->h);
+    if (!files) return;
+    proc_scan(files->statusfd, rss, &values[MEMSTATS_WATCH_RSS], 1);
+    proc_scan(files->meminfofd, available, meminfo, 2);
+    values[MEMSTATS_WATCH_AVAILABLE] = meminfo[0] >= 0 ? meminfo[0] : meminfo[1];
+#endif
+}
+
+/*
+ * Tells whether value reached threshold, or stays within slack of it, in the direction of pressure.
+ */
+static int watch_reached(int measure, long long value, long long threshold, long long slack)
+{
+    if (measure == MEMSTATS_WATCH_AVAILABLE) return value <= threshold + slack;
+    return value >= threshold - slack;
+}
+
+static int watch_level(const struct watch *watch, long long value)
+{
+    int level = MEMSTATS_LEVEL_NORMAL;
+    if (watch->soft && watch_reached(watch->measure, value, watch->soft,
+                                     watch->level >= MEMSTATS_LEVEL_SOFT ? watch->hysteresis : 0)) {
+        level = MEMSTATS_LEVEL_SOFT;
+    }
+    if (watch->hard && watch_reached(watch->measure, value, watch->hard,
+                                     watch->level >= MEMSTATS_LEVEL_HARD ? watch->hysteresis : 0)) {
+        level = MEMSTATS_LEVEL_HARD;
+    }
+    return level;
+}
+
+static void watchdog_check(struct memstats_watchdog *w)
+{
+    long long values[2];
+    watchdog_measure(w, values);
+    for (struct watch *watch = w->watches; watch; watch = watch->next) {
+        long long value = values[watch->measure];
+        if (value < 0) continue;
+        int level = watch_level(watch, value);
+        if (level == watch->level) continue;
+        watch->level = level;
+        watch->callback(watch->measure, level, value, watch->arg);
+    }
+}
+
+static void *watchdog_run(void *arg)
+{
+    struct memstats_watchdog *w = arg;
+    char buf[MEMSTATS_BUFSIZE];
+
+    pthread_mutex_lock(&w->mutex);
+    while (!w->stop) {
+        if (w->watches) watchdog_check(w);
+        pthread_mutex_unlock(&w->mutex);
+
+        struct pollfd fds[3] = {
+            { .fd = w->wakefd[0], .events = POLLIN, },
+            { .fd = w->psifd, .events = POLLPRI, },
+            { .fd = w->eventsfd, .events = POLLPRI, },
+        };
+        if (poll(fds, 3, w->interval) > 0) {
+            if (fds[0].revents) {
+                while (read(w->wakefd[0], buf, sizeof buf) > 0)
+                    ;
+            }
+            /* The trigger of a removed cgroup reports an error for good. */
+            if (fds[1].revents & (POLLERR | POLLNVAL)) {
+                close(w->psifd);
+                w->psifd = -1;
+            }
+            /* A notification of memory.events is only cleared by reading the file. */
+            if (fds[2].revents && pread(w->eventsfd, buf, sizeof buf, 0) < 0) {
+                close(w->eventsfd);
+                w->eventsfd = -1;
             }
         }
+
+        pthread_mutex_lock(&w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return (void *) 0;
+}
+
+struct memstats_watchdog *memstats_watchdog_start(unsigned long interval)
+{
+    if (!interval || interval > INT_MAX) {
+        errno = EINVAL;
+        return (void *) 0;
     }
 
-    fclose(meminfofp);
-    meminfofp = (void *) 0;
+    struct memstats_watchdog *w = calloc(1, sizeof *w);
+    if (!w) return (void *) 0;
+    w->interval = (int) interval;
+    w->h = memstats_open();
+    if (!w->h) {
+        free(w);
+        return (void *) 0;
+    }
+    if (pipe_open(w->wakefd)) {
+        int err = errno;
+        memstats_close(w->h);
+        free(w);
+        errno = err;
+        return (void *) 0;
+    }
+#ifdef __APPLE_CC__
+    w->psifd    = -1;
+    w->eventsfd = -1;
+#else
+    w->psifd    = psi_open();
+    w->eventsfd = events_open();
 #endif
 
-    return totalmem;
+    int err = pthread_mutex_init(&w->mutex, (void *) 0);
+    if (!err) {
+        err = pthread_create(&w->thread, (void *) 0, watchdog_run, w);
+        if (err) pthread_mutex_destroy(&w->mutex);
+    }
+    if (err) {
+        close(w->wakefd[0]);
+        close(w->wakefd[1]);
+        if (w->psifd >= 0) close(w->psifd);
+        if (w->eventsfd >= 0) close(w->eventsfd);
+        memstats_close(w->h);
+        free(w);
+        errno = err;
+        return (void *) 0;
+    }
+    return w;
+}
+
+void memstats_watchdog_stop(struct memstats_watchdog *w)
+{
+    if (!w) return;
+
+    pthread_mutex_lock(&w->mutex);
+    w->stop = 1;
+    pthread_mutex_unlock(&w->mutex);
+    watchdog_wake(w);
+    pthread_join(w->thread, (void *) 0);
+
+    while (w->watches) {
+        struct watch *watch = w->watches;
+        w->watches = watch->next;
+        free(watch);
+    }
+    pthread_mutex_destroy(&w->mutex);
+    close(w->wakefd[0]);
+    close(w->wakefd[1]);
+    if (w->psifd >= 0) close(w->psifd);
+    if (w->eventsfd >= 0) close(w->eventsfd);
+    memstats_close(w->h);
+    free(w);
+}
+
+int memstats_watchdog_add(struct memstats_watchdog *w, int measure, long long soft, long long hard,
+                          long long hysteresis, memstats_watch_callback callback, void *arg)
+{
+    if (!w || !callback || (measure != MEMSTATS_WATCH_RSS && measure != MEMSTATS_WATCH_AVAILABLE)
+        || soft < 0 || hard < 0 || (!soft && !hard) || hysteresis < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct watch *watch = malloc(sizeof *watch);
+    if (!watch) return -1;
+    *watch = (struct watch){
+        .measure = measure, .soft = soft, .hard = hard, .hysteresis = hysteresis,
+        .level = MEMSTATS_LEVEL_NORMAL, .callback = callback, .arg = arg,
+    };
+
+    pthread_mutex_lock(&w->mutex);
+    watch->next = w->watches;
+    w->watches = watch;
+    pthread_mutex_unlock(&w->mutex);
+    watchdog_wake(w);
+    return 0;
+}
+
+int memstats_watchdog_remove(struct memstats_watchdog *w, memstats_watch_callback callback, void *arg)
+{
+    if (!w || !callback) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int removed = 0;
+    pthread_mutex_lock(&w->mutex);
+    for (struct watch **at = &w->watches; *at;) {
+        struct watch *watch = *at;
+        if (watch->callback == callback && watch->arg == arg) {
+            *at = watch->next;
+            free(watch);
+            removed = 1;
+        }
+        else {
+            at = &watch->next;
+        }
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    if (!removed) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
 }
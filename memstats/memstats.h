@@ -58,16 +58,240 @@
 #ifndef MEMSTATS_H_
 #define MEMSTATS_H_ 1
 
+#include <stddef.h>
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+/*
+ * Memory figures, in kB (see memstats_snapshot).
+ */
+struct memstats {
+    long long used;     /* resident set size of the process (VmRSS) */
+    long long peak;     /* its high-water mark (VmHWM) */
+    long long free;     /* free memory of the system (MemFree) */
+    long long total;    /* total memory of the system (MemTotal) */
+};
+
+/*
+ * The fields of struct memstats one at a time, in kB on every platform, or -1 if they couldn't be read.
+ */
 long long memstats_memused(void);
 long long memstats_mempeak(void);
 long long memstats_memfree(void);
 long long memstats_memtotal(void);
 
+/*
+ * Descriptors of the files memstats reads, kept open between calls.
+ */
+struct memstats_handle;
+
+/*
+ * Opens a handle, or returns a null pointer with errno set. Threads can read through the same handle
+ * concurrently, without locking, and a child process can keep using the handles of its parent after
+ * fork(): they notice that the process changed and reopen its files.
+ */
+struct memstats_handle *memstats_open(void);
+
+/*
+ * Fills stats with one read of /proc/self/status and one of /proc/meminfo. Returns 0, or -1 with errno
+ * set if they couldn't be read.
+ */
+int memstats_read(struct memstats_handle *h, struct memstats *stats);
+
+/*
+ * Closes a handle, which no thread may be reading through anymore.
+ */
+void memstats_close(struct memstats_handle *h);
+
+/*
+ * Like memstats_read, with a handle shared by the functions without one, opened on first use.
+ */
+int memstats_snapshot(struct memstats *stats);
+
+/*
+ * Memory of the process from /proc/self/statm, in bytes: the cheapest breakdown.
+ */
+struct memstats_statm {
+    long long size;         /* virtual memory */
+    long long resident;     /* resident set */
+    long long file;         /* resident and file-backed or shared memory */
+    long long anon;         /* resident and anonymous */
+    long long text;         /* code */
+    long long data;         /* data and stack */
+};
+
+/*
+ * Memory of the process from /proc/self/smaps_rollup, in bytes, -1 for the lines the kernel doesn't have.
+ * Its read walks every mapping of the process, so it costs more as they grow.
+ */
+struct memstats_rollup {
+    long long rss;
+    long long pss;              /* proportional set size: shared pages count divided by their users */
+    long long pss_anon;
+    long long pss_file;
+    long long pss_shmem;
+    long long shared_clean;
+    long long shared_dirty;
+    long long private_clean;
+    long long private_dirty;
+    long long anon;             /* anonymous memory */
+    long long anon_huge;        /* anonymous memory backed by transparent huge pages */
+    long long swap;
+    long long swap_pss;
+    long long locked;
+};
+
+/*
+ * Memory of the system from /proc/meminfo, in bytes.
+ */
+struct memstats_system {
+    long long total;
+    long long free;
+    long long available;        /* estimate of what can be allocated without swapping (MemAvailable) */
+    long long swaptotal;
+    long long swapfree;
+};
+
+/*
+ * Fill the structure with one read of its file. Return 0, or -1 with errno set, to ENOSYS if the system
+ * doesn't provide it.
+ */
+int memstats_read_statm(struct memstats_handle *h, struct memstats_statm *statm);
+int memstats_read_rollup(struct memstats_handle *h, struct memstats_rollup *rollup);
+int memstats_read_system(struct memstats_handle *h, struct memstats_system *system);
+
+/*
+ * Fields of a sample, the Vm lines of /proc/self/status and MemFree of /proc/meminfo.
+ */
+enum {
+    MEMSTATS_VMPEAK = 0,
+    MEMSTATS_VMSIZE,
+    MEMSTATS_VMLCK,
+    MEMSTATS_VMPIN,
+    MEMSTATS_VMHWM,
+    MEMSTATS_VMRSS,
+    MEMSTATS_VMDATA,
+    MEMSTATS_VMSTK,
+    MEMSTATS_VMEXE,
+    MEMSTATS_VMLIB,
+    MEMSTATS_VMPTE,
+    MEMSTATS_VMSWAP,
+    MEMSTATS_MEMFREE,
+    MEMSTATS_NFIELDS
+};
+
+struct memstats_sample {
+    long long time;                         /* nanoseconds since the Epoch */
+    long long values[MEMSTATS_NFIELDS];     /* in kB, -1 if not available */
+};
+
+/*
+ * Summary of a field over a window of samples, in kB. Percentiles are nearest-rank.
+ */
+struct memstats_summary {
+    size_t count;       /* samples in the window, none of the others is set if 0 */
+    long long min;
+    long long max;
+    double mean;
+    long long p50;
+    long long p90;
+    long long p99;
+};
+
+/*
+ * A thread that samples every field into a ring of the last samples.
+ */
+struct memstats_sampler;
+
+/*
+ * Starts sampling every interval milliseconds, keeping the last capacity samples. Returns a null
+ * pointer with errno set if the sampler couldn't be started.
+ */
+struct memstats_sampler *memstats_sampler_start(unsigned long interval, size_t capacity);
+
+/*
+ * Stops the thread and frees the sampler, which no thread may be reading anymore.
+ */
+void memstats_sampler_stop(struct memstats_sampler *s);
+
+/*
+ * Copies the last n samples (at most), oldest first, and returns how many were copied. It doesn't lock
+ * nor wait for the sampler thread, so it can be called from any thread at any rate.
+ */
+size_t memstats_sampler_samples(struct memstats_sampler *s, struct memstats_sample *samples, size_t n);
+
+/*
+ * Summarizes a field (one of the MEMSTATS_ constants) over the samples of the last window milliseconds
+ * before the newest one, or over all the samples kept if window is 0. Returns 0, or -1 with errno set.
+ */
+int memstats_sampler_summary(struct memstats_sampler *s, int field, unsigned long window,
+                             struct memstats_summary *summary);
+
+/*
+ * Writes the samples kept as CSV, oldest first: a header line, then one line per sample with its time in
+ * seconds since the Epoch and its fields in kB (empty if not available). Returns 0, or -1 with errno set.
+ */
+int memstats_sampler_csv(struct memstats_sampler *s, FILE *fp);
+
+/*
+ * Measures a watchdog compares with its thresholds, in kB: the RSS of the process, which is under pressure
+ * at or above a threshold, and the memory available to the system (MemAvailable, or the free memory where
+ * it isn't known), which is under pressure at or below one.
+ */
+enum {
+    MEMSTATS_WATCH_RSS = 0,
+    MEMSTATS_WATCH_AVAILABLE
+};
+
+enum {
+    MEMSTATS_LEVEL_NORMAL = 0,
+    MEMSTATS_LEVEL_SOFT,
+    MEMSTATS_LEVEL_HARD
+};
+
+/*
+ * Called by the watchdog thread when the level of a watch changes, either way, with the measure that
+ * changed it.
+ */
+typedef void (*memstats_watch_callback)(int measure, int level, long long value, void *arg);
+
+/*
+ * A thread that checks the thresholds of its watches every interval, and as soon as the kernel reports
+ * memory pressure (through a trigger of /proc/pressure/memory, or the memory.events of the cgroup v2 of the
+ * process) where it can.
+ */
+struct memstats_watchdog;
+
+/*
+ * Starts checking every interval milliseconds. Returns a null pointer with errno set if the watchdog
+ * couldn't be started.
+ */
+struct memstats_watchdog *memstats_watchdog_start(unsigned long interval);
+
+/*
+ * Stops the thread and frees the watchdog with its watches.
+ */
+void memstats_watchdog_stop(struct memstats_watchdog *w);
+
+/*
+ * Watches a measure (one of the MEMSTATS_WATCH_ constants): its level becomes soft or hard once it reaches
+ * the threshold, and only goes back once it is hysteresis kB clear of it again. Either threshold may be 0
+ * for none. The watch starts at the normal level, and is checked at once. Returns 0, or -1 with errno set.
+ */
+int memstats_watchdog_add(struct memstats_watchdog *w, int measure, long long soft, long long hard,
+                          long long hysteresis, memstats_watch_callback callback, void *arg);
+
+/*
+ * Removes the watches of the callback with this argument. Once it returns, the callback isn't running nor
+ * called anymore. Callbacks run with the watches locked, so they must neither add nor remove watches.
+ * Returns 0, or -1 with errno set if there was none.
+ */
+int memstats_watchdog_remove(struct memstats_watchdog *w, memstats_watch_callback callback, void *arg);
+
 #ifdef __cplusplus
 }
 #endif